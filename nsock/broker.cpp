@@ -0,0 +1,461 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+#include <string.h>
+
+#include "nsock.h"
+#include "npoll.h"
+#include "util.h"
+#include "broker.h"
+#include "commandServer.h"
+
+
+using namespace std;
+using namespace nsock;
+using namespace npoll;
+
+
+string BrokerStat::toString() const {
+    stringstream ss;
+
+    ss << "{"
+       << "clientNr:" << clientNr << ", "
+       << "subscriptionNr:" << subscriptionNr << ", "
+       << "pubNr:" << pubNr << ", "
+       << "pubBytes:" << pubBytes << ", "
+       << "deliverNr:" << deliverNr << ", "
+       << "dropNr:" << dropNr << ", "
+       << "disconnectNr:" << disconnectNr << ", "
+       << "badCommandNr:" << badCommandNr
+       << "}";
+
+    return ss.str();
+}
+
+
+bool parseBrokerPolicy(const string &arg, BrokerPolicy &policy) {
+    if (arg == "drop") {
+        policy = BrokerDrop;
+    } else if (arg == "buffer") {
+        policy = BrokerBuffer;
+    } else if (arg == "disconnect") {
+        policy = BrokerDisconnect;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+
+vector<string_view> TopicTrie::split(const string &topic) {
+    vector<string_view> levels;
+    string_view rest(topic);
+
+    while (true) {
+        size_t slash = rest.find('/');
+        levels.push_back(rest.substr(0, slash));
+        if (slash == string_view::npos) {
+            break;
+        }
+        rest.remove_prefix(slash + 1);
+    }
+
+    return levels;
+}
+
+bool TopicTrie::validPattern(const string &pattern) {
+    if (pattern.empty()) {
+        return false;
+    }
+
+    auto levels = split(pattern);
+    for (size_t i = 0; i < levels.size(); i++) {
+        auto level = levels[i];
+        if (level == "#") {
+            if (i + 1 != levels.size()) {
+                return false;
+            }
+        } else if (level != "+" && level.find_first_of("+#") != string_view::npos) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool TopicTrie::validTopic(const string &topic) {
+    return !topic.empty() && topic.find_first_of("+#") == string::npos;
+}
+
+
+bool TopicTrie::subscribe(const string &pattern, BrokerClientPtr client) {
+    if (!validPattern(pattern)) {
+        return false;
+    }
+
+    Node *node = &root;
+    for (auto level : split(pattern)) {
+        auto &child = node->children[string(level)];
+        if (!child) {
+            child = make_unique<Node>();
+        }
+        node = child.get();
+    }
+
+    return node->clients.insert(client).second;
+}
+
+bool TopicTrie::unsubscribe(const string &pattern, BrokerClientPtr client) {
+    if (!validPattern(pattern)) {
+        return false;
+    }
+
+    // The path down, to prune the nodes left empty on the way back
+    vector<pair<Node *, string_view>> path;
+    Node *node = &root;
+    for (auto level : split(pattern)) {
+        auto it = node->children.find(level);
+        if (it == node->children.end()) {
+            return false;
+        }
+        path.emplace_back(node, level);
+        node = it->second.get();
+    }
+
+    if (node->clients.erase(client) == 0) {
+        return false;
+    }
+
+    while (!path.empty() && node->clients.empty() && node->children.empty()) {
+        auto [parent, level] = path.back();
+        path.pop_back();
+        parent->children.erase(parent->children.find(level));
+        node = parent;
+    }
+
+    return true;
+}
+
+
+size_t TopicTrie::countNodes(const Node &node) {
+    size_t nr = node.children.size();
+    for (auto &kv : node.children) {
+        nr += countNodes(*kv.second);
+    }
+
+    return nr;
+}
+
+
+void TopicTrie::collect(const Node &node, uint64_t seq, vector<BrokerClientPtr> &clients) {
+    for (auto &client : node.clients) {
+        if (client->matchSeq != seq) {
+            client->matchSeq = seq;
+            clients.push_back(client);
+        }
+    }
+}
+
+void TopicTrie::matchLevel(const Node &node, const vector<string_view> &levels,
+                           size_t level, uint64_t seq, vector<BrokerClientPtr> &clients) {
+    auto it = node.children.find(string_view("#"));
+    if (it != node.children.end()) {
+        collect(*it->second, seq, clients);
+    }
+
+    if (level == levels.size()) {
+        collect(node, seq, clients);
+        return;
+    }
+
+    it = node.children.find(levels[level]);
+    if (it != node.children.end()) {
+        matchLevel(*it->second, levels, level + 1, seq, clients);
+    }
+
+    it = node.children.find(string_view("+"));
+    if (it != node.children.end()) {
+        matchLevel(*it->second, levels, level + 1, seq, clients);
+    }
+}
+
+void TopicTrie::match(const string &topic, uint64_t seq, vector<BrokerClientPtr> &clients) const {
+    matchLevel(root, split(topic), 0, seq, clients);
+}
+
+
+BrokerServer::BrokerServer(BrokerPolicy policy, size_t bufferLimit, size_t maxLineLen) :
+    mPolicy(policy), mBufferLimit(bufferLimit), mMaxLineLen(maxLineLen) {
+}
+
+BrokerServer::~BrokerServer() {
+}
+
+
+BrokerServerPtr BrokerServer::createBrokerServer(string host, unsigned short port,
+                                                 BrokerPolicy policy, size_t bufferLimit,
+                                                 size_t maxLineLen) {
+    BrokerServerPtr server = make_shared<BrokerServer>(policy, bufferLimit, maxLineLen);
+
+    NSockOnConnectFunc connCb = [=] (NSockPtr sock) {
+        server->onConnect(sock);
+    };
+    server->mListenSock = NSock::listen(host, port, connCb);
+    if (!server->mListenSock) {
+        return nullptr;
+    }
+    printf("BrokerServer now listening on %s:%d\n", host.c_str(), port);
+
+    return server;
+}
+
+string BrokerServer::getBrokerStats() const {
+    stringstream ss;
+
+    ss << "{\n";
+    ss << "listenSocket: " << mListenSock->getStats().toString() << ",\n";
+    ss << "broker: " << mStat.toString() << "\n";
+    ss << "}\n";
+
+    return ss.str();
+}
+
+void BrokerServer::serverLoop() {
+    bool exit = false;
+
+    EofFunc eofCb = [&]() {
+        log("%s: Got EoF, exiting...\n", __FUNCTION__);
+        exit = true;
+    };
+
+    CommandServer cmdServer(eofCb);
+    auto self = shared_from_this();
+    auto getStatsCb = [=] (const NRequest &req) {
+        return self->getBrokerStats();
+    };
+
+    cmdServer.addCommand("get-stats", getStatsCb);
+
+    cmdServer.monitorStdin();
+
+    npollLoop(exit);
+
+    while (!mClients.empty()) {
+        auto client = mClients.begin()->second;
+        client->sock->destroy();
+        remove(client);
+    }
+
+    if (mListenSock) {
+        mListenSock->end();
+        mListenSock = nullptr;
+    }
+}
+
+
+void BrokerServer::remove(BrokerClientPtr client) {
+    if (mClients.erase(client->sock) == 0) {
+        return;
+    }
+
+    for (auto &pattern : client->patterns) {
+        mTopics.unsubscribe(pattern, client);
+    }
+    mStat.subscriptionNr -= client->patterns.size();
+    client->patterns.clear();
+    --mStat.clientNr;
+}
+
+
+void BrokerServer::reply(BrokerClientPtr client, const string &msg) {
+    string line = msg + "\n";
+    client->sock->send((const uint8_t *)line.data(), line.size());
+}
+
+
+/*
+ * Queue a message to a subscriber, as its policy allows.
+ */
+void BrokerServer::deliver(BrokerClientPtr client, const NBufSlice &msg) {
+    size_t queued = client->sock->getQueuedBytes();
+    bool fits;
+
+    switch (client->policy) {
+    case BrokerDrop:
+        // The replies queued to it don't count, only messages
+        fits = client->sock->getQueuedSharedBytes() == 0;
+        break;
+    default:
+        fits = queued + msg.size() <= client->bufferLimit;
+        break;
+    }
+
+    if (fits && client->sock->send(msg) > 0) {
+        ++client->deliverNr;
+        ++mStat.deliverNr;
+        return;
+    }
+
+    if (client->policy == BrokerDisconnect) {
+        log("%s: nsock %lu too slow with %lu bytes queued, disconnecting\n",
+            __FUNCTION__, client->sock->getId(), queued);
+        ++mStat.disconnectNr;
+        client->sock->destroy();
+        remove(client);
+        return;
+    }
+
+    ++client->dropNr;
+    ++mStat.dropNr;
+}
+
+void BrokerServer::publish(const string &topic, const uint8_t *payload, size_t payloadLen) {
+    ++mStat.pubNr;
+    mStat.pubBytes += payloadLen;
+
+    vector<BrokerClientPtr> clients;
+    mTopics.match(topic, ++mMatchSeq, clients);
+    if (clients.empty()) {
+        return;
+    }
+
+    // Built once, for all of them
+    string header = "MSG " + topic + " ";
+    auto msg = NBuffer::create(header.size() + payloadLen + 1, [&] (uint8_t *buf) {
+        memcpy(buf, header.data(), header.size());
+        memcpy(buf + header.size(), payload, payloadLen);
+        buf[header.size() + payloadLen] = '\n';
+    });
+
+    for (auto &client : clients) {
+        deliver(client, msg);
+    }
+}
+
+
+bool BrokerServer::onLine(BrokerClientPtr client, const uint8_t *line, size_t lineLen) {
+    string_view rest((const char *)line, lineLen);
+    auto word = [&] () {
+        size_t space = rest.find(' ');
+        string_view w = rest.substr(0, space);
+        rest.remove_prefix(space == string_view::npos ? rest.size() : space + 1);
+        return string(w);
+    };
+
+    string cmd = word();
+    if (cmd == "PUB") {
+        string topic = word();
+        if (!TopicTrie::validTopic(topic)) {
+            ++mStat.badCommandNr;
+            reply(client, "ERR bad topic");
+        } else {
+            publish(topic, (const uint8_t *)rest.data(), rest.size());
+        }
+
+    } else if (cmd == "SUB") {
+        string pattern = word();
+        if (!TopicTrie::validPattern(pattern)) {
+            ++mStat.badCommandNr;
+            reply(client, "ERR bad pattern");
+        } else if (!mTopics.subscribe(pattern, client)) {
+            reply(client, "ERR already subscribed");
+        } else {
+            client->patterns.insert(pattern);
+            ++mStat.subscriptionNr;
+            reply(client, "OK");
+        }
+
+    } else if (cmd == "UNSUB") {
+        string pattern = word();
+        if (!mTopics.unsubscribe(pattern, client)) {
+            reply(client, "ERR not subscribed");
+        } else {
+            client->patterns.erase(pattern);
+            --mStat.subscriptionNr;
+            reply(client, "OK");
+        }
+
+    } else if (cmd == "POLICY") {
+        string policy = word();
+        string limit = word();
+        size_t bufferLimit = mBufferLimit;
+        if (!limit.empty()) {
+            try {
+                bufferLimit = stoul(limit);
+            } catch (const exception &e) {
+                policy.clear();
+            }
+        }
+
+        if (!parseBrokerPolicy(policy, client->policy)) {
+            ++mStat.badCommandNr;
+            reply(client, "ERR bad policy");
+            return true;
+        }
+        client->bufferLimit = bufferLimit;
+        reply(client, "OK");
+
+    } else if (!cmd.empty()) {
+        ++mStat.badCommandNr;
+        reply(client, "ERR unknown command");
+    }
+
+    // A publish may have disconnected it, if it is subscribed itself
+    return client->sock->getState() != NSockClosed;
+}
+
+
+void BrokerServer::onSocketEnd(BrokerClientPtr client) {
+    log("%s: nsock peer done: nsockId=%lu\n", __FUNCTION__, client->sock->getId());
+
+    // The socket ends itself once its messages are flushed
+    remove(client);
+}
+
+void BrokerServer::onSocketError(BrokerClientPtr client, int error) {
+    log("%s: nsock error: nsockId=%lu, error=%d\n", __FUNCTION__,
+        client->sock->getId(), error);
+
+    client->sock->destroy();
+    remove(client);
+}
+
+void BrokerServer::onConnect(NSockPtr sock) {
+    log("%s: client nsock %lu connected\n", __FUNCTION__, sock->getId());
+
+    auto client = make_shared<BrokerClient>();
+    client->sock = sock;
+    client->policy = mPolicy;
+    client->bufferLimit = mBufferLimit;
+    mClients[sock] = client;
+    ++mStat.clientNr;
+
+    // The callbacks hold the client weakly: the sockets are held through it
+    auto self = shared_from_this();
+    weak_ptr<BrokerClient> weakClient = client;
+    NFrameFunc lineCb = [=] (NSockPtr sock, const uint8_t *line, size_t lineLen) {
+        auto client = weakClient.lock();
+        return client ? self->onLine(client, line, lineLen) : false;
+    };
+    NSockOnErrorFunc errorCb = [=] (NSockPtr sock, int error) {
+        auto client = weakClient.lock();
+        if (client) {
+            self->onSocketError(client, error);
+        }
+    };
+    NSockOnEndFunc endCb = [=] (NSockPtr sock) {
+        auto client = weakClient.lock();
+        if (client) {
+            self->onSocketEnd(client);
+        }
+    };
+
+    client->framer = make_shared<NLineFramer>(lineCb, mMaxLineLen);
+    client->framer->setErrorFn(errorCb);
+
+    sock->setRecvFn(client->framer->recvFn());
+    sock->setErrorFn(errorCb);
+    sock->setEndFn(endCb);
+}
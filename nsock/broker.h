@@ -0,0 +1,176 @@
+#ifndef _BROKER_H
+#define _BROKER_H
+
+#include <vector>
+#include <memory>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+
+#include "nsock.h"
+#include "nframer.h"
+#include "npoll.h"
+#include "util.h"
+
+
+/*
+ * A topic based pub/sub broker. Clients talk a line protocol:
+ *
+ *   SUB <pattern>                  -> OK | ERR <reason>
+ *   UNSUB <pattern>                -> OK | ERR <reason>
+ *   POLICY drop|buffer|disconnect [bytes]
+ *                                  -> OK | ERR <reason>
+ *   PUB <topic> <payload>          (no reply)
+ *
+ * and subscribers get "MSG <topic> <payload>" for each message published to a
+ * topic one of their patterns matches, once even if several do. Topics are
+ * levels split by '/'. In a pattern, '+' matches any one level, and '#', as
+ * the last level, any number of them (none too: "a/#" matches "a").
+ *
+ * A published message is built once, and queued to every subscriber as a
+ * shared buffer (NSock::send(NBufSlice)).
+ *
+ * A subscriber that reads slower than messages come in is handled by its
+ * policy. Drop delivers a message only if no earlier message is still queued
+ * to it, so at most one waits for it here. Buffer and disconnect count all the
+ * bytes queued to it, replies too, against its limit.
+ *
+ * brokerServer.cpp runs it as a server.
+ */
+
+enum BrokerPolicy {
+    BrokerDrop = 0,         // skip messages while an earlier one is queued
+    BrokerBuffer,           // queue up to a limit, skip messages past it
+    BrokerDisconnect        // queue up to a limit, disconnect past it
+};
+
+/* "drop", "buffer" or "disconnect"; false for anything else */
+bool parseBrokerPolicy(const std::string &arg, BrokerPolicy &policy);
+
+struct BrokerStat {
+    uint64_t clientNr = 0;
+    uint64_t subscriptionNr = 0;
+    uint64_t pubNr = 0;
+    uint64_t pubBytes = 0;
+    uint64_t deliverNr = 0;
+    uint64_t dropNr = 0;
+    uint64_t disconnectNr = 0;
+    uint64_t badCommandNr = 0;
+
+    std::string toString() const;
+};
+
+class BrokerClient;
+typedef std::shared_ptr<BrokerClient> BrokerClientPtr;
+
+class BrokerClient {
+public:
+    nsock::NSockPtr sock;
+    nsock::NFramerPtr framer;
+
+    std::set<std::string> patterns;
+
+    BrokerPolicy policy = BrokerDrop;
+    size_t bufferLimit = 0;
+
+    // The last fan-out that matched it, to deliver once per message
+    uint64_t matchSeq = 0;
+
+    uint64_t deliverNr = 0;
+    uint64_t dropNr = 0;
+};
+
+
+/*
+ * The subscriptions, a node per pattern level. Matching a topic walks the
+ * exact level, '+' and '#' branches of each node it reaches.
+ */
+class TopicTrie {
+public:
+    /* Return false if the pattern is not valid, or already subscribed */
+    bool subscribe(const std::string &pattern, BrokerClientPtr client);
+    bool unsubscribe(const std::string &pattern, BrokerClientPtr client);
+
+    /* The clients subscribed to topic, each once */
+    void match(const std::string &topic, uint64_t seq,
+               std::vector<BrokerClientPtr> &clients) const;
+
+    static bool validPattern(const std::string &pattern);
+    static bool validTopic(const std::string &topic);
+
+    /* The nodes below the root; unsubscribing prunes the ones left empty */
+    size_t nodeNr() const {
+        return countNodes(root);
+    }
+
+private:
+    struct Node {
+        std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+        std::set<BrokerClientPtr> clients;
+    };
+
+    static std::vector<std::string_view> split(const std::string &topic);
+    static size_t countNodes(const Node &node);
+
+    static void collect(const Node &node, uint64_t seq,
+                        std::vector<BrokerClientPtr> &clients);
+    static void matchLevel(const Node &node, const std::vector<std::string_view> &levels,
+                           size_t level, uint64_t seq,
+                           std::vector<BrokerClientPtr> &clients);
+
+    Node root;
+};
+
+
+class BrokerServer;
+typedef std::shared_ptr<BrokerServer> BrokerServerPtr;
+
+class BrokerServer : public std::enable_shared_from_this<BrokerServer> {
+public:
+    BrokerServer(BrokerPolicy policy, size_t bufferLimit, size_t maxLineLen);
+    ~BrokerServer();
+
+    static BrokerServerPtr createBrokerServer(std::string host, unsigned short port,
+                                              BrokerPolicy policy=BrokerDrop,
+                                              size_t bufferLimit=1024*1024,
+                                              size_t maxLineLen=64*1024);
+    void serverLoop();
+    std::string getBrokerStats() const;
+
+    nsock::NSockPtr getListenSock() const {
+        return mListenSock;
+    }
+
+    const BrokerStat &getStats() const {
+        return mStat;
+    }
+
+private:
+    /* The socket callbacks */
+    void onConnect(nsock::NSockPtr sock);
+    bool onLine(BrokerClientPtr client, const uint8_t *line, size_t lineLen);
+    void onSocketEnd(BrokerClientPtr client);
+    void onSocketError(BrokerClientPtr client, int error);
+
+    void publish(const std::string &topic, const uint8_t *payload, size_t payloadLen);
+    void deliver(BrokerClientPtr client, const nsock::NBufSlice &msg);
+    void reply(BrokerClientPtr client, const std::string &msg);
+
+    /* Forget a client and its subscriptions */
+    void remove(BrokerClientPtr client);
+
+    BrokerPolicy mPolicy;
+    size_t mBufferLimit;
+    size_t mMaxLineLen;
+
+    nsock::NSockPtr mListenSock;
+    std::map<nsock::NSockPtr, BrokerClientPtr> mClients;
+    TopicTrie mTopics;
+    uint64_t mMatchSeq = 0;
+
+    BrokerStat mStat;
+};
+
+
+#endif
@@ -0,0 +1,67 @@
+#include <iostream>
+
+#include <getopt.h>
+
+#include "npoll.h"
+#include "util.h"
+#include "broker.h"
+
+
+using namespace std;
+using namespace nsock;
+using namespace npoll;
+
+
+int main(int argc, char *argv[]) {
+    string host = "localhost";
+    unsigned short port = 12123;
+    BrokerPolicy policy = BrokerDrop;
+    size_t bufferLimit = 1024 * 1024;
+    size_t maxLineLen = 64 * 1024;
+
+    auto usage = [&] () {
+        printf("%s: [-h host] [-p port] [-c drop|buffer|disconnect] [-n bufferBytes] "
+               "[-l maxLineBytes]\n", argv[0]);
+        return -1;
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:n:l:")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = stoi(optarg);
+            break;
+        case 'c':
+            if (!parseBrokerPolicy(optarg, policy)) {
+                return usage();
+            }
+            break;
+        case 'n':
+            bufferLimit = stoul(optarg);
+            break;
+        case 'l':
+            maxLineLen = stoul(optarg);
+            break;
+        default:
+            return usage();
+        }
+    }
+
+    logSetPath("/tmp/nsock/brokerServer");
+
+    log("%s: starting...\n", argv[0]);
+
+    BrokerServerPtr server = BrokerServer::createBrokerServer(host, port, policy,
+                                                              bufferLimit, maxLineLen);
+    if (!server) {
+        printf("Failed to listen on %s:%d\n", host.c_str(), port);
+        return -1;
+    }
+
+    server->serverLoop();
+
+    cout << "Good bye\n";
+}
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <algorithm>
 
+#include <getopt.h>
+
 #include "nsock.h"
 #include "npoll.h"
 #include "util.h"
@@ -21,7 +23,9 @@ ConnServer::~ConnServer() {
 }
 
 
-ConnServerPtr ConnServer::createConnServer(std::string host, unsigned short port) {
+ConnServerPtr ConnServer::createConnServer(std::string host, unsigned short port,
+                                           std::string unixPath, uint64_t idleTimeoutMs,
+                                           size_t maxConnections, bool shedIdle) {
     ConnServerPtr server = make_shared<ConnServer>(host, port);
 
     NSockOnConnectFunc connCb = [=] (NSockPtr sock) {
@@ -30,6 +34,19 @@ ConnServerPtr ConnServer::createConnServer(std::string host, unsigned short port
     server->mListenSock = NSock::listen(host, port, connCb);
     printf("ConnServer now listening on %s:%d\n", host.c_str(), port);
 
+    // Accepted connections get the listener's deadlines
+    server->mListenSock->setTimeouts(idleTimeoutMs, 0, 0);
+    server->mListenSock->setMaxConnections(maxConnections, shedIdle);
+
+    // Optionally serve the same echo over a unix domain socket, e.g. to
+    // compare it with loopback TCP.
+    if (!unixPath.empty()) {
+        server->mUnixListenSock = NSock::listenUnix(unixPath, connCb);
+        server->mUnixListenSock->setTimeouts(idleTimeoutMs, 0, 0);
+        server->mUnixListenSock->setMaxConnections(maxConnections, shedIdle);
+        printf("ConnServer now listening on %s\n", unixPath.c_str());
+    }
+
     server->serverLoop();
 
     return server;
@@ -41,6 +58,9 @@ string ConnServer::getConnStats() const {
     auto stat = mListenSock->getStats();
     ss << "{\n";
     ss << "listenSocket: " << stat.toString() << ",\n";
+    if (mUnixListenSock) {
+        ss << "unixListenSocket: " << mUnixListenSock->getStats().toString() << ",\n";
+    }
     ss << "connections: [";
     bool first = true;
     for (auto &conn : mConnections) {
@@ -83,6 +103,11 @@ void ConnServer::serverLoop() {
         mListenSock->end();
         mListenSock = nullptr;
     }
+
+    if (mUnixListenSock) {
+        mUnixListenSock->end();
+        mUnixListenSock = nullptr;
+    }
 }
 
 
@@ -93,16 +118,14 @@ size_t ConnServer::onSocketRecv(NSockPtr sock, const uint8_t *buf, int recvLen)
     int n = sock->send(buf, recvLen);
     if (n < 0) {
         log("%s: socket send error: %d\n", __FUNCTION__, n);
-        sock->end();
+        mConnections.erase(sock);
+        sock->destroy();
         return 0;
     }
 
     if (n < recvLen) {
         log("%s: socket send buffer full, pausing receive\n", __FUNCTION__, n);
-        sock->setRecvFn(nullptr);
-
-        assert(!mRecvPaused);
-        mRecvPaused = true;
+        sock->pause();
     }
 
     return n;
@@ -113,21 +136,32 @@ void ConnServer::onSocketDrain(NSockPtr sock) {
         sock->getId());
 
     // Rearm receive if needed
-    if (mRecvPaused) {
-        auto self = shared_from_this();
-        NSockOnRecvFunc recvCb = [=] (NSockPtr sock, const uint8_t *buf, int bufLen) {
-            return self->onSocketRecv(sock, buf, bufLen);
-        };
-
-        mRecvPaused = false;
-        sock->setRecvFn(recvCb);
+    if (sock->isPaused()) {
+        sock->resume();
     }
 }
 
+void ConnServer::onSocketTimeout(NSockPtr sock, NSockTimeout type) {
+    log("%s: nsock timed out: nsockId=%lu, type=%d\n", __FUNCTION__,
+        sock->getId(), type);
+    mConnections.erase(sock);
+    sock->end();
+}
+
 void ConnServer::onSocketError(NSockPtr sock, int error) {
     log("%s: nsock error: nsockId=%lu, error=%d\n", __FUNCTION__,
         sock->getId(), error);
-    sock->end();
+
+    // Nothing left to flush to a broken connection
+    sock->destroy();
+}
+
+void ConnServer::onSocketEnd(NSockPtr sock) {
+    log("%s: nsock peer done: nsockId=%lu\n", __FUNCTION__,
+        sock->getId());
+
+    // The socket ends itself once the echoes are flushed
+    mConnections.erase(sock);
 }
 
 void ConnServer::onConnect(NSockPtr sock) {
@@ -146,21 +180,65 @@ void ConnServer::onConnect(NSockPtr sock) {
     };
     sock->setErrorFn(errorCb);
 
+    NSockOnEndFunc endCb = [=] (NSockPtr sock) {
+        self->onSocketEnd(sock);
+    };
+    sock->setEndFn(endCb);
+
     NSockOnDrainFunc drainCb = [=] (NSockPtr sock) {
         self->onSocketDrain(sock);
     };
     sock->setDrainFn(drainCb);
+
+    NSockOnTimeoutFunc timeoutCb = [=] (NSockPtr sock, NSockTimeout type) {
+        self->onSocketTimeout(sock, type);
+    };
+    sock->setTimeoutFn(timeoutCb);
 }
 
 
 int main(int argc, char *argv[]) {
-    // TODO getopt
+    string host = "localhost";
+    unsigned short port = 12121;
+    string unixPath;
+    uint64_t idleTimeoutMs = 0;
+    size_t maxConnections = 0;
+    bool shedIdle = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:t:m:s")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = stoi(optarg);
+            break;
+        case 'u':
+            unixPath = optarg;
+            break;
+        case 't':
+            idleTimeoutMs = stoul(optarg);
+            break;
+        case 'm':
+            maxConnections = stoul(optarg);
+            break;
+        case 's':
+            shedIdle = true;
+            break;
+        default:
+            printf("%s: [-h host] [-p port] [-u unixSocketPath] [-t idleTimeoutMs] "
+                   "[-m maxConnections [-s]]\n", argv[0]);
+            return -1;
+        }
+    }
 
     logSetPath("/tmp/nsock/echoServer");
 
     log("%s: starting...\n", argv[0]);
 
-    ConnServerPtr server = ConnServer::createConnServer();
+    ConnServerPtr server = ConnServer::createConnServer(host, port, unixPath, idleTimeoutMs,
+                                                      maxConnections, shedIdle);
 
     server->serverLoop();
 
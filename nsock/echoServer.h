@@ -21,7 +21,11 @@ public:
     ~ConnServer();
 
     static ConnServerPtr createConnServer(std::string host="localhost",
-                                          unsigned short port=12121);
+                                          unsigned short port=12121,
+                                          std::string unixPath="",
+                                          uint64_t idleTimeoutMs=0,
+                                          size_t maxConnections=0,
+                                          bool shedIdle=false);
     void serverLoop();
     std::string getConnStats() const;
 
@@ -29,16 +33,18 @@ private:
     /* The socket callbacks */
     void onConnect(nsock::NSockPtr sock);
     void onSocketError(nsock::NSockPtr sock, int error);
+    void onSocketEnd(nsock::NSockPtr sock);
     void onSocketDrain(nsock::NSockPtr sock);
+    void onSocketTimeout(nsock::NSockPtr sock, nsock::NSockTimeout type);
     size_t onSocketRecv(nsock::NSockPtr sock, const uint8_t *buf, int recvLen);
 
     std::string mHost;
     unsigned short mPort;
     nsock::NSockPtr mListenSock;
+    nsock::NSockPtr mUnixListenSock;
     std::set<nsock::NSockPtr> mConnections;
 
     uint8_t *mPendingSendBuf = nullptr;
-    bool mRecvPaused = false;
 };
 
 
@@ -5,14 +5,28 @@
 #include <string>
 #include <set>
 #include <algorithm>
+#include <chrono>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <openssl/pem.h>
 
 #include "gtest/gtest.h"
 #include "nsock.h"
+#include "ndgram.h"
+#include "ntls.h"
+#include "nframer.h"
+#include "nscan.h"
+#include "negress.h"
+#include "naccept.h"
+#include "nalloc.h"
 #include "npoll.h"
+#include "broker.h"
 
 
 using namespace std;
@@ -21,9 +35,9 @@ using namespace npoll;
 
 
 /*
- * Test the circular buffer.
+ * Test the circular buffer, plain and mirrored.
  */
-class CircularBufferTest : public ::testing::Test {
+class CircularBufferTest : public ::testing::TestWithParam<bool> {
 protected:
     void SetUp() override {
     }
@@ -31,14 +45,19 @@ protected:
     void TearDown() override {
     }
 
-    CircularBuffer cBuffer;
+    CircularBuffer cBuffer{64*1024, GetParam()};
 };
 
+INSTANTIATE_TEST_SUITE_P(Variants, CircularBufferTest, ::testing::Bool(),
+                         [] (const ::testing::TestParamInfo<bool> &info) {
+                             return info.param ? "Mirrored" : "Plain";
+                         });
+
 
 /*
  * Write to circular buffer until it is full.
  */
-TEST_F(CircularBufferTest, WriteUntilFull) {
+TEST_P(CircularBufferTest, WriteUntilFull) {
     size_t bufsz = 64;
     uint8_t *buf = new uint8_t[bufsz];
 
@@ -55,7 +74,7 @@ TEST_F(CircularBufferTest, WriteUntilFull) {
 /*
  * Read from the buffer until it is empty.
  */
-TEST_F(CircularBufferTest, ReadUntilEmpty) {
+TEST_P(CircularBufferTest, ReadUntilEmpty) {
     size_t bufsz = 256;
     uint8_t *buf = new uint8_t[bufsz];
 
@@ -84,7 +103,7 @@ TEST_F(CircularBufferTest, ReadUntilEmpty) {
  * Write some data, then read from the buffer and ensure data integrity is
  * preserved.
  */
-TEST_F(CircularBufferTest, WriteAndReadWithWrapAround) {
+TEST_P(CircularBufferTest, WriteAndReadWithWrapAround) {
     const size_t testWriteSize = (cBuffer.dataBufSize + 13331) * 13;
     size_t wbufSize = cBuffer.dataBufSize;
     uint8_t *wbuf = new uint8_t[wbufSize];
@@ -123,6 +142,2075 @@ TEST_F(CircularBufferTest, WriteAndReadWithWrapAround) {
     delete [] wbuf;
 }
 
+/*
+ * Peek doesn't consume. Only the consumed part of a chunk goes away, the rest
+ * is returned again by the next peek.
+ */
+TEST_P(CircularBufferTest, PeekAndPartialConsume) {
+    uint8_t wbuf[100];
+    for (size_t i = 0; i < sizeof(wbuf); i++) {
+        wbuf[i] = i;
+    }
+    ASSERT_EQ(cBuffer.put(wbuf, sizeof(wbuf)), sizeof(wbuf));
+
+    uint8_t *bufPtr = nullptr;
+    ASSERT_EQ(cBuffer.peek(&bufPtr), sizeof(wbuf));
+    ASSERT_EQ(cBuffer.peek(&bufPtr), sizeof(wbuf));
+
+    cBuffer.consume(30);
+    ASSERT_EQ(cBuffer.peek(&bufPtr), sizeof(wbuf) - 30);
+    ASSERT_EQ(bufPtr[0], 30);
+
+    cBuffer.consume(sizeof(wbuf) - 30);
+    ASSERT_TRUE(cBuffer.empty());
+    ASSERT_EQ(cBuffer.peek(&bufPtr), 0UL);
+    ASSERT_EQ(bufPtr, nullptr);
+}
+
+
+/*
+ * Mirrored, data that wraps around the end comes back in one piece, and the
+ * second mapping shows the same bytes as the first.
+ */
+TEST_P(CircularBufferTest, WrappedDataIsContiguousWhenMirrored) {
+    ASSERT_EQ(cBuffer.isMirrored(), GetParam());
+
+    // Move the head close to the end, then wrap
+    vector<uint8_t> fill(cBuffer.dataBufSize - 100, 0);
+    ASSERT_EQ(cBuffer.put(fill.data(), fill.size()), fill.size());
+    cBuffer.consume(fill.size());
+
+    uint8_t wbuf[300];
+    for (size_t i = 0; i < sizeof(wbuf); i++) {
+        wbuf[i] = i;
+    }
+    ASSERT_EQ(cBuffer.put(wbuf, sizeof(wbuf)), sizeof(wbuf));
+
+    uint8_t *bufPtr = nullptr;
+    struct iovec iov[2];
+    if (!GetParam()) {
+        ASSERT_EQ(cBuffer.peek(&bufPtr), 100UL);
+        ASSERT_EQ(cBuffer.peekv(iov, sizeof(wbuf)), 2);
+        return;
+    }
+
+    ASSERT_EQ(cBuffer.peek(&bufPtr), sizeof(wbuf));
+    ASSERT_EQ(memcmp(bufPtr, wbuf, sizeof(wbuf)), 0);
+    ASSERT_EQ(cBuffer.peekv(iov, sizeof(wbuf)), 1);
+    ASSERT_EQ(iov[0].iov_len, sizeof(wbuf));
+    ASSERT_EQ(cBuffer.dataBuf[0], wbuf[100]);
+
+    ASSERT_EQ(cBuffer.get(&bufPtr), sizeof(wbuf));
+    ASSERT_TRUE(cBuffer.empty());
+    ASSERT_EQ(cBuffer.dataStart, 200UL);
+}
+
+
+/*
+ * A SOCK_SEQPACKET socket pair delivers each send() as one message, including
+ * messages that wrap around the end of the send buffer.
+ */
+TEST(NSockPairTest, SeqPacketKeepsMessageBoundaries) {
+    auto [sender, receiver] = NSock::pair(SOCK_SEQPACKET);
+    ASSERT_TRUE(sender);
+    ASSERT_TRUE(receiver);
+
+    const size_t msgNr = 64;
+    const size_t msgLen = 3000;
+    vector<size_t> recvLens;
+    bool exitLoop = false;
+
+    receiver->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        recvLens.push_back(len);
+        for (int i = 0; i < len; i++) {
+            EXPECT_EQ(buf[i], (uint8_t)recvLens.size());
+        }
+        if (recvLens.size() == msgNr) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+
+    size_t sentNr = 0;
+    auto sendMore = [&] (NSockPtr sock) {
+        vector<uint8_t> msg(msgLen);
+        while (sentNr < msgNr) {
+            fill(msg.begin(), msg.end(), (uint8_t)(sentNr + 1));
+            if (sock->send(msg.data(), msg.size()) == 0) {
+                break;
+            }
+            ++sentNr;
+        }
+    };
+    sender->setDrainFn(sendMore);
+    sendMore(sender);
+
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(recvLens.size(), msgNr);
+    for (auto len : recvLens) {
+        ASSERT_EQ(len, msgLen);
+    }
+
+    sender->end();
+    receiver->end();
+}
+
+
+/*
+ * SOCK_SEQPACKET messages come in whole, whatever room a held slice left in
+ * the receive buffer and however long they are, up to the receive buffer
+ * limit. A longer one fails the socket rather than come in cut off.
+ */
+TEST(NSockUnixTest, SeqPacketReadsLongMessagesWhole) {
+    string path = "@nsockTest-" + to_string(getpid());
+    NSockPtr receiver;
+    vector<NBufSlice> kept;
+    int error = 0;
+    bool exitLoop = false;
+    auto listenSock = NSock::listenUnix(path, [&] (NSockPtr sock) {
+        receiver = sock;
+        sock->setRecvSliceFn([&] (NSockPtr sock, const NBufSlice &slice) {
+            kept.push_back(slice);
+            exitLoop = true;
+            return slice.size();
+        });
+        sock->setErrorFn([&] (NSockPtr sock, int err) {
+            error = err;
+            exitLoop = true;
+        });
+    }, SOCK_SEQPACKET);
+    ASSERT_TRUE(listenSock);
+
+    // A peer that isn't an NSock, so it can send more than 64KB at once
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path + 1, path.data() + 1, path.size() - 1);
+    socklen_t addrLen = offsetof(struct sockaddr_un, sun_path) + path.size();
+    int peer = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    ASSERT_NE(peer, -1);
+    ASSERT_EQ(connect(peer, (struct sockaddr *)&addr, addrLen), 0);
+    int sndBuf = 1024 * 1024;
+    setsockopt(peer, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+
+    // The first slice is held, which leaves less room behind it than the
+    // second message needs; the third is longer than the initial buffer.
+    vector<size_t> msgLens = {40 * 1024, 30 * 1024, 200 * 1024};
+    for (size_t i = 0; i < msgLens.size(); i++) {
+        vector<uint8_t> msg(msgLens[i], (uint8_t)(i + 1));
+        ASSERT_EQ(::send(peer, msg.data(), msg.size(), 0), (ssize_t)msg.size());
+    }
+    while (kept.size() < msgLens.size() && !error) {
+        exitLoop = false;
+        npollLoop(exitLoop);
+    }
+
+    ASSERT_EQ(error, 0);
+    ASSERT_EQ(kept.size(), msgLens.size());
+    for (size_t i = 0; i < msgLens.size(); i++) {
+        ASSERT_EQ(kept[i].size(), msgLens[i]);
+        ASSERT_TRUE(all_of(kept[i].data(), kept[i].data() + kept[i].size(),
+                           [&] (uint8_t c) { return c == i + 1; }));
+    }
+
+    // Past the 256KB default limit
+    vector<uint8_t> tooLong(300 * 1024);
+    ASSERT_EQ(::send(peer, tooLong.data(), tooLong.size(), 0), (ssize_t)tooLong.size());
+    exitLoop = false;
+    npollLoop(exitLoop);
+    ASSERT_EQ(error, EMSGSIZE);
+    ASSERT_EQ(kept.size(), msgLens.size());
+
+    ::close(peer);
+    receiver->destroy();
+    listenSock->destroy();
+}
+
+
+/*
+ * Datagrams queued with send() arrive intact and in order over loopback, with
+ * and without GSO coalescing.
+ */
+TEST(NDgramTest, BatchedLoopback) {
+    for (bool gso : {false, true}) {
+        // The last datagram is empty
+        const size_t dgramNr = 101;
+        const size_t dgramLen = 500;
+        vector<vector<uint8_t>> received;
+        bool exitLoop = false;
+
+        auto rx = NDgram::bind("127.0.0.1", 0,
+                               [&] (NDgramPtr, const uint8_t *buf, size_t len,
+                                    const struct sockaddr_storage &) {
+                                   received.emplace_back(buf, buf + len);
+                                   if (received.size() == dgramNr) {
+                                       exitLoop = true;
+                                   }
+                               },
+                               nullptr);
+        auto tx = NDgram::bind("127.0.0.1", 0, nullptr, nullptr);
+        ASSERT_TRUE(rx && tx);
+        if (gso && (tx->enableGso(dgramLen) || rx->enableGro())) {
+            continue;
+        }
+
+        auto dest = rx->getLocalAddr();
+        for (size_t i = 0; i < dgramNr; i++) {
+            vector<uint8_t> buf(i + 1 < dgramNr ? dgramLen : 0, (uint8_t)i);
+            ASSERT_EQ(tx->send(buf.data(), buf.size(), dest), (int)buf.size());
+        }
+        tx->flush();
+
+        npollLoop(exitLoop);
+
+        ASSERT_EQ(received.size(), dgramNr);
+        for (size_t i = 0; i < dgramNr; i++) {
+            size_t len = i + 1 < dgramNr ? dgramLen : 0;
+            ASSERT_EQ(received[i], vector<uint8_t>(len, (uint8_t)i));
+        }
+        ASSERT_EQ(tx->getStats().sendPackets, dgramNr);
+        ASSERT_EQ(rx->getStats().recvPackets, dgramNr);
+
+        tx->close();
+        rx->close();
+    }
+}
+
+
+/*
+ * A fatal send error closed from onError stops the flush: one error, not one
+ * per queued datagram.
+ */
+TEST(NDgramTest, CloseFromOnErrorStopsFlush) {
+    int errorNr = 0;
+    auto tx = NDgram::bind("127.0.0.1", 0, nullptr,
+                           [&] (NDgramPtr dgram, int error) {
+                               ++errorNr;
+                               dgram->close();
+                           });
+    ASSERT_TRUE(tx);
+
+    // Broadcast without SO_BROADCAST is refused
+    struct sockaddr_storage dest;
+    ASSERT_TRUE(NDgram::resolve("255.255.255.255", 9, dest));
+    uint8_t buf[100] = {0};
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(tx->send(buf, sizeof(buf), dest), (int)sizeof(buf));
+    }
+    tx->flush();
+
+    ASSERT_EQ(errorNr, 1);
+    ASSERT_EQ(tx->getStats().sendErrorNr, 1UL);
+}
+
+
+/*
+ * TLS handshake over loopback TCP with a self-signed certificate, then data
+ * over the kernel TLS session in both directions. Skipped if the kernel has no
+ * "tls" ULP.
+ */
+TEST(NSockTlsTest, KernelTlsLoopback) {
+    auto serverCtx = NTlsContext::createSelfSignedServer("localhost");
+    auto clientCtx = NTlsContext::createClient(false);
+
+    const string request = "ping over kTLS";
+    string serverGot, clientGot;
+    int tlsError = 0;
+    bool exitLoop = false;
+    NSockPtr serverConn;
+
+    auto onError = [&] (NSockPtr sock, int error) {
+        if (sock->getStats().tlsErrorNr) {
+            tlsError = error;
+        }
+        exitLoop = true;
+    };
+
+    auto listenSock = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        serverConn = sock;
+        sock->setErrorFn(onError);
+        sock->startTls(serverCtx, true, [&] (NSockPtr sock) {
+            sock->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+                serverGot.append((const char *)buf, len);
+                if (serverGot == request) {
+                    sock->send((const uint8_t *)buf, len);
+                }
+                return (size_t)len;
+            });
+        });
+    });
+    ASSERT_TRUE(listenSock);
+
+    auto addr = listenSock->getLocalAddr();
+    unsigned short port = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+    auto client = NSock::connect("127.0.0.1", port,
+                                 [&] (NSockPtr sock, const uint8_t *buf, int len) {
+                                     clientGot.append((const char *)buf, len);
+                                     if (clientGot == request) {
+                                         exitLoop = true;
+                                     }
+                                     return (size_t)len;
+                                 },
+                                 onError);
+    ASSERT_TRUE(client);
+    client->startTls(clientCtx, false, [&] (NSockPtr sock) {
+        sock->send((const uint8_t *)request.c_str(), request.size());
+    });
+
+    npollLoop(exitLoop);
+
+    client->end();
+    if (serverConn) {
+        serverConn->end();
+    }
+    listenSock->end();
+
+    if (tlsError == ENOENT || tlsError == ENOPROTOOPT) {
+        GTEST_SKIP() << "kernel TLS is not available";
+    }
+
+    ASSERT_EQ(tlsError, 0);
+    ASSERT_TRUE(client->isTls());
+    ASSERT_EQ(serverGot, request);
+    ASSERT_EQ(clientGot, request);
+}
+
+
+/*
+ * The records besides application data that come in once the kernel has the
+ * session: session tickets are skipped, even when they come in pieces,
+ * close_notify ends the stream, and KeyUpdate or any other alert fails it.
+ */
+TEST(NSockTlsTest, RecordsAfterHandshake) {
+    const uint8_t recordAlert = 21, recordHandshake = 22, recordData = 23;
+
+    NTlsRecords records;
+    string data = "data";
+    ASSERT_EQ(records.onRecord(recordData, (const uint8_t *)data.data(), data.size()),
+              NTlsRecords::Data);
+
+    // Two NewSessionTickets in one record, read in three pieces
+    vector<uint8_t> tickets = {4, 0, 0, 3, 'a', 'b', 'c', 4, 0, 0, 2, 'd', 'e'};
+    ASSERT_EQ(records.onRecord(recordHandshake, tickets.data(), 2), NTlsRecords::Skip);
+    ASSERT_EQ(records.onRecord(recordHandshake, tickets.data() + 2, 7), NTlsRecords::Skip);
+    ASSERT_EQ(records.onRecord(recordHandshake, tickets.data() + 9, 4), NTlsRecords::Skip);
+    ASSERT_EQ(records.onRecord(recordData, (const uint8_t *)data.data(), data.size()),
+              NTlsRecords::Data);
+
+    vector<uint8_t> closeNotify = {1, 0};
+    ASSERT_EQ(records.onRecord(recordAlert, closeNotify.data(), 1), NTlsRecords::Skip);
+    ASSERT_EQ(records.onRecord(recordAlert, closeNotify.data() + 1, 1), NTlsRecords::End);
+
+    vector<uint8_t> keyUpdate = {24, 0, 0, 1, 0};
+    ASSERT_EQ(NTlsRecords().onRecord(recordHandshake, keyUpdate.data(), keyUpdate.size()),
+              NTlsRecords::Fail);
+
+    vector<uint8_t> badRecordMac = {2, 20};
+    ASSERT_EQ(NTlsRecords().onRecord(recordAlert, badRecordMac.data(), badRecordMac.size()),
+              NTlsRecords::Fail);
+}
+
+
+/*
+ * A client that verifies the server certificate checks it is for the hostname
+ * given: the handshake fails for another one, and without one.
+ */
+TEST(NSockTlsTest, ClientVerifiesHostname) {
+    auto serverCtx = NTlsContext::createSelfSignedServer("localhost");
+
+    // Trust the self-signed certificate
+    string caFile = "/tmp/nsockTest-" + to_string(getpid()) + ".pem";
+    FILE *f = fopen(caFile.c_str(), "w");
+    ASSERT_TRUE(f);
+    PEM_write_X509(f, SSL_CTX_get0_certificate(serverCtx->get()));
+    fclose(f);
+    auto clientCtx = NTlsContext::createClient(true, caFile);
+    unlink(caFile.c_str());
+
+    for (string hostname : {"localhost", "example.com", ""}) {
+        SCOPED_TRACE(hostname);
+        NSockPtr serverConn;
+        auto listenSock = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+            serverConn = sock;
+            sock->setErrorFn([] (NSockPtr sock, int error) {
+            });
+            sock->startTls(serverCtx, true, nullptr);
+        });
+        ASSERT_TRUE(listenSock);
+
+        bool ready = false;
+        int clientError = 0;
+        bool exitLoop = false;
+        auto addr = listenSock->getLocalAddr();
+        unsigned short port = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+        auto client = NSock::connect("127.0.0.1", port, nullptr,
+                                     [&] (NSockPtr sock, int error) {
+                                         clientError = error;
+                                         exitLoop = true;
+                                     });
+        ASSERT_TRUE(client);
+        client->startTls(clientCtx, false, [&] (NSockPtr sock) {
+            ready = true;
+            exitLoop = true;
+        }, hostname);
+
+        npollLoop(exitLoop);
+
+        if (hostname == "localhost") {
+            // Past the handshake, unless there is no kernel TLS to hand over to
+            ASSERT_TRUE(ready || clientError == ENOENT || clientError == ENOPROTOOPT);
+        } else if (hostname.empty()) {
+            ASSERT_EQ(clientError, EINVAL);
+        } else {
+            ASSERT_EQ(clientError, EPROTO);
+        }
+
+        client->destroy();
+        if (serverConn) {
+            serverConn->destroy();
+        }
+        listenSock->destroy();
+    }
+}
+
+
+/*
+ * At the connection limit, accepting pauses and the next client waits in the
+ * backlog until a slot frees up. With shedIdle, the connections idle the
+ * longest are closed to make room instead.
+ */
+TEST(NSockListenTest, MaxConnectionsPausesThenSheds) {
+    vector<NSockPtr> accepted;
+    bool exitLoop = false;
+    auto listenSock = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        accepted.push_back(sock);
+        exitLoop = true;
+    });
+    ASSERT_TRUE(listenSock);
+    listenSock->setMaxConnections(2);
+
+    auto addr = listenSock->getLocalAddr();
+    unsigned short port = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+    auto noRecv = [] (NSockPtr sock, const uint8_t *buf, int len) {
+        return (size_t)len;
+    };
+    auto noError = [] (NSockPtr sock, int error) {
+    };
+
+    auto runFor = [&] (uint64_t ms) {
+        exitLoop = false;
+        npollAddTimer(ms, [&] () {
+            exitLoop = true;
+        });
+        npollLoop(exitLoop);
+    };
+
+    vector<NSockPtr> clients;
+    for (int i = 0; i < 3; i++) {
+        clients.push_back(NSock::connect("127.0.0.1", port, noRecv, noError));
+        ASSERT_TRUE(clients.back());
+        runFor(20);
+    }
+
+    // The third waits in the backlog
+    ASSERT_EQ(accepted.size(), 2UL);
+    ASSERT_EQ(listenSock->getStats().connNr, 2UL);
+    ASSERT_EQ(listenSock->getStats().acceptPauseNr, 1UL);
+
+    // A slot frees up, and it gets in
+    accepted[0]->destroy();
+    runFor(20);
+    ASSERT_EQ(accepted.size(), 3UL);
+    ASSERT_EQ(listenSock->getStats().connNr, 2UL);
+    ASSERT_EQ(listenSock->getStats().peakConnNr, 2UL);
+
+    // With shedding, a new connection pushes out the idlest one
+    listenSock->setMaxConnections(2, true);
+    int shedError = 0;
+    accepted[1]->setErrorFn([&] (NSockPtr sock, int error) {
+        shedError = error;
+    });
+    clients.push_back(NSock::connect("127.0.0.1", port, noRecv, noError));
+    runFor(20);
+
+    ASSERT_EQ(accepted.size(), 4UL);
+    ASSERT_EQ(listenSock->getStats().shedNr, 1UL);
+    ASSERT_EQ(accepted[1]->getState(), NSockClosed);
+    ASSERT_EQ(accepted[2]->getState(), NSockConnected);
+    ASSERT_EQ(accepted[3]->getState(), NSockConnected);
+    ASSERT_EQ(shedError, ECONNABORTED);
+
+    for (auto &sock : accepted) {
+        sock->destroy();
+    }
+    for (auto &sock : clients) {
+        sock->destroy();
+    }
+    listenSock->end();
+}
+
+TEST(NSockListenTest, ConnectAsyncQueuesUntilConnected) {
+    string serverGot;
+    bool exitLoop = false;
+    NSockPtr serverConn;
+    auto listenSock = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        serverConn = sock;
+        sock->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+            serverGot.append((const char *)buf, len);
+            exitLoop = true;
+            return (size_t)len;
+        });
+    });
+    ASSERT_TRUE(listenSock);
+    auto addr = listenSock->getLocalAddr();
+    unsigned short port = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+
+    bool connected = false;
+    int clientError = 0;
+    auto onError = [&] (NSockPtr sock, int error) {
+        clientError = error;
+        exitLoop = true;
+    };
+    auto client = NSock::connectAsync("127.0.0.1", port, [&] (NSockPtr sock) {
+        connected = true;
+    }, onError);
+    ASSERT_TRUE(client);
+    ASSERT_EQ(client->getState(), NSockConnecting);
+
+    string msg = "sent while connecting";
+    ASSERT_EQ(client->send((const uint8_t *)msg.data(), msg.size()), (int)msg.size());
+    npollLoop(exitLoop);
+
+    ASSERT_TRUE(connected);
+    ASSERT_EQ(client->getState(), NSockConnected);
+    ASSERT_EQ(serverGot, msg);
+
+    // Nobody listening there anymore
+    client->destroy();
+    serverConn->destroy();
+    listenSock->end();
+    exitLoop = false;
+    connected = false;
+    auto refused = NSock::connectAsync("127.0.0.1", port, [&] (NSockPtr sock) {
+        connected = true;
+    }, onError);
+    ASSERT_TRUE(refused);
+    npollLoop(exitLoop);
+
+    ASSERT_FALSE(connected);
+    ASSERT_EQ(clientError, ECONNREFUSED);
+    refused->destroy();
+}
+
+/*
+ * shutdown() or end() before the connection is up: the FIN goes out once it
+ * is, after what was queued.
+ */
+TEST(NSockListenTest, EndWhileConnectingSendsFinOnceConnected) {
+    string serverGot;
+    int endNr = 0;
+    bool exitLoop = false;
+    vector<NSockPtr> serverConns;
+    auto listenSock = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        serverConns.push_back(sock);
+        sock->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+            serverGot.append((const char *)buf, len);
+            return (size_t)len;
+        });
+        sock->setEndFn([&] (NSockPtr sock) {
+            ++endNr;
+            exitLoop = true;
+        });
+    });
+    ASSERT_TRUE(listenSock);
+    auto addr = listenSock->getLocalAddr();
+    unsigned short port = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+
+    bool connected = false;
+    auto onError = [&] (NSockPtr sock, int error) {
+        ADD_FAILURE() << "client error " << error;
+        exitLoop = true;
+    };
+    auto halfClosed = NSock::connectAsync("127.0.0.1", port, [&] (NSockPtr sock) {
+        connected = true;
+    }, onError);
+    ASSERT_TRUE(halfClosed);
+    halfClosed->shutdown();
+    npollLoop(exitLoop);
+
+    ASSERT_TRUE(connected);
+    ASSERT_EQ(endNr, 1);
+    ASSERT_TRUE(serverGot.empty());
+
+    auto ended = NSock::connectAsync("127.0.0.1", port, nullptr, onError);
+    ASSERT_TRUE(ended);
+    string msg = "sent and ended while connecting";
+    ASSERT_EQ(ended->send((const uint8_t *)msg.data(), msg.size()), (int)msg.size());
+    ended->end();
+    exitLoop = false;
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(endNr, 2);
+    ASSERT_EQ(serverGot, msg);
+
+    // The server ends too, which closes the client
+    exitLoop = false;
+    npollAddTimer(50, [&] () {
+        exitLoop = true;
+    });
+    npollLoop(exitLoop);
+    ASSERT_EQ(ended->getState(), NSockClosed);
+
+    halfClosed->destroy();
+    for (auto &sock : serverConns) {
+        sock->destroy();
+    }
+    listenSock->end();
+}
+
+TEST(NAllocTest, SlabsRecycleChunks) {
+    NSlab slab(64, 4096);
+    void *a = slab.alloc();
+    void *b = slab.alloc();
+    ASSERT_NE(a, b);
+    slab.free(a);
+    ASSERT_EQ(slab.alloc(), a);
+    ASSERT_EQ(slab.getStats().slabNr, 1UL);
+    ASSERT_EQ(slab.getStats().inUseNr, 2UL);
+
+    // A whole slab in use takes another one
+    vector<void *> chunks;
+    for (size_t i = 0; i < 4096 / 64; i++) {
+        chunks.push_back(slab.alloc());
+    }
+    ASSERT_EQ(slab.getStats().slabNr, 2UL);
+    ASSERT_EQ(slab.getStats().peakInUseNr, 2 + 4096 / 64UL);
+}
+
+TEST(NAllocTest, HugePageArenasBackNewSlabs) {
+    auto before = nallocGetStats();
+    nallocUseHugePages(true);
+
+    // Two 1MB slabs fit in one 2MB arena, a 3MB one gets its own
+    NSlab small(64 * 1024, 1024 * 1024);
+    NSlab large(3 * 1024 * 1024, 3 * 1024 * 1024);
+    vector<uint8_t *> chunks;
+    for (size_t i = 0; i < 2 * 16; i++) {
+        chunks.push_back(static_cast<uint8_t *>(small.alloc()));
+    }
+    chunks.push_back(static_cast<uint8_t *>(large.alloc()));
+    for (auto chunk : chunks) {
+        memset(chunk, 0xab, 64 * 1024);
+    }
+    nallocUseHugePages(false);
+
+    auto stat = nallocGetStats();
+    ASSERT_TRUE(stat.arenaNr >= before.arenaNr + 2);
+    ASSERT_EQ(stat.hugeTlbArenaNr + stat.thpArenaNr, stat.arenaNr);
+    ASSERT_EQ(stat.arenaUsedBytes, before.arenaUsedBytes + 5 * 1024 * 1024UL);
+    ASSERT_EQ((uintptr_t)chunks.back() % (2 * 1024 * 1024), 0UL);
+    ASSERT_FALSE(stat.hugePages);
+}
+
+TEST(NAllocTest, MirroredSendBuffersStreamInOrder) {
+    auto before = nallocGetStats();
+    nallocUseMirroredBuffers(true);
+    auto [a, b] = NSock::pair();
+    nallocUseMirroredBuffers(false);
+    ASSERT_TRUE(a && b);
+    ASSERT_EQ(nallocGetStats().mirroredNr, before.mirroredNr + 2);
+
+    // Odd sized sends, so the data wraps around the send buffer at all sorts
+    // of places
+    size_t total = 4 * 1024 * 1024;
+    size_t sentLen = 0, recvLen = 0;
+    bool exitLoop = false;
+    b->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        for (int i = 0; i < len; i++) {
+            if (buf[i] != (uint8_t)((recvLen + i) % 251)) {
+                ADD_FAILURE() << "byte " << recvLen + i;
+                exitLoop = true;
+                return (size_t)len;
+            }
+        }
+        recvLen += len;
+        if (recvLen == total) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+
+    vector<uint8_t> chunk(10007);
+    auto pump = [&] (NSockPtr sock) {
+        while (sentLen < total) {
+            size_t len = min(chunk.size(), total - sentLen);
+            for (size_t i = 0; i < len; i++) {
+                chunk[i] = (sentLen + i) % 251;
+            }
+            int n = sock->send(chunk.data(), len);
+            if (n <= 0) {
+                return;
+            }
+            sentLen += n;
+        }
+    };
+    a->setDrainFn(pump);
+    pump(a);
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(recvLen, total);
+    a->destroy();
+    b->destroy();
+}
+
+TEST(NAllocTest, SocketsComeBackToTheirSlabs) {
+    auto usage = [] () {
+        auto stat = nallocGetStats();
+        uint64_t objects = 0;
+        for (auto &slab : stat.objects) {
+            objects += slab.inUseNr;
+        }
+        return make_pair(objects, stat.inUseBytes);
+    };
+
+    auto bufferClass = [] (const NAllocStat &stat, size_t chunkSize) {
+        for (auto &slab : stat.buffers) {
+            if (slab.chunkSize == chunkSize) {
+                return slab;
+            }
+        }
+        return SlabStat();
+    };
+
+    // Sized by class: 64KB and 5000 bytes (8KB) buffers
+    void *buf = nallocBuffer(5000);
+    auto stat = nallocGetStats();
+    ASSERT_EQ(bufferClass(stat, 8192).inUseNr, 1UL);
+    nallocFreeBuffer(buf, 5000);
+
+    // Shared buffers too, small ones in small classes
+    uint64_t smallNr = bufferClass(stat, 128).inUseNr;
+    {
+        string msg(100, 'x');
+        auto shared = NBuffer::copy((const uint8_t *)msg.data(), msg.size());
+        ASSERT_EQ(bufferClass(nallocGetStats(), 128).inUseNr, smallNr + 1);
+    }
+    ASSERT_EQ(bufferClass(nallocGetStats(), 128).inUseNr, smallNr);
+
+    auto before = usage();
+    {
+        auto [a, b] = NSock::pair();
+        ASSERT_TRUE(a && b);
+        ASSERT_EQ(usage().first, before.first + 2);
+        ASSERT_GE(usage().second, before.second + 2 * 64 * 1024);
+
+        string msg = "slab";
+        ASSERT_EQ(a->send((const uint8_t *)msg.data(), msg.size()), (int)msg.size());
+        bool exitLoop = false;
+        b->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+            exitLoop = true;
+            return (size_t)len;
+        });
+        npollLoop(exitLoop);
+
+        a->destroy();
+        b->destroy();
+    }
+    ASSERT_EQ(usage(), before);
+}
+
+static struct sockaddr_storage inetAddr(const char *ip) {
+    struct sockaddr_storage addr = {0};
+    auto sin = reinterpret_cast<struct sockaddr_in *>(&addr);
+    auto sin6 = reinterpret_cast<struct sockaddr_in6 *>(&addr);
+    if (inet_pton(AF_INET, ip, &sin->sin_addr) == 1) {
+        addr.ss_family = AF_INET;
+    } else if (inet_pton(AF_INET6, ip, &sin6->sin6_addr) == 1) {
+        addr.ss_family = AF_INET6;
+    }
+
+    return addr;
+}
+
+TEST(NAcceptFilterTest, SlidingWindowAndPrefixes) {
+    auto filter = NAcceptFilter::create(3, 1000, 1024);
+    ASSERT_EQ(filter->allow("10.1.0.0/16"), 0);
+    ASSERT_EQ(filter->deny("10.0.0.0/8"), 0);
+    ASSERT_EQ(filter->deny("2001:db8::/32"), 0);
+    ASSERT_EQ(filter->deny("10.0.0.0/33"), -EINVAL);
+    ASSERT_EQ(filter->deny("bogus"), -EINVAL);
+
+    auto client = inetAddr("192.0.2.1");
+    ASSERT_TRUE(filter->admit(client, 0));
+    ASSERT_TRUE(filter->admit(client, 100));
+    ASSERT_TRUE(filter->admit(client, 200));
+    ASSERT_FALSE(filter->admit(client, 300));
+    ASSERT_TRUE(filter->admit(inetAddr("192.0.2.2"), 300));
+
+    // Half way into the next window, half of the 4 attempts still count
+    ASSERT_TRUE(filter->admit(client, 1500));
+    ASSERT_FALSE(filter->admit(client, 1500));
+
+    // Two windows later, it's forgotten
+    ASSERT_TRUE(filter->admit(client, 3000));
+
+    // Allow wins over deny, and never counts. IPv4-mapped addresses match
+    // IPv4 prefixes.
+    for (int i = 0; i < 10; i++) {
+        ASSERT_TRUE(filter->admit(inetAddr("10.1.2.3"), 3000));
+    }
+    ASSERT_FALSE(filter->admit(inetAddr("10.2.0.1"), 3000));
+    ASSERT_FALSE(filter->admit(inetAddr("::ffff:10.2.0.1"), 3000));
+    ASSERT_FALSE(filter->admit(inetAddr("2001:db8:1::1"), 3000));
+    ASSERT_TRUE(filter->admit(inetAddr("2001:db9::1"), 3000));
+
+    auto stat = filter->getStats();
+    ASSERT_EQ(stat.allowNr, 10UL);
+    ASSERT_EQ(stat.denyNr, 3UL);
+    ASSERT_EQ(stat.limitNr, 2UL);
+
+    // A small table keeps working when full, by evicting
+    auto small = NAcceptFilter::create(1, 1000, 8);
+    for (int i = 0; i < 100; i++) {
+        string ip = "198.51.100." + to_string(i);
+        ASSERT_TRUE(small->admit(inetAddr(ip.c_str()), 0));
+    }
+    ASSERT_GT(small->getStats().evictNr, 0UL);
+    ASSERT_LE(small->trackedNr(), 16UL);
+
+    // Limits past 16 bits count all the way up
+    auto large = NAcceptFilter::create(70000, 1000, 8);
+    for (int i = 0; i < 70000; i++) {
+        ASSERT_TRUE(large->admit(client, 0));
+    }
+    ASSERT_FALSE(large->admit(client, 0));
+}
+
+TEST(NAcceptFilterTest, ListenerClosesFiltered) {
+    size_t acceptedNr = 0;
+    auto listenSock = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        ++acceptedNr;
+    });
+    ASSERT_TRUE(listenSock);
+    auto filter = NAcceptFilter::create(1, 60000);
+    listenSock->setAcceptFilter(filter);
+
+    auto addr = listenSock->getLocalAddr();
+    unsigned short port = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+
+    // The second connection within the window is closed right away
+    vector<NSockPtr> clients;
+    int closedNr = 0;
+    bool exitLoop = false;
+    for (int i = 0; i < 2; i++) {
+        auto client = NSock::connect("127.0.0.1", port,
+                                     [] (NSockPtr sock, const uint8_t *buf, int len) {
+                                         return (size_t)len;
+                                     },
+                                     [&] (NSockPtr sock, int error) {
+                                         ++closedNr;
+                                         exitLoop = true;
+                                     });
+        ASSERT_TRUE(client);
+        clients.push_back(client);
+    }
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(acceptedNr, 1UL);
+    ASSERT_EQ(closedNr, 1);
+    ASSERT_EQ(listenSock->getStats().filteredNr, 1UL);
+    ASSERT_EQ(filter->getStats().limitNr, 1UL);
+
+    for (auto &client : clients) {
+        client->destroy();
+    }
+    listenSock->end();
+}
+
+/*
+ * While onRecv consumes nothing, the socket keeps reading and hands the
+ * accumulated data over contiguously, up to the receive buffer limit.
+ */
+TEST(NSockPairTest, RecvAccumulatesWhileConsumerLags) {
+    auto [sender, receiver] = NSock::pair();
+    ASSERT_TRUE(sender && receiver);
+
+    const size_t totalLen = 400 * 1024;
+    const size_t limit = 192 * 1024;
+    receiver->setRecvBufferLimit(limit);
+
+    size_t maxSeen = 0;
+    size_t recvTotal = 0;
+    uint8_t expectByte = 0;
+    bool exitLoop = false;
+    receiver->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        maxSeen = max(maxSeen, (size_t)len);
+        if ((size_t)len < limit && recvTotal + len < totalLen) {
+            // Lagging: take nothing until a full buffer has built up
+            return (size_t)0;
+        }
+        for (int i = 0; i < len; i++) {
+            EXPECT_EQ(buf[i], expectByte++);
+        }
+        recvTotal += len;
+        if (recvTotal == totalLen) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+
+    size_t sentTotal = 0;
+    uint8_t sendByte = 0;
+    auto pump = [&] (NSockPtr sock) {
+        uint8_t buf[4096];
+        while (sentTotal < totalLen) {
+            size_t len = min(sizeof(buf), totalLen - sentTotal);
+            for (size_t i = 0; i < len; i++) {
+                buf[i] = sendByte + i;
+            }
+            int n = sock->send(buf, len);
+            sendByte += n;
+            sentTotal += n;
+            if ((size_t)n < len) {
+                break;
+            }
+        }
+    };
+    sender->setDrainFn(pump);
+    pump(sender);
+
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(recvTotal, totalLen);
+    ASSERT_EQ(maxSeen, limit);
+    ASSERT_GT(receiver->getStats().recvBufGrowNr, 0UL);
+
+    sender->end();
+    receiver->end();
+}
+
+
+/*
+ * Budgets cut a stream into per iteration pieces, both ways. A message is
+ * never cut: it is read whole, and the socket yields after it.
+ */
+TEST(NSockPairTest, IoBudgetsYieldButKeepMessagesWhole) {
+    auto [sender, receiver] = NSock::pair();
+    ASSERT_TRUE(sender && receiver);
+    sender->setIoBudget(0, 4096);
+    receiver->setIoBudget(4096, 0);
+
+    const size_t totalLen = 64 * 1024;
+    size_t recvTotal = 0, maxSeen = 0;
+    bool exitLoop = false;
+    receiver->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        maxSeen = max(maxSeen, (size_t)len);
+        recvTotal += len;
+        if (recvTotal == totalLen) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+
+    vector<uint8_t> data(totalLen, 'b');
+    ASSERT_EQ(sender->send(data.data(), data.size()), (int)totalLen);
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(recvTotal, totalLen);
+    ASSERT_LE(maxSeen, 4096UL);
+    ASSERT_GT(sender->getStats().sendBudgetHitNr, 0UL);
+    ASSERT_GT(receiver->getStats().recvBudgetHitNr, 0UL);
+
+    sender->destroy();
+    receiver->destroy();
+
+    auto [msgSender, msgReceiver] = NSock::pair(SOCK_SEQPACKET);
+    ASSERT_TRUE(msgSender && msgReceiver);
+    msgReceiver->setIoBudget(1000, 0);
+
+    vector<int> lens;
+    exitLoop = false;
+    msgReceiver->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        lens.push_back(len);
+        if (lens.size() == 2) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+
+    vector<uint8_t> msg(4000, 'm');
+    ASSERT_EQ(msgSender->send(msg.data(), msg.size()), 4000);
+    ASSERT_EQ(msgSender->send(msg.data(), msg.size()), 4000);
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(lens, vector<int>({4000, 4000}));
+    ASSERT_GT(msgReceiver->getStats().recvBudgetHitNr, 0UL);
+
+    msgSender->destroy();
+    msgReceiver->destroy();
+}
+
+
+/*
+ * Latency mode, over loopback TCP (unix sockets have no TCP_NOTSENT_LOWAT):
+ * with the peer not reading, the kernel holds about the low water mark of
+ * unsent data, the rest waits in the send buffer, and onDrain still fires
+ * once the peer reads again.
+ */
+TEST(NSockPairTest, NotSentLowatKeepsBacklogInSendBuffer) {
+    NSockPtr receiver;
+    bool exitLoop = false;
+    size_t recvTotal = 0;
+    const size_t totalLen = 32 * 1024 * 1024;
+    auto listenSock = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        receiver = sock;
+        sock->pause();
+        sock->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+            recvTotal += len;
+            if (recvTotal == totalLen) {
+                exitLoop = true;
+            }
+            return (size_t)len;
+        });
+    });
+    ASSERT_TRUE(listenSock);
+    auto addr = listenSock->getLocalAddr();
+    unsigned short port = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+
+    auto sender = NSock::connect("127.0.0.1", port, nullptr, [&] (NSockPtr sock, int error) {
+        ADD_FAILURE() << "sender error " << error;
+        exitLoop = true;
+    });
+    ASSERT_TRUE(sender);
+    const uint32_t lowat = 16 * 1024;
+    ASSERT_EQ(sender->setNotSentLowat(lowat), 0);
+
+    size_t sentTotal = 0;
+    int drainNr = 0;
+    vector<uint8_t> chunk(16 * 1024, 'l');
+    auto pump = [&] (NSockPtr sock) {
+        while (sentTotal < totalLen) {
+            int n = sock->send(chunk.data(), min(chunk.size(), totalLen - sentTotal));
+            if (n <= 0) {
+                return;
+            }
+            sentTotal += n;
+        }
+    };
+    sender->setDrainFn([&] (NSockPtr sock) {
+        ++drainNr;
+        pump(sock);
+    });
+    pump(sender);
+
+    // Stalled: the peer's receive window is full
+    npollAddTimer(200, [&] () {
+        exitLoop = true;
+    });
+    npollLoop(exitLoop);
+    ASSERT_TRUE(receiver);
+    ASSERT_LT(sentTotal, totalLen);
+    ASSERT_GT(sender->getQueuedBytes(), 0UL);
+    // The kernel checks the mark when it starts a new segment, so a write
+    // may fill up the last one (up to 64KB on loopback) past it. Without the
+    // mark, this is the whole kernel send buffer, megabytes.
+    int unsent = sender->getKernelUnsentBytes();
+    ASSERT_GE(unsent, 0);
+    ASSERT_LE((size_t)unsent, lowat + 64 * 1024UL);
+
+    exitLoop = false;
+    int stalledDrainNr = drainNr;
+    receiver->resume();
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(recvTotal, totalLen);
+    ASSERT_GT(drainNr, stalledDrainNr);
+
+    sender->destroy();
+    receiver->destroy();
+    listenSock->destroy();
+}
+
+
+TEST(NSockPairTest, PauseHoldsDataUntilResume) {
+    auto [sender, receiver] = NSock::pair();
+    auto [kicker, kicked] = NSock::pair();
+    ASSERT_TRUE(sender && receiver && kicker && kicked);
+
+    const string msg = "held back while paused";
+    string received;
+    bool exitLoop = false;
+    receiver->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        received.append(reinterpret_cast<const char *>(buf), len);
+        if (received.size() == msg.size()) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+
+    receiver->pause();
+    ASSERT_TRUE(receiver->isPaused());
+    sender->send(reinterpret_cast<const uint8_t *>(msg.data()), msg.size());
+
+    // Resume from inside the loop, once the data has been sitting there
+    kicked->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        EXPECT_TRUE(received.empty());
+        receiver->resume();
+        return (size_t)len;
+    });
+    uint8_t kick = 'k';
+    kicker->send(&kick, 1);
+
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(received, msg);
+    ASSERT_FALSE(receiver->isPaused());
+
+    sender->end();
+    receiver->end();
+    kicker->end();
+    kicked->end();
+}
+
+
+TEST(NSockPairTest, RateLimitThrottlesBothDirections) {
+    auto [sender, receiver] = NSock::pair();
+    ASSERT_TRUE(sender && receiver);
+
+    // 64KB in bursts of 16KB at 128KB/s: at least (64 - 16) / 128 s
+    const size_t totalLen = 64 * 1024;
+    NRateLimit limit;
+    limit.bytesPerSec = 128 * 1024;
+    limit.burstBytes = 16 * 1024;
+    receiver->setRecvRateLimit(limit);
+
+    size_t recvTotal = 0;
+    bool exitLoop = false;
+    receiver->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        recvTotal += len;
+        if (recvTotal == totalLen) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+
+    vector<uint8_t> data(totalLen, 'r');
+    auto start = chrono::steady_clock::now();
+    ASSERT_EQ(sender->send(data.data(), data.size()), (int)totalLen);
+    npollLoop(exitLoop);
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    ASSERT_EQ(recvTotal, totalLen);
+    ASSERT_GE(elapsed, 0.3);
+    ASSERT_GT(receiver->getStats().recvThrottleNr, 0UL);
+    ASSERT_GT(receiver->getStats().recvThrottledUs, 0UL);
+
+    // 10 messages per second, 2 at once: the third send() is refused until a
+    // token comes back, and onDrain says when.
+    NRateLimit msgLimit;
+    msgLimit.msgsPerSec = 10;
+    msgLimit.burstMsgs = 2;
+    sender->setSendRateLimit(msgLimit);
+
+    uint8_t byte = 'm';
+    ASSERT_EQ(sender->send(&byte, 1), 1);
+    ASSERT_EQ(sender->send(&byte, 1), 1);
+    ASSERT_EQ(sender->send(&byte, 1), 0);
+
+    exitLoop = false;
+    sender->setDrainFn([&] (NSockPtr sock) {
+        EXPECT_EQ(sock->send(&byte, 1), 1);
+        exitLoop = true;
+    });
+    npollLoop(exitLoop);
+    ASSERT_EQ(sender->getStats().sendThrottleNr, 1UL);
+
+    sender->end();
+    receiver->end();
+
+    // Messages longer than the burst still come whole
+    auto [msgSender, msgReceiver] = NSock::pair(SOCK_SEQPACKET);
+    ASSERT_TRUE(msgSender && msgReceiver);
+    NRateLimit smallBurst;
+    smallBurst.bytesPerSec = 8000;
+    smallBurst.burstBytes = 2000;
+    msgReceiver->setRecvRateLimit(smallBurst);
+
+    vector<int> lens;
+    exitLoop = false;
+    msgReceiver->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        lens.push_back(len);
+        if (lens.size() == 2) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+
+    vector<uint8_t> msg(4000, 'm');
+    ASSERT_EQ(msgSender->send(msg.data(), msg.size()), 4000);
+    ASSERT_EQ(msgSender->send(msg.data(), msg.size()), 4000);
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(lens, vector<int>({4000, 4000}));
+    ASSERT_GT(msgReceiver->getStats().recvThrottleNr, 0UL);
+
+    msgSender->destroy();
+    msgReceiver->destroy();
+}
+
+
+TEST(NSockPairTest, HighLaneGoesBeforeQueuedBulk) {
+    auto [sender, receiver] = NSock::pair();
+    ASSERT_TRUE(sender && receiver);
+    ASSERT_EQ(sender->setSendLanes(2), 0);
+
+    // Back up the kernel and the bulk lane
+    receiver->pause();
+    vector<uint8_t> bulk(16 * 1024, 'b');
+    size_t bulkTotal = 0;
+    while (sender->send(bulk.data(), bulk.size()) == (int)bulk.size()) {
+        bulkTotal += bulk.size();
+    }
+    ASSERT_GT(sender->getStats().laneSendBytes[0], 0UL);
+    ASSERT_EQ(sender->send(bulk.data(), bulk.size(), 2), -EINVAL);
+
+    const string heartbeat = "HEARTBEAT";
+    ASSERT_EQ(sender->send(reinterpret_cast<const uint8_t *>(heartbeat.data()),
+                           heartbeat.size(), 1), (int)heartbeat.size());
+    ASSERT_EQ(sender->setSendLanes(1), -EBUSY);
+
+    string received;
+    bool exitLoop = false;
+    receiver->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        received.append(reinterpret_cast<const char *>(buf), len);
+        if (received.size() == bulkTotal + heartbeat.size()) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+    receiver->resume();
+    npollLoop(exitLoop);
+
+    // The heartbeat is whole, on a bulk message boundary, ahead of the bulk
+    // data that was still queued.
+    auto pos = received.find(heartbeat);
+    ASSERT_NE(pos, string::npos);
+    ASSERT_EQ(pos % bulk.size(), 0UL);
+    ASSERT_LT(pos + heartbeat.size(), received.size());
+
+    auto stat = sender->getStats();
+    ASSERT_EQ(stat.laneSendBytes[1], heartbeat.size());
+    ASSERT_EQ(stat.laneSendBytes[0], bulkTotal);
+    ASSERT_EQ(stat.laneJumpNr, 1UL);
+
+    sender->end();
+    receiver->end();
+}
+
+TEST(NSockPairTest, TimeoutsFireOncePerType) {
+    auto [idle, reader] = NSock::pair();
+    auto [writer, stalled] = NSock::pair();
+    ASSERT_TRUE(idle && reader && writer && stalled);
+
+    map<NSOCKID, vector<NSockTimeout>> fired;
+    auto onTimeout = [&] (NSockPtr sock, NSockTimeout type) {
+        fired[sock->getId()].push_back(type);
+    };
+    auto sink = [] (NSockPtr sock, const uint8_t *buf, int len) {
+        return (size_t)len;
+    };
+
+    idle->setRecvFn(sink);
+    idle->setTimeouts(60, 0, 0);
+    idle->setTimeoutFn(onTimeout);
+
+    reader->setRecvFn(sink);
+    reader->setTimeouts(0, 60, 0);
+    reader->setTimeoutFn(onTimeout);
+
+    // The peer never reads, so the writer's queue gets stuck
+    stalled->pause();
+    writer->setTimeouts(0, 0, 60);
+    writer->setTimeoutFn(onTimeout);
+    vector<uint8_t> chunk(64 * 1024, 's');
+    while (writer->send(chunk.data(), chunk.size()) > 0) {
+    }
+
+    bool exitLoop = false;
+    npollAddTimer(500, [&] () {
+        exitLoop = true;
+    });
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(fired[idle->getId()], vector<NSockTimeout>{NSockIdleTimeout});
+    ASSERT_EQ(fired[reader->getId()], vector<NSockTimeout>{NSockReadTimeout});
+    ASSERT_EQ(fired[writer->getId()], vector<NSockTimeout>{NSockWriteTimeout});
+    ASSERT_EQ(idle->getStats().idleTimeoutNr, 1UL);
+    ASSERT_EQ(reader->getStats().readTimeoutNr, 1UL);
+    ASSERT_EQ(writer->getStats().writeTimeoutNr, 1UL);
+
+    idle->end();
+    reader->end();
+    writer->end();
+    stalled->end();
+}
+
+TEST(NSockPairTest, EndFlushesThenWaitsForPeer) {
+    auto [sender, receiver] = NSock::pair();
+    ASSERT_TRUE(sender && receiver);
+
+    // Queue more than the kernel takes, then end right away
+    receiver->pause();
+    vector<uint8_t> chunk(16 * 1024, 'f');
+    size_t sentTotal = 0;
+    int n;
+    while ((n = sender->send(chunk.data(), chunk.size())) > 0) {
+        sentTotal += n;
+    }
+    sender->end();
+    ASSERT_EQ(sender->getState(), NSockClosing);
+    ASSERT_EQ(sender->send(chunk.data(), chunk.size()), -EPIPE);
+
+    size_t recvTotal = 0;
+    bool exitLoop = false;
+    receiver->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        recvTotal += len;
+        return (size_t)len;
+    });
+    receiver->setEndFn([&] (NSockPtr sock) {
+        // The sender's FIN, after all the data. We end() on return.
+        EXPECT_EQ(recvTotal, sentTotal);
+        EXPECT_EQ(sender->getState(), NSockClosing);
+        exitLoop = true;
+    });
+    receiver->resume();
+    npollLoop(exitLoop);
+
+    // Our FIN lets the sender finish closing
+    exitLoop = false;
+    npollAddTimer(10, [&] () {
+        exitLoop = true;
+    });
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(recvTotal, sentTotal);
+    ASSERT_EQ(sender->getState(), NSockClosed);
+    ASSERT_EQ(receiver->getState(), NSockClosed);
+    ASSERT_EQ(sender->getStats().discardedBytes, 0UL);
+}
+
+
+/*
+ * end() from onRecv: the callback runs to its end with its captures intact,
+ * and isn't called again for data that comes after.
+ */
+TEST(NSockPairTest, EndFromOnRecv) {
+    auto [client, server] = NSock::pair();
+    ASSERT_TRUE(client && server);
+
+    int recvNr = 0;
+    string reply = "bye";
+    server->setRecvFn([&recvNr, reply] (NSockPtr sock, const uint8_t *buf, int len) {
+        ++recvNr;
+        sock->send((const uint8_t *)reply.data(), reply.size());
+        sock->end();
+        EXPECT_EQ(reply, "bye");
+        return (size_t)len;
+    });
+
+    string clientGot;
+    bool exitLoop = false;
+    client->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        clientGot.append((const char *)buf, len);
+        return (size_t)len;
+    });
+    client->setEndFn([&] (NSockPtr sock) {
+        exitLoop = true;
+    });
+
+    // The second piece is there when the server ends
+    string request = "first";
+    ASSERT_EQ(client->send((const uint8_t *)request.data(), request.size()),
+              (int)request.size());
+    ASSERT_EQ(client->send((const uint8_t *)request.data(), request.size()),
+              (int)request.size());
+    npollLoop(exitLoop);
+
+    exitLoop = false;
+    npollAddTimer(10, [&] () {
+        exitLoop = true;
+    });
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(recvNr, 1);
+    ASSERT_EQ(clientGot, reply);
+    ASSERT_EQ(server->getState(), NSockClosed);
+    ASSERT_EQ(client->getState(), NSockClosed);
+}
+
+
+TEST(NSockPairTest, HalfOpenRespondsAfterPeerEnd) {
+    auto [client, server] = NSock::pair();
+    ASSERT_TRUE(client && server);
+
+    // The server answers only once the whole request is in
+    string request;
+    bool serverError = false;
+    server->setAllowHalfOpen(true);
+    server->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        request.append((const char *)buf, len);
+        return (size_t)len;
+    });
+    server->setErrorFn([&] (NSockPtr sock, int error) {
+        serverError = true;
+    });
+    server->setEndFn([&] (NSockPtr sock) {
+        EXPECT_TRUE(sock->isReadShut());
+        string response = "got " + to_string(request.size());
+        EXPECT_EQ(sock->send((const uint8_t *)response.data(), response.size()),
+                  (int)response.size());
+        sock->end();
+    });
+
+    string response;
+    bool exitLoop = false;
+    int clientError = -1;
+    client->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        response.append((const char *)buf, len);
+        return (size_t)len;
+    });
+    client->setErrorFn([&] (NSockPtr sock, int error) {
+        // No onEnd: the server's FIN comes as error 0
+        clientError = error;
+        exitLoop = true;
+    });
+
+    string msg = "request";
+    ASSERT_EQ(client->send((const uint8_t *)msg.data(), msg.size()), (int)msg.size());
+    client->shutdown();
+    ASSERT_EQ(client->send((const uint8_t *)msg.data(), msg.size()), -EPIPE);
+    npollLoop(exitLoop);
+
+    ASSERT_FALSE(serverError);
+    ASSERT_EQ(request, msg);
+    ASSERT_EQ(response, "got 7");
+    ASSERT_EQ(clientError, 0);
+
+    // Both sides are done, so both are closed
+    ASSERT_EQ(client->getState(), NSockClosed);
+    ASSERT_EQ(server->getState(), NSockClosed);
+}
+
+/*
+ * A -> B =pipe=> C -> D, with D slow to start, so B has to wait on the pipe.
+ */
+TEST(NSockPairTest, PipeSplicesWithBackpressure) {
+    auto [a, b] = NSock::pair();
+    auto [c, d] = NSock::pair();
+    ASSERT_TRUE(a && b && c && d);
+
+    // Some data B got before the pipe goes first
+    string early = "early bird ";
+    ASSERT_EQ(a->send((const uint8_t *)early.data(), early.size()), (int)early.size());
+    string bGot;
+    bool exitLoop = false;
+    b->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        bGot.append((const char *)buf, len);
+        exitLoop = true;
+        return (size_t)0;
+    });
+    npollLoop(exitLoop);
+    ASSERT_EQ(bGot, early);
+
+    ASSERT_EQ(b->pipe(c, 64 * 1024), 0);
+    b->setEndFn([&] (NSockPtr sock) {
+        c->shutdown();
+    });
+
+    string dGot;
+    d->pause();
+    d->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        dGot.append((const char *)buf, len);
+        return (size_t)len;
+    });
+    d->setEndFn([&] (NSockPtr sock) {
+        exitLoop = true;
+    });
+
+    // A counting pattern, so reordering or loss shows
+    string sent = early;
+    size_t total = 4 * 1024 * 1024;
+    string chunk(16 * 1024, 0);
+    size_t next = 0;
+    auto pump = [&] (NSockPtr sock) {
+        while (sent.size() < total) {
+            for (size_t i = 0; i < chunk.size(); i++) {
+                chunk[i] = 'a' + (next + i) % 26;
+            }
+            int n = sock->send((const uint8_t *)chunk.data(), chunk.size());
+            if (n <= 0) {
+                return;
+            }
+            sent.append(chunk, 0, n);
+            next += n;
+        }
+        sock->shutdown();
+    };
+    a->setDrainFn(pump);
+    pump(a);
+
+    npollAddTimer(20, [&] () {
+        d->resume();
+    });
+    exitLoop = false;
+    npollLoop(exitLoop);
+
+    ASSERT_EQ(dGot.size(), sent.size());
+    ASSERT_TRUE(dGot == sent);
+    ASSERT_GT(b->getStats().pipeFullNr, 0UL);
+    ASSERT_EQ(b->getStats().splicedBytes, sent.size() - early.size());
+    ASSERT_EQ(c->getStats().splicedBytes, sent.size() - early.size());
+
+    for (auto &sock : {a, b, c, d}) {
+        sock->destroy();
+    }
+}
+
+TEST(NSockPairTest, SharedBufferFansOutWithoutCopies) {
+    vector<pair<NSockPtr, NSockPtr>> pairs;
+    vector<string> got(3);
+    string expected;
+    size_t doneNr = 0;
+    bool exitLoop = false;
+    for (size_t i = 0; i < got.size(); i++) {
+        pairs.push_back(NSock::pair());
+        ASSERT_TRUE(pairs[i].first && pairs[i].second);
+        pairs[i].second->setRecvFn([&, i] (NSockPtr sock, const uint8_t *buf, int len) {
+            got[i].append((const char *)buf, len);
+            if (got[i].size() == expected.size() && ++doneNr == got.size()) {
+                exitLoop = true;
+            }
+            return (size_t)len;
+        });
+    }
+
+    // Big enough to be queued behind a full kernel buffer
+    string payload(1024 * 1024, 0);
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = 'a' + i % 26;
+    }
+    auto shared = NBuffer::copy((const uint8_t *)payload.data(), payload.size());
+    string head = "head:", tail = ":tail";
+    expected = head + payload + tail;
+
+    for (auto &p : pairs) {
+        ASSERT_EQ(p.first->send((const uint8_t *)head.data(), head.size()), (int)head.size());
+        ASSERT_EQ(p.first->send(NBufSlice(shared)), (int)payload.size());
+        ASSERT_EQ(p.first->send((const uint8_t *)tail.data(), tail.size()), (int)tail.size());
+    }
+    ASSERT_GT(shared.use_count(), 1);
+
+    npollLoop(exitLoop);
+
+    for (size_t i = 0; i < got.size(); i++) {
+        ASSERT_TRUE(got[i] == expected);
+        ASSERT_EQ(pairs[i].first->getStats().sharedSendBytes, payload.size());
+        ASSERT_EQ(pairs[i].first->getQueuedBytes(), 0UL);
+    }
+
+    // Written everywhere, so only we hold it
+    ASSERT_EQ(shared.use_count(), 1);
+
+    // A slice goes out as it is
+    auto part = NBufSlice(shared).slice(26, 52);
+    ASSERT_EQ(part.size(), 52UL);
+    ASSERT_EQ(pairs[0].first->send(part.slice(26)), 26);
+    expected += payload.substr(52, 26);
+    doneNr = got.size() - 1;
+    exitLoop = false;
+    npollLoop(exitLoop);
+    ASSERT_TRUE(got[0] == expected);
+
+    for (auto &p : pairs) {
+        p.first->destroy();
+        p.second->destroy();
+    }
+}
+
+/*
+ * A -> B -> C -> D, with B keeping every slice it got and forwarding it as
+ * is: what B keeps must not be received over.
+ */
+TEST(NSockPairTest, RecvSlicesCanBeKeptAndForwarded) {
+    auto [a, b] = NSock::pair();
+    auto [c, d] = NSock::pair();
+    ASSERT_TRUE(a && b && c && d);
+
+    vector<NBufSlice> kept;
+    b->setRecvSliceFn([&] (NSockPtr sock, const NBufSlice &slice) {
+        kept.push_back(slice);
+        c->send(slice);
+        return slice.size();
+    });
+
+    string sent, dGot;
+    bool exitLoop = false;
+    size_t total = 2 * 1024 * 1024;
+    d->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        dGot.append((const char *)buf, len);
+        if (dGot.size() == total) {
+            exitLoop = true;
+        }
+        return (size_t)len;
+    });
+
+    string chunk(8 * 1024, 0);
+    auto pump = [&] (NSockPtr sock) {
+        while (sent.size() < total) {
+            for (size_t i = 0; i < chunk.size(); i++) {
+                chunk[i] = 'a' + (sent.size() + i) % 26;
+            }
+            int n = sock->send((const uint8_t *)chunk.data(), chunk.size());
+            if (n <= 0) {
+                return;
+            }
+            sent.append(chunk, 0, n);
+        }
+    };
+    a->setDrainFn(pump);
+    pump(a);
+    npollLoop(exitLoop);
+
+    string keptData;
+    for (auto &slice : kept) {
+        keptData.append((const char *)slice.data(), slice.size());
+    }
+    ASSERT_TRUE(keptData == sent);
+    ASSERT_TRUE(dGot == sent);
+    ASSERT_GT(b->getStats().recvBufSwapNr, 0UL);
+    ASSERT_EQ(c->getStats().sharedSendBytes, sent.size());
+
+    for (auto &sock : {a, b, c, d}) {
+        sock->destroy();
+    }
+}
+
+TEST(NSockPairTest, DestroyDiscardsQueuedData) {
+    auto [sender, receiver] = NSock::pair();
+    ASSERT_TRUE(sender && receiver);
+
+    receiver->pause();
+    vector<uint8_t> chunk(16 * 1024, 'd');
+    while (sender->send(chunk.data(), chunk.size()) > 0) {
+    }
+
+    size_t queued = sender->getStats().sendBytes;
+    ASSERT_GT(queued, 0UL);
+    sender->destroy();
+    ASSERT_EQ(sender->getState(), NSockClosed);
+    ASSERT_GT(sender->getStats().discardedBytes, 0UL);
+
+    receiver->destroy();
+}
+
+TEST(NSockPairTest, EgressSchedulerSharesByWeight) {
+    auto sched = NEgressScheduler::create(64 * 1024, 4 * 1024);
+    auto [heavy, heavyPeer] = NSock::pair();
+    auto [light, lightPeer] = NSock::pair();
+    ASSERT_TRUE(heavy && heavyPeer && light && lightPeer);
+
+    heavy->setEgressScheduler(sched, 3);
+    light->setEgressScheduler(sched, 1);
+
+    auto sink = [] (NSockPtr sock, const uint8_t *buf, int len) {
+        return (size_t)len;
+    };
+    heavyPeer->setRecvFn(sink);
+    lightPeer->setRecvFn(sink);
+
+    // Both keep their queues full
+    vector<uint8_t> chunk(16 * 1024, 'w');
+    auto pump = [&] (NSockPtr sock) {
+        while (sock->send(chunk.data(), chunk.size()) == (int)chunk.size()) {
+        }
+    };
+    heavy->setDrainFn(pump);
+    light->setDrainFn(pump);
+    pump(heavy);
+    pump(light);
+
+    bool exitLoop = false;
+    npollAddTimer(200, [&] () {
+        exitLoop = true;
+    });
+    npollLoop(exitLoop);
+
+    auto stat = sched->getStats();
+    ASSERT_GT(stat.capHitNr, 10UL);
+
+    double ratio = (double)heavy->getStats().sendBytes / light->getStats().sendBytes;
+    ASSERT_GT(ratio, 2.5);
+    ASSERT_LT(ratio, 3.5);
+
+    heavy->end();
+    heavyPeer->end();
+    light->end();
+    lightPeer->end();
+}
+
+
+/*
+ * Test the framers by feeding them an encoded stream cut into random pieces.
+ */
+class FramerTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        srand(::time(NULL));
+        for (size_t i = 0; i < 500; i++) {
+            size_t len = rand() % 300;
+            string frame;
+            for (size_t j = 0; j < len; j++) {
+                frame += 'a' + (i + j) % 26;
+            }
+            frames.push_back(frame);
+        }
+    }
+
+    /* Feed the stream in random sized pieces, return the frames received */
+    vector<string> feedInPieces(NFramerPtr framer, const string &stream) {
+        size_t off = 0;
+        while (off < stream.size()) {
+            size_t len = min(stream.size() - off, (size_t)(rand() % 700 + 1));
+            size_t consumed = framer->feed(nullptr, (const uint8_t *)stream.data() + off, len);
+            EXPECT_EQ(consumed, len);
+            off += len;
+        }
+        return received;
+    }
+
+    NFrameFunc frameFn = [this] (NSockPtr sock, const uint8_t *frame, size_t len) {
+        received.emplace_back((const char *)frame, len);
+        return true;
+    };
+
+    vector<string> frames;
+    vector<string> received;
+};
+
+TEST_F(FramerTest, FixedHeader) {
+    auto framer = make_shared<NFixedHeaderFramer>(frameFn, 1024, 6, 2, 4);
+
+    string stream;
+    for (auto &frame : frames) {
+        uint32_t len = frame.size();
+        stream += string("\x01\x02", 2);
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            stream += (char)((len >> shift) & 0xff);
+        }
+        stream += frame;
+    }
+
+    ASSERT_EQ(feedInPieces(framer, stream), frames);
+    auto stat = framer->getStats();
+    ASSERT_EQ(stat.frameNr, frames.size());
+    ASSERT_LT(stat.copiedFrameNr, stat.frameNr);
+}
+
+TEST_F(FramerTest, Varint) {
+    auto framer = make_shared<NVarintFramer>(frameFn, 1024);
+
+    string stream;
+    for (auto &frame : frames) {
+        size_t len = frame.size();
+        do {
+            uint8_t byte = len & 0x7f;
+            len >>= 7;
+            stream += (char)(len ? byte | 0x80 : byte);
+        } while (len);
+        stream += frame;
+    }
+
+    ASSERT_EQ(feedInPieces(framer, stream), frames);
+}
+
+TEST_F(FramerTest, Delimiter) {
+    auto framer = make_shared<NDelimiterFramer>(frameFn, 1024, "\r\n");
+
+    string stream;
+    for (auto &frame : frames) {
+        stream += frame + "\r\n";
+    }
+
+    ASSERT_EQ(feedInPieces(framer, stream), frames);
+}
+
+TEST_F(FramerTest, TooLarge) {
+    auto framer = make_shared<NDelimiterFramer>(frameFn, 16);
+    int error = 0;
+    framer->setErrorFn([&] (NSockPtr sock, int err) {
+        error = err;
+    });
+
+    string stream = "short\n" + string(100, 'x') + "\nlost\n";
+    feedInPieces(framer, stream);
+
+    ASSERT_EQ(error, EMSGSIZE);
+    ASSERT_EQ(received, vector<string>{"short"});
+    ASSERT_EQ(framer->getStats().tooLargeNr, 1UL);
+}
+
+TEST_F(FramerTest, StopLeavesDataUnconsumed) {
+    auto framer = make_shared<NDelimiterFramer>([&] (NSockPtr, const uint8_t *frame, size_t len) {
+        received.emplace_back((const char *)frame, len);
+        return false;
+    }, 64);
+
+    string stream = "one\ntwo\n";
+    size_t consumed = framer->feed(nullptr, (const uint8_t *)stream.data(), stream.size());
+    ASSERT_EQ(consumed, 4UL);
+    ASSERT_EQ(received, vector<string>{"one"});
+}
+
+TEST_F(FramerTest, Lines) {
+    auto framer = make_shared<NLineFramer>(frameFn, 1024);
+
+    string stream;
+    for (size_t i = 0; i < frames.size(); i++) {
+        stream += frames[i] + (i % 2 ? "\r\n" : "\n");
+    }
+
+    ASSERT_EQ(feedInPieces(framer, stream), frames);
+}
+
+
+/*
+ * Every scanByte() implementation the CPU supports agrees with memchr, for
+ * all lengths and match positions around the vector widths.
+ */
+TEST(ScanTest, MatchesMemchr) {
+    vector<uint8_t> buf(300);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = 'a' + i % 26;
+    }
+
+    for (auto impl : {NScanScalar, NScanSse2, NScanAvx2}) {
+        if (!scanImplSupported(impl)) {
+            continue;
+        }
+
+        for (size_t len = 0; len < 200; len++) {
+            for (size_t pos = 0; pos <= len; pos++) {
+                auto saved = buf[pos];
+                if (pos < len) {
+                    buf[pos] = '\n';
+                }
+                auto expected = memchr(buf.data(), '\n', len);
+                ASSERT_EQ(scanByteWith(impl, buf.data(), len, '\n'), expected)
+                    << scanImplName(impl) << " len=" << len << " pos=" << pos;
+                buf[pos] = saved;
+            }
+        }
+    }
+}
+
+
+/*
+ * The broker's subscriptions: '+' is one level, '#' any number of them.
+ */
+TEST(BrokerTest, TopicTrieMatchesWildcards) {
+    TopicTrie trie;
+    auto exact = make_shared<BrokerClient>();
+    auto plus = make_shared<BrokerClient>();
+    auto hash = make_shared<BrokerClient>();
+    ASSERT_TRUE(trie.subscribe("a/b", exact));
+    ASSERT_TRUE(trie.subscribe("a/+", plus));
+    ASSERT_TRUE(trie.subscribe("a/#", hash));
+    ASSERT_FALSE(trie.subscribe("a/b", exact));
+    ASSERT_FALSE(trie.subscribe("a/#/b", exact));
+    ASSERT_FALSE(trie.subscribe("a/b+", exact));
+    ASSERT_FALSE(TopicTrie::validTopic("a/+"));
+
+    uint64_t seq = 0;
+    auto match = [&] (const string &topic) {
+        vector<BrokerClientPtr> clients;
+        trie.match(topic, ++seq, clients);
+        return set<BrokerClientPtr>(clients.begin(), clients.end());
+    };
+    ASSERT_TRUE(match("a/b") == (set<BrokerClientPtr>{exact, plus, hash}));
+    ASSERT_TRUE(match("a/c") == (set<BrokerClientPtr>{plus, hash}));
+    ASSERT_TRUE(match("a") == (set<BrokerClientPtr>{hash}));
+    ASSERT_TRUE(match("a/b/c") == (set<BrokerClientPtr>{hash}));
+    ASSERT_TRUE(match("b/a").empty());
+}
+
+TEST(BrokerTest, TopicTrieDeliversOncePerClient) {
+    TopicTrie trie;
+    auto client = make_shared<BrokerClient>();
+    auto other = make_shared<BrokerClient>();
+    for (auto pattern : {"x/y", "x/+", "+/y", "x/#", "#"}) {
+        ASSERT_TRUE(trie.subscribe(pattern, client));
+    }
+    ASSERT_TRUE(trie.subscribe("x/y", other));
+
+    vector<BrokerClientPtr> clients;
+    trie.match("x/y", 1, clients);
+    ASSERT_EQ(clients.size(), 2UL);
+
+    // The next message gets them again
+    clients.clear();
+    trie.match("x/y", 2, clients);
+    ASSERT_EQ(clients.size(), 2UL);
+}
+
+TEST(BrokerTest, TopicTriePrunesOnUnsubscribe) {
+    TopicTrie trie;
+    auto client = make_shared<BrokerClient>();
+    auto other = make_shared<BrokerClient>();
+    ASSERT_TRUE(trie.subscribe("a/b/c", client));
+    ASSERT_TRUE(trie.subscribe("a/x", client));
+    ASSERT_TRUE(trie.subscribe("a/x", other));
+    ASSERT_EQ(trie.nodeNr(), 4UL);
+
+    ASSERT_TRUE(trie.unsubscribe("a/b/c", client));
+    ASSERT_EQ(trie.nodeNr(), 2UL);
+    ASSERT_FALSE(trie.unsubscribe("a/b/c", client));
+
+    // Still there for the other one
+    ASSERT_TRUE(trie.unsubscribe("a/x", client));
+    ASSERT_EQ(trie.nodeNr(), 2UL);
+    ASSERT_TRUE(trie.unsubscribe("a/x", other));
+    ASSERT_EQ(trie.nodeNr(), 0UL);
+
+    vector<BrokerClientPtr> clients;
+    trie.match("a/x", 1, clients);
+    ASSERT_TRUE(clients.empty());
+}
+
+/*
+ * A subscriber that doesn't read, under each slow consumer policy: drop skips
+ * messages while an earlier one is queued, buffer queues up to its limit and
+ * skips past it, and disconnect closes the subscriber once past it.
+ */
+TEST(BrokerTest, SlowSubscriberPolicies) {
+    auto broker = BrokerServer::createBrokerServer("127.0.0.1", 0);
+    ASSERT_TRUE(broker);
+    auto addr = broker->getListenSock()->getLocalAddr();
+    unsigned short port = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+
+    bool exitLoop = false;
+    auto runUntil = [&] (function<bool ()> done) {
+        auto start = chrono::steady_clock::now();
+        while (!done() && chrono::steady_clock::now() - start < chrono::seconds(5)) {
+            exitLoop = false;
+            npollAddTimer(5, [&] () {
+                exitLoop = true;
+            });
+            npollLoop(exitLoop);
+        }
+        return done();
+    };
+
+    struct Peer {
+        NSockPtr sock;
+        string got;
+        bool ended = false;
+    };
+    auto connect = [&] (shared_ptr<Peer> peer) {
+        peer->sock = NSock::connect("127.0.0.1", port,
+            [peer] (NSockPtr sock, const uint8_t *buf, int len) {
+                peer->got.append((const char *)buf, len);
+                return (size_t)len;
+            },
+            [peer] (NSockPtr sock, int error) {
+                peer->ended = true;
+            });
+        peer->sock->setEndFn([peer] (NSockPtr sock) {
+            peer->ended = true;
+        });
+    };
+    auto command = [&] (shared_ptr<Peer> peer, const string &line) {
+        string withNl = line + "\n";
+        peer->sock->send((const uint8_t *)withNl.data(), withNl.size());
+    };
+
+    auto pub = make_shared<Peer>();
+    connect(pub);
+    string payload(32 * 1024, 'p');
+    auto publish = [&] (size_t msgNr) {
+        string lines;
+        for (size_t i = 0; i < msgNr; i++) {
+            lines += "PUB t " + payload + "\n";
+        }
+        size_t sent = 0;
+        auto pump = [&] (NSockPtr sock) {
+            while (sent < lines.size()) {
+                int n = sock->send((const uint8_t *)lines.data() + sent, lines.size() - sent);
+                if (n <= 0) {
+                    return;
+                }
+                sent += n;
+            }
+        };
+        pub->sock->setDrainFn(pump);
+        pump(pub->sock);
+
+        uint64_t pubNr = broker->getStats().pubNr + msgNr;
+        runUntil([&] () {
+            return broker->getStats().pubNr == pubNr;
+        });
+        pub->sock->setDrainFn(nullptr);
+    };
+
+    // Enough to fill the kernel buffers between the broker and a subscriber
+    const size_t msgNr = 1000;
+    const size_t limit = 256 * 1024;
+    uint64_t deliverNr = 0, dropNr = 0;
+    for (auto policy : {"drop", "buffer", "disconnect"}) {
+        SCOPED_TRACE(policy);
+        auto sub = make_shared<Peer>();
+        connect(sub);
+        command(sub, string("POLICY ") + policy + " " + to_string(limit));
+        command(sub, "SUB t");
+        ASSERT_TRUE(runUntil([&] () {
+            return sub->got == "OK\nOK\n";
+        }));
+        sub->got.clear();
+        sub->sock->pause();
+
+        auto before = broker->getStats();
+        publish(msgNr);
+        auto stat = broker->getStats();
+        deliverNr = stat.deliverNr - before.deliverNr;
+        dropNr = stat.dropNr - before.dropNr;
+
+        if (string(policy) == "disconnect") {
+            ASSERT_EQ(stat.disconnectNr, before.disconnectNr + 1);
+            ASSERT_EQ(dropNr, 0UL);
+            ASSERT_LT(deliverNr, msgNr);
+            sub->sock->resume();
+            ASSERT_TRUE(runUntil([&] () {
+                return sub->ended;
+            }));
+        } else {
+            ASSERT_EQ(stat.disconnectNr, before.disconnectNr);
+            ASSERT_GT(dropNr, 0UL);
+            ASSERT_EQ(deliverNr + dropNr, msgNr);
+
+            // What was delivered comes through once it reads again
+            size_t msgLen = string("MSG t ").size() + payload.size() + 1;
+            sub->sock->resume();
+            ASSERT_TRUE(runUntil([&] () {
+                return sub->got.size() == deliverNr * msgLen;
+            }));
+            ASSERT_FALSE(sub->ended);
+        }
+        sub->sock->destroy();
+    }
+
+    pub->sock->destroy();
+    broker->getListenSock()->destroy();
+}
 
 int main(int argc, char *argv[]) {
     ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <random>
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "naccept.h"
+#include "ntimer.h"
+
+
+using namespace std;
+
+namespace nsock {
+
+
+NAcceptFilterPtr NAcceptFilter::create(uint32_t maxPerWindow, uint64_t windowMs,
+                                       size_t maxTracked) {
+    return make_shared<NAcceptFilter>(maxPerWindow, max<uint64_t>(windowMs, 1),
+                                      max<size_t>(maxTracked, sProbeNr));
+}
+
+
+NAcceptFilter::NAcceptFilter(uint32_t maxPerWindow, uint64_t windowMs, size_t maxTracked) :
+    maxPerWindow(maxPerWindow), windowMs(windowMs) {
+    // At most half full
+    size_t size = 1;
+    while (size < 2 * maxTracked) {
+        size <<= 1;
+    }
+    table.assign(size, Slot{{0, 0}, 0, 0, 0});
+    tableMask = size - 1;
+
+    random_device rd;
+    seed = ((uint64_t)rd() << 32) | rd();
+}
+
+
+int NAcceptFilter::allow(const string &cidr) {
+    Prefix prefix;
+    int err = parsePrefix(cidr, prefix);
+    if (err) {
+        return err;
+    }
+
+    allowList.push_back(prefix);
+    return 0;
+}
+
+
+int NAcceptFilter::deny(const string &cidr) {
+    Prefix prefix;
+    int err = parsePrefix(cidr, prefix);
+    if (err) {
+        return err;
+    }
+
+    denyList.push_back(prefix);
+    return 0;
+}
+
+
+bool NAcceptFilter::admit(const struct sockaddr_storage &addr) {
+    return admit(addr, NTimerWheel::nowMs());
+}
+
+
+bool NAcceptFilter::admit(const struct sockaddr_storage &addr, uint64_t nowMs) {
+    Key key;
+    if (!toKey(addr, key)) {
+        return true;
+    }
+
+    if (matches(allowList, key)) {
+        ++stat.allowNr;
+        return true;
+    }
+
+    if (matches(denyList, key)) {
+        ++stat.denyNr;
+        return false;
+    }
+
+    if (!maxPerWindow) {
+        ++stat.admitNr;
+        return true;
+    }
+
+    uint32_t window = nowMs / windowMs + 1;
+    double elapsed = (double)(nowMs % windowMs) / windowMs;
+    lastWindow = window;
+
+    // Find the address in its probe sequence, or else a free slot, or else
+    // the slot with the lowest count.
+    size_t base = hash(key);
+    Slot *found = nullptr;
+    Slot *freeSlot = nullptr;
+    Slot *victim = nullptr;
+    double victimCount = 0;
+    for (size_t i = 0; i < sProbeNr; i++) {
+        Slot &slot = table[(base + i) & tableMask];
+        bool live = slot.window && slot.window + 1 >= window;
+
+        if (live && slot.key == key) {
+            found = &slot;
+            break;
+        }
+
+        if (!live) {
+            if (!freeSlot) {
+                freeSlot = &slot;
+            }
+        } else if (!freeSlot) {
+            double count = estimate(slot, window, elapsed);
+            if (!victim || count < victimCount) {
+                victim = &slot;
+                victimCount = count;
+            }
+        }
+    }
+
+    if (!found) {
+        found = freeSlot;
+        if (!found) {
+            ++stat.evictNr;
+            found = victim;
+        }
+        *found = Slot{key, window, 0, 0};
+    }
+
+    // Roll the windows forward
+    if (found->window != window) {
+        found->prev = (found->window + 1 == window) ? found->cur : 0;
+        found->cur = 0;
+        found->window = window;
+    }
+
+    bool admitted = estimate(*found, window, elapsed) < maxPerWindow;
+    if (found->cur < UINT32_MAX) {
+        ++found->cur;
+    }
+
+    if (!admitted) {
+        ++stat.limitNr;
+        return false;
+    }
+
+    ++stat.admitNr;
+    return true;
+}
+
+
+size_t NAcceptFilter::trackedNr() const {
+    size_t n = 0;
+    for (auto &slot : table) {
+        if (slot.window && slot.window + 1 >= lastWindow) {
+            ++n;
+        }
+    }
+
+    return n;
+}
+
+
+double NAcceptFilter::estimate(const Slot &slot, uint32_t window, double elapsed) const {
+    if (slot.window == window) {
+        return slot.cur + slot.prev * (1 - elapsed);
+    }
+
+    // Last seen in the previous window
+    return slot.cur * (1 - elapsed);
+}
+
+
+size_t NAcceptFilter::hash(const Key &key) const {
+    // splitmix64 finalizer over both halves
+    uint64_t h = key.hi ^ seed;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h ^= key.lo;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    return (size_t)h;
+}
+
+
+static uint64_t loadBe64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+
+bool NAcceptFilter::toKey(const struct sockaddr_storage &addr, Key &key) {
+    if (addr.ss_family == AF_INET) {
+        auto sin = reinterpret_cast<const struct sockaddr_in *>(&addr);
+        key.hi = 0;
+        key.lo = 0xffff00000000ULL | ntohl(sin->sin_addr.s_addr);
+        return true;
+    }
+
+    if (addr.ss_family == AF_INET6) {
+        auto sin6 = reinterpret_cast<const struct sockaddr_in6 *>(&addr);
+        key.hi = loadBe64(sin6->sin6_addr.s6_addr);
+        key.lo = loadBe64(sin6->sin6_addr.s6_addr + 8);
+        return true;
+    }
+
+    return false;
+}
+
+
+int NAcceptFilter::parsePrefix(const string &cidr, Prefix &prefix) {
+    string host = cidr;
+    int len = -1;
+
+    size_t slash = cidr.find('/');
+    if (slash != string::npos) {
+        host = cidr.substr(0, slash);
+        char *end;
+        len = strtol(cidr.c_str() + slash + 1, &end, 10);
+        if (*end || end == cidr.c_str() + slash + 1 || len < 0) {
+            return -EINVAL;
+        }
+    }
+
+    struct sockaddr_storage addr = {0};
+    auto sin = reinterpret_cast<struct sockaddr_in *>(&addr);
+    auto sin6 = reinterpret_cast<struct sockaddr_in6 *>(&addr);
+    if (inet_pton(AF_INET, host.c_str(), &sin->sin_addr) == 1) {
+        addr.ss_family = AF_INET;
+        if (len > 32) {
+            return -EINVAL;
+        }
+        len = (len < 0) ? 128 : len + 96;
+    } else if (inet_pton(AF_INET6, host.c_str(), &sin6->sin6_addr) == 1) {
+        addr.ss_family = AF_INET6;
+        if (len > 128) {
+            return -EINVAL;
+        }
+        len = (len < 0) ? 128 : len;
+    } else {
+        return -EINVAL;
+    }
+
+    toKey(addr, prefix.addr);
+    prefix.len = len;
+
+    return 0;
+}
+
+
+bool NAcceptFilter::matches(const vector<Prefix> &prefixes, const Key &key) {
+    for (auto &prefix : prefixes) {
+        uint64_t hiMask = (prefix.len >= 64) ? UINT64_MAX :
+            (prefix.len ? UINT64_MAX << (64 - prefix.len) : 0);
+        uint64_t loMask = (prefix.len >= 128) ? UINT64_MAX :
+            (prefix.len > 64 ? UINT64_MAX << (128 - prefix.len) : 0);
+
+        if (((key.hi ^ prefix.addr.hi) & hiMask) == 0 &&
+            ((key.lo ^ prefix.addr.lo) & loMask) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+}
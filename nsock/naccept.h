@@ -0,0 +1,137 @@
+#ifndef _NACCEPT_H
+#define _NACCEPT_H
+
+#include <string>
+#include <sstream>
+#include <memory>
+#include <vector>
+
+#include <inttypes.h>
+#include <sys/socket.h>
+
+
+namespace nsock {
+
+struct AcceptFilterStat {
+    uint64_t admitNr = 0;       // counted, and under the limit
+    uint64_t allowNr = 0;       // on the allow list
+    uint64_t denyNr = 0;        // on the deny list
+    uint64_t limitNr = 0;       // over the limit
+    uint64_t evictNr = 0;       // live addresses pushed out of the table
+
+    std::string toString() const {
+        std::stringstream ss;
+
+        ss << "{"
+           << "admitNr:" << admitNr << ", "
+           << "allowNr:" << allowNr << ", "
+           << "denyNr:" << denyNr << ", "
+           << "limitNr:" << limitNr << ", "
+           << "evictNr:" << evictNr
+           << "}";
+
+        return ss.str();
+    }
+};
+
+
+class NAcceptFilter;
+typedef std::shared_ptr<NAcceptFilter> NAcceptFilterPtr;
+
+/*
+ * Decides, right after accept(), whether a connection from a remote address
+ * is let in. A listening socket with a filter (see NSock::setAcceptFilter())
+ * closes the others before allocating anything for them.
+ *
+ * - Addresses in an allow prefix always get in, and are not counted.
+ * - Addresses in a deny prefix never get in.
+ * - Any other address gets at most maxPerWindow connections per windowMs,
+ *   over a sliding window. Attempts over the limit count too, so a client
+ *   that keeps hammering stays out.
+ *
+ * The counts live in a fixed size open addressing table, sized for
+ * maxTracked addresses, with a short probe sequence. An address not seen
+ * for two windows frees its slot. When all the slots an address may go in
+ * are live, the one with the lowest count is evicted. The hash is seeded
+ * per filter, so clients can't pick addresses that collide.
+ *
+ * IPv4 addresses are handled as IPv4-mapped IPv6 ones, so "10.0.0.0/8" also
+ * matches ::ffff:10.1.2.3. Other address families (e.g. unix sockets) are
+ * always let in.
+ */
+class NAcceptFilter {
+public:
+    static NAcceptFilterPtr create(uint32_t maxPerWindow, uint64_t windowMs=1000,
+                                   size_t maxTracked=64*1024);
+
+    /* Add a prefix, e.g. "10.0.0.0/8", "2001:db8::/32" or "127.0.0.1" */
+    int allow(const std::string &cidr);
+    int deny(const std::string &cidr);
+
+    /* Let a connection from addr in, now or at nowMs (steady clock) */
+    bool admit(const struct sockaddr_storage &addr);
+    bool admit(const struct sockaddr_storage &addr, uint64_t nowMs);
+
+    /* Addresses with a live count */
+    size_t trackedNr() const;
+
+    AcceptFilterStat getStats() const {
+        return stat;
+    }
+
+    NAcceptFilter(uint32_t maxPerWindow, uint64_t windowMs, size_t maxTracked);
+
+private:
+    // An address, as IPv6
+    struct Key {
+        uint64_t hi;
+        uint64_t lo;
+
+        bool operator==(const Key &other) const {
+            return hi == other.hi && lo == other.lo;
+        }
+    };
+
+    struct Prefix {
+        Key addr;
+        uint32_t len;
+    };
+
+    // A slot is empty, or stale, if its window is older than the previous
+    // one. Windows are numbered from 1, so 0 is never live.
+    struct Slot {
+        Key key;
+        uint32_t window;
+        uint32_t cur;           // attempts in the current window
+        uint32_t prev;          // and in the previous one
+    };
+
+    static constexpr size_t sProbeNr = 8;
+
+    static bool toKey(const struct sockaddr_storage &addr, Key &key);
+    static int parsePrefix(const std::string &cidr, Prefix &prefix);
+    static bool matches(const std::vector<Prefix> &prefixes, const Key &key);
+
+    size_t hash(const Key &key) const;
+
+    /* The count of a live slot, in the current window */
+    double estimate(const Slot &slot, uint32_t window, double elapsed) const;
+
+    uint32_t maxPerWindow;
+    uint64_t windowMs;
+
+    std::vector<Prefix> allowList;
+    std::vector<Prefix> denyList;
+
+    std::vector<Slot> table;
+    size_t tableMask;
+    uint64_t seed;
+
+    uint32_t lastWindow = 0;
+
+    AcceptFilterStat stat;
+};
+
+}
+
+#endif
@@ -0,0 +1,378 @@
+#include <map>
+#include <memory>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nalloc.h"
+
+
+using namespace std;
+
+namespace nsock {
+
+// Chunks are aligned like malloc's
+static const size_t sChunkAlign = alignof(max_align_t);
+
+static const size_t sObjectSlabBytes = 64*1024;
+
+static const size_t sMinBufferShift = 6;       // 64 bytes
+static const size_t sMaxBufferShift = 22;      // 4MB
+static const size_t sBufferSlabBytes = 1024*1024;
+
+// Buffers under a page are cut from slabs of object size
+static const size_t sPageBufferShift = 12;
+
+static const size_t sHugePageSize = 2*1024*1024;
+
+
+/*
+ * Huge page arenas. Slabs are cut from the current 2MB arena; one larger
+ * than that gets an arena of its own. Arenas are never unmapped.
+ */
+static bool sUseHugePages = false;
+
+static uint8_t *sArena = nullptr;
+static size_t sArenaSize = 0;
+static size_t sArenaUsed = 0;
+
+static uint64_t sArenaNr = 0;
+static uint64_t sHugeTlbArenaNr = 0;
+static uint64_t sThpArenaNr = 0;
+static uint64_t sArenaBytes = 0;
+static uint64_t sArenaUsedBytes = 0;
+
+static uint8_t *mapArena(size_t size) {
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+        ++sHugeTlbArenaNr;
+    } else {
+        // No hugetlbfs pages: map a huge page aligned region, and ask for
+        // transparent huge pages
+        size_t mapSize = size + sHugePageSize;
+        mem = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+
+        uintptr_t start = (uintptr_t)mem;
+        uintptr_t aligned = (start + sHugePageSize - 1) & ~(sHugePageSize - 1);
+        if (aligned > start) {
+            munmap(mem, aligned - start);
+        }
+        if (aligned + size < start + mapSize) {
+            munmap((void *)(aligned + size), start + mapSize - aligned - size);
+        }
+        mem = (void *)aligned;
+
+        madvise(mem, size, MADV_HUGEPAGE);
+        ++sThpArenaNr;
+    }
+
+    ++sArenaNr;
+    sArenaBytes += size;
+
+    return static_cast<uint8_t *>(mem);
+}
+
+static void *arenaAlloc(size_t bytes) {
+    bytes = (bytes + sChunkAlign - 1) & ~(sChunkAlign - 1);
+
+    if (bytes > sHugePageSize) {
+        size_t size = (bytes + sHugePageSize - 1) & ~(sHugePageSize - 1);
+        void *mem = mapArena(size);
+        if (mem) {
+            sArenaUsedBytes += bytes;
+        }
+        return mem;
+    }
+
+    if (!sArena || sArenaUsed + bytes > sArenaSize) {
+        uint8_t *arena = mapArena(sHugePageSize);
+        if (!arena) {
+            return nullptr;
+        }
+        sArena = arena;
+        sArenaSize = sHugePageSize;
+        sArenaUsed = 0;
+    }
+
+    void *mem = sArena + sArenaUsed;
+    sArenaUsed += bytes;
+    sArenaUsedBytes += bytes;
+
+    return mem;
+}
+
+void nallocUseHugePages(bool on) {
+    sUseHugePages = on;
+}
+
+
+/*
+ * Mirrored buffers: reserve twice the size, then map the memfd over both
+ * halves.
+ */
+static bool sUseMirroredBuffers = false;
+
+static uint64_t sMirroredNr = 0;
+static uint64_t sMirroredBytes = 0;
+static uint64_t sMirrorFailNr = 0;
+
+size_t nallocMirrorSize(size_t size) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    return (max<size_t>(size, 1) + pageSize - 1) & ~(pageSize - 1);
+}
+
+void *nallocMirroredBuffer(size_t size) {
+    assert(size && size == nallocMirrorSize(size));
+
+    int fd = memfd_create("nsock-mirror", MFD_CLOEXEC);
+    if (fd < 0) {
+        ++sMirrorFailNr;
+        return nullptr;
+    }
+    if (ftruncate(fd, size)) {
+        close(fd);
+        ++sMirrorFailNr;
+        return nullptr;
+    }
+
+    auto area = static_cast<uint8_t *>(mmap(nullptr, 2 * size, PROT_NONE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (area == MAP_FAILED) {
+        close(fd);
+        ++sMirrorFailNr;
+        return nullptr;
+    }
+
+    for (auto half : {area, area + size}) {
+        if (mmap(half, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fd, 0) == MAP_FAILED) {
+            munmap(area, 2 * size);
+            close(fd);
+            ++sMirrorFailNr;
+            return nullptr;
+        }
+    }
+
+    // The mappings keep the memfd alive
+    close(fd);
+
+    ++sMirroredNr;
+    sMirroredBytes += size;
+
+    return area;
+}
+
+void nallocFreeMirroredBuffer(void *buf, size_t size) {
+    if (!buf) {
+        return;
+    }
+
+    munmap(buf, 2 * size);
+    --sMirroredNr;
+    sMirroredBytes -= size;
+}
+
+void nallocUseMirroredBuffers(bool on) {
+    sUseMirroredBuffers = on;
+}
+
+bool nallocUsingMirroredBuffers() {
+    return sUseMirroredBuffers;
+}
+
+
+NSlab::NSlab(size_t chunkSize, size_t slabBytes) :
+    chunkSize(chunkSize), chunksPerSlab(max<size_t>(1, slabBytes / chunkSize)) {
+    assert(chunkSize >= sizeof(FreeChunk) && chunkSize % sChunkAlign == 0);
+    stat.chunkSize = chunkSize;
+}
+
+NSlab::~NSlab() {
+    for (auto slab : slabs) {
+        ::free(slab);
+    }
+}
+
+
+bool NSlab::grow() {
+    size_t bytes = chunkSize * chunksPerSlab;
+    uint8_t *slab;
+
+    if (sUseHugePages) {
+        slab = static_cast<uint8_t *>(arenaAlloc(bytes));
+        if (!slab) {
+            return false;
+        }
+    } else {
+        slab = static_cast<uint8_t *>(malloc(bytes));
+        if (!slab) {
+            return false;
+        }
+        slabs.push_back(slab);
+    }
+    ++stat.slabNr;
+    stat.slabBytes += bytes;
+
+    // Chained so that the first chunk is used first
+    for (size_t i = chunksPerSlab; i-- > 0; ) {
+        auto chunk = reinterpret_cast<FreeChunk *>(slab + i * chunkSize);
+        chunk->next = freeList;
+        freeList = chunk;
+    }
+
+    return true;
+}
+
+
+void *NSlab::alloc() {
+    if (!freeList && !grow()) {
+        throw bad_alloc();
+    }
+
+    FreeChunk *chunk = freeList;
+    freeList = chunk->next;
+
+    ++stat.allocNr;
+    ++stat.inUseNr;
+    stat.peakInUseNr = max(stat.peakInUseNr, stat.inUseNr);
+
+    return chunk;
+}
+
+void NSlab::free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    auto chunk = static_cast<FreeChunk *>(ptr);
+    chunk->next = freeList;
+    freeList = chunk;
+
+    ++stat.freeNr;
+    --stat.inUseNr;
+}
+
+
+/*
+ * The slabs outlive everything, objects freed by static destructors included,
+ * so they are never deleted.
+ */
+static map<size_t, NSlab *> &objectSlabs() {
+    static auto slabs = new map<size_t, NSlab *>();
+    return *slabs;
+}
+
+static vector<NSlab *> &bufferSlabs() {
+    static auto slabs = [] () {
+        auto slabs = new vector<NSlab *>();
+        for (size_t shift = sMinBufferShift; shift <= sMaxBufferShift; shift++) {
+            size_t slabBytes = shift < sPageBufferShift ? sObjectSlabBytes : sBufferSlabBytes;
+            slabs->push_back(new NSlab(1UL << shift, slabBytes));
+        }
+        return slabs;
+    }();
+    return *slabs;
+}
+
+static uint64_t sLargeAllocNr = 0;
+static uint64_t sLargeInUseNr = 0;
+
+
+NSlab &nallocSlab(size_t size) {
+    size = (max(size, sizeof(void *)) + sChunkAlign - 1) & ~(sChunkAlign - 1);
+
+    auto &slab = objectSlabs()[size];
+    if (!slab) {
+        slab = new NSlab(size, sObjectSlabBytes);
+    }
+
+    return *slab;
+}
+
+
+/* The size class of a buffer of size bytes, or -1 if too large */
+static int bufferClass(size_t size) {
+    size_t shift = sMinBufferShift;
+    while ((1UL << shift) < size) {
+        if (++shift > sMaxBufferShift) {
+            return -1;
+        }
+    }
+
+    return shift - sMinBufferShift;
+}
+
+
+void *nallocBuffer(size_t size) {
+    int cls = bufferClass(size);
+    if (cls < 0) {
+        void *buf = malloc(size);
+        if (!buf) {
+            throw bad_alloc();
+        }
+        ++sLargeAllocNr;
+        ++sLargeInUseNr;
+        return buf;
+    }
+
+    return bufferSlabs()[cls]->alloc();
+}
+
+void nallocFreeBuffer(void *buf, size_t size) {
+    if (!buf) {
+        return;
+    }
+
+    int cls = bufferClass(size);
+    if (cls < 0) {
+        ::free(buf);
+        --sLargeInUseNr;
+        return;
+    }
+
+    bufferSlabs()[cls]->free(buf);
+}
+
+
+NAllocStat nallocGetStats() {
+    NAllocStat stat;
+
+    auto add = [&] (const SlabStat &slab, vector<SlabStat> &to) {
+        to.push_back(slab);
+        stat.slabBytes += slab.slabBytes;
+        stat.inUseBytes += slab.inUseNr * slab.chunkSize;
+    };
+
+    for (auto &kv : objectSlabs()) {
+        add(kv.second->getStats(), stat.objects);
+    }
+    for (auto slab : bufferSlabs()) {
+        add(slab->getStats(), stat.buffers);
+    }
+    stat.largeAllocNr = sLargeAllocNr;
+    stat.largeInUseNr = sLargeInUseNr;
+
+    stat.hugePages = sUseHugePages;
+    stat.arenaNr = sArenaNr;
+    stat.hugeTlbArenaNr = sHugeTlbArenaNr;
+    stat.thpArenaNr = sThpArenaNr;
+    stat.arenaBytes = sArenaBytes;
+    stat.arenaUsedBytes = sArenaUsedBytes;
+
+    stat.mirrored = sUseMirroredBuffers;
+    stat.mirroredNr = sMirroredNr;
+    stat.mirroredBytes = sMirroredBytes;
+    stat.mirrorFailNr = sMirrorFailNr;
+
+    return stat;
+}
+
+}
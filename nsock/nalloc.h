@@ -0,0 +1,238 @@
+#ifndef _NALLOC_H
+#define _NALLOC_H
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <new>
+
+#include <inttypes.h>
+#include <stddef.h>
+
+
+namespace nsock {
+
+/*
+ * Allocation for objects created and freed per connection: NSock objects
+ * (with their shared_ptr control blocks), the socket buffers and the shared
+ * NBuffers. With many short connections, that is a few large mallocs per
+ * accept, and as many frees when it closes.
+ *
+ * Instead, memory is carved into fixed size chunks, a slab at a time, and a
+ * freed chunk is kept on a free list for the next allocation of its size.
+ * Slabs are never given back: the footprint stays at the high water mark,
+ * rather than going up and down with the churn.
+ *
+ * With nallocUseHugePages(), slabs come from 2MB huge page arenas instead of
+ * malloc, so that many connections' buffers take few TLB entries.
+ *
+ * Mirrored buffers are the odd ones out: each is its own memfd, mapped twice.
+ *
+ * Like npoll, this belongs to the loop's thread, and is not thread safe.
+ */
+
+struct SlabStat {
+    size_t chunkSize = 0;
+    uint64_t slabNr = 0;
+    uint64_t slabBytes = 0;
+    uint64_t allocNr = 0;
+    uint64_t freeNr = 0;
+    uint64_t inUseNr = 0;
+    uint64_t peakInUseNr = 0;
+
+    std::string toString() const {
+        std::stringstream ss;
+
+        ss << "{"
+           << "chunkSize:" << chunkSize << ", "
+           << "slabNr:" << slabNr << ", "
+           << "slabBytes:" << slabBytes << ", "
+           << "allocNr:" << allocNr << ", "
+           << "freeNr:" << freeNr << ", "
+           << "inUseNr:" << inUseNr << ", "
+           << "peakInUseNr:" << peakInUseNr
+           << "}";
+
+        return ss.str();
+    }
+};
+
+struct NAllocStat {
+    std::vector<SlabStat> objects;      // NSlabAllocator, by object size
+    std::vector<SlabStat> buffers;      // nallocBuffer(), by size class
+
+    // nallocBuffer() sizes over the largest class, straight from malloc
+    uint64_t largeAllocNr = 0;
+    uint64_t largeInUseNr = 0;
+
+    // Memory held in slabs, and of it in use
+    uint64_t slabBytes = 0;
+    uint64_t inUseBytes = 0;
+
+    // Huge page arenas: mapped with MAP_HUGETLB, or as transparent huge
+    // pages when there are no hugetlbfs pages to be had
+    bool hugePages = false;
+    uint64_t arenaNr = 0;
+    uint64_t hugeTlbArenaNr = 0;
+    uint64_t thpArenaNr = 0;
+    uint64_t arenaBytes = 0;
+    uint64_t arenaUsedBytes = 0;
+
+    // nallocMirroredBuffer(): in use, their size (mapped twice), and the
+    // ones that fell back to a plain buffer
+    bool mirrored = false;
+    uint64_t mirroredNr = 0;
+    uint64_t mirroredBytes = 0;
+    uint64_t mirrorFailNr = 0;
+
+    std::string toString() const {
+        std::stringstream ss;
+
+        ss << "{"
+           << "slabBytes:" << slabBytes << ", "
+           << "inUseBytes:" << inUseBytes << ", "
+           << "largeAllocNr:" << largeAllocNr << ", "
+           << "largeInUseNr:" << largeInUseNr << ", "
+           << "hugePages:" << hugePages << ", "
+           << "arenaNr:" << arenaNr << ", "
+           << "hugeTlbArenaNr:" << hugeTlbArenaNr << ", "
+           << "thpArenaNr:" << thpArenaNr << ", "
+           << "arenaBytes:" << arenaBytes << ", "
+           << "arenaUsedBytes:" << arenaUsedBytes << ", "
+           << "mirrored:" << mirrored << ", "
+           << "mirroredNr:" << mirroredNr << ", "
+           << "mirroredBytes:" << mirroredBytes << ", "
+           << "mirrorFailNr:" << mirrorFailNr << ", "
+           << "objects:[";
+        for (size_t i = 0; i < objects.size(); i++) {
+            ss << (i ? ", " : "") << objects[i].toString();
+        }
+        ss << "], buffers:[";
+        for (size_t i = 0; i < buffers.size(); i++) {
+            ss << (i ? ", " : "") << buffers[i].toString();
+        }
+        ss << "]}";
+
+        return ss.str();
+    }
+};
+
+
+/*
+ * Chunks of one size.
+ */
+class NSlab {
+public:
+    NSlab(size_t chunkSize, size_t slabBytes);
+    ~NSlab();
+
+    void *alloc();
+    void free(void *chunk);
+
+    const SlabStat &getStats() const {
+        return stat;
+    }
+
+    NSlab(const NSlab &) = delete;
+    NSlab &operator=(const NSlab &) = delete;
+
+private:
+    struct FreeChunk {
+        FreeChunk *next;
+    };
+
+    bool grow();
+
+    size_t chunkSize;
+    size_t chunksPerSlab;
+    std::vector<void *> slabs;      // from malloc; arena ones stay mapped
+    FreeChunk *freeList = nullptr;
+
+    SlabStat stat;
+};
+
+/* The slab for objects of size bytes, made on first use */
+NSlab &nallocSlab(size_t size);
+
+
+/*
+ * An allocator for std::allocate_shared, so the object and its control block
+ * come from a slab.
+ */
+template <typename T>
+struct NSlabAllocator {
+    typedef T value_type;
+
+    NSlabAllocator() = default;
+
+    template <typename U>
+    NSlabAllocator(const NSlabAllocator<U> &) {
+    }
+
+    T *allocate(size_t n) {
+        if (n != 1) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        static NSlab &slab = nallocSlab(sizeof(T));
+        return static_cast<T *>(slab.alloc());
+    }
+
+    void deallocate(T *obj, size_t n) {
+        if (n != 1) {
+            ::operator delete(obj);
+            return;
+        }
+        static NSlab &slab = nallocSlab(sizeof(T));
+        slab.free(obj);
+    }
+
+    template <typename U>
+    bool operator==(const NSlabAllocator<U> &) const {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const NSlabAllocator<U> &) const {
+        return false;
+    }
+};
+
+
+/*
+ * Buffers, in power of two size classes from 64 bytes to 4MB. A buffer is at
+ * least size bytes; free it with the same size.
+ */
+void *nallocBuffer(size_t size);
+void nallocFreeBuffer(void *buf, size_t size);
+
+NAllocStat nallocGetStats();
+
+/*
+ * Take new slabs from huge page arenas (on), or malloc (off). Slabs made
+ * before stay where they are, so set this before creating sockets.
+ */
+void nallocUseHugePages(bool on);
+
+
+/*
+ * A buffer whose pages are mapped twice, back to back, so that buf[i] and
+ * buf[size + i] are the same byte: data that wraps around the end of a ring
+ * reads and writes as one piece. size must be a multiple of the page size
+ * (nallocMirrorSize() rounds it up). Return nullptr if it can't be mapped.
+ */
+void *nallocMirroredBuffer(size_t size);
+void nallocFreeMirroredBuffer(void *buf, size_t size);
+size_t nallocMirrorSize(size_t size);
+
+/*
+ * Give the sockets' send buffers (CircularBuffer) mirrored buffers (on), or
+ * plain ones (off). Each takes a memfd while it is being mapped and two
+ * mappings after, so mind vm.max_map_count with many sockets. Like huge
+ * pages, set this before creating sockets.
+ */
+void nallocUseMirroredBuffers(bool on);
+bool nallocUsingMirroredBuffers();
+
+}
+
+#endif
@@ -0,0 +1,36 @@
+#include <string.h>
+
+#include "nbuffer.h"
+#include "nalloc.h"
+
+
+using namespace std;
+
+namespace nsock {
+
+
+NBuffer::NBuffer(size_t len) :
+    buf(static_cast<uint8_t *>(nallocBuffer(len))), len(len) {
+}
+
+
+NBuffer::~NBuffer() {
+    nallocFreeBuffer(buf, len);
+}
+
+
+NBufferPtr NBuffer::create(size_t len, const function<void (uint8_t *buf)> &fillFn) {
+    auto buffer = allocate_shared<NBuffer>(NSlabAllocator<NBuffer>(), len);
+    fillFn(buffer->buf);
+
+    return buffer;
+}
+
+
+NBufferPtr NBuffer::copy(const uint8_t *buf, size_t len) {
+    return create(len, [=] (uint8_t *dst) {
+        memcpy(dst, buf, len);
+    });
+}
+
+}
@@ -0,0 +1,112 @@
+#ifndef _NBUFFER_H
+#define _NBUFFER_H
+
+#include <memory>
+#include <functional>
+#include <algorithm>
+
+#include <inttypes.h>
+#include <assert.h>
+
+
+namespace nsock {
+
+class NBuffer;
+typedef std::shared_ptr<const NBuffer> NBufferPtr;
+
+/*
+ * An immutable, reference counted buffer. Filled once when it is created,
+ * then shared: NSock::send(NBufSlice) queues a reference instead of a copy,
+ * so a message fanned out to many sockets is in memory once, and freed when
+ * the last socket has written it.
+ *
+ * The memory is a buffer from nalloc, in its size class, so like nalloc this
+ * belongs to the loop's thread: drop the last reference there.
+ */
+class NBuffer {
+public:
+    /* A buffer of len bytes, filled by fillFn */
+    static NBufferPtr create(size_t len, const std::function<void (uint8_t *buf)> &fillFn);
+
+    /* A copy of buf */
+    static NBufferPtr copy(const uint8_t *buf, size_t len);
+
+    const uint8_t *data() const {
+        return buf;
+    }
+
+    size_t size() const {
+        return len;
+    }
+
+    NBuffer(size_t len);
+    ~NBuffer();
+
+    NBuffer(const NBuffer &) = delete;
+    NBuffer &operator=(const NBuffer &) = delete;
+
+private:
+    // NSock receives into its buffer, past what it has handed out
+    friend class NSock;
+
+    uint8_t *buf;
+    size_t len;
+};
+
+
+/*
+ * A view into an NBuffer, holding a reference to it. Cheap to copy, and to
+ * slice further.
+ */
+class NBufSlice {
+public:
+    NBufSlice() {
+    }
+
+    NBufSlice(NBufferPtr buffer) :
+        buffer(buffer), off(0), len(buffer ? buffer->size() : 0) {
+    }
+
+    NBufSlice(NBufferPtr buffer, size_t off, size_t len) :
+        buffer(buffer), off(off), len(len) {
+        assert(buffer && off + len <= buffer->size());
+    }
+
+    const uint8_t *data() const {
+        return buffer ? buffer->data() + off : nullptr;
+    }
+
+    size_t size() const {
+        return len;
+    }
+
+    bool empty() const {
+        return len == 0;
+    }
+
+    /* The part from off on, at most len bytes */
+    NBufSlice slice(size_t from, size_t sliceLen=SIZE_MAX) const {
+        from = std::min(from, len);
+        return NBufSlice(buffer, off + from, std::min(sliceLen, len - from));
+    }
+
+    /* Drop the first n bytes */
+    void advance(size_t n) {
+        n = std::min(n, len);
+        off += n;
+        len -= n;
+    }
+
+    const NBufferPtr &getBuffer() const {
+        return buffer;
+    }
+
+private:
+    NBufferPtr buffer;
+    size_t off = 0;
+    size_t len = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,478 @@
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <sstream>
+
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <netinet/udp.h>
+
+#include "ndgram.h"
+#include "npoll.h"
+#include "util.h"
+
+
+using namespace std;
+using namespace npoll;
+
+namespace nsock {
+
+// Largest UDP payload, and the largest GSO super-packet
+static const size_t sMaxDgramSize = 65507;
+
+
+static socklen_t sockAddrLen(const struct sockaddr_storage &addr) {
+    return addr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) :
+                                        sizeof(struct sockaddr_in);
+}
+
+
+static bool sameAddr(const struct sockaddr_storage &a, const struct sockaddr_storage &b) {
+    return a.ss_family == b.ss_family && memcmp(&a, &b, sockAddrLen(a)) == 0;
+}
+
+
+NDgram::NDgram(int sfd) :
+    sockfd(sfd) {
+}
+
+
+NDgram::~NDgram() {
+    log("%s: fd=%d\n", __FUNCTION__, sockfd);
+    close();
+}
+
+
+bool NDgram::resolve(const string &host, unsigned short port,
+                     struct sockaddr_storage &addr) {
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo *result;
+    int err = getaddrinfo(host.empty() ? NULL : host.c_str(),
+                          to_string(port).c_str(),
+                          &hints,
+                          &result);
+    if (err) {
+        log("%s: failed getaddrinfo(): %s\n", __FUNCTION__, gai_strerror(err));
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+
+    return true;
+}
+
+
+/*
+ * Create a UDP socket.
+ */
+NDgramPtr NDgram::bind(const string &host, unsigned short port,
+                       NDgramOnRecvFunc recvFn,
+                       NDgramOnErrorFunc errorFn) {
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;     // Allow IPv4 or IPv6
+    hints.ai_socktype = SOCK_DGRAM;  // datagram socket
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_protocol = 0;           // Any protocol
+
+    struct addrinfo *result, *rp;
+    int err = getaddrinfo(host.empty() ? NULL : host.c_str(),
+                          to_string(port).c_str(),
+                          &hints,
+                          &result);
+    if (err) {
+        stringstream ss;
+        ss << "Failed getaddrinfo(): " << gai_strerror(err) << endl;
+        throw runtime_error(ss.str());
+    }
+
+    int sfd = -1;
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sfd == -1)
+            continue;
+
+        err = ::bind(sfd, rp->ai_addr, rp->ai_addrlen);
+        if (!err)
+            break;
+
+        ::close(sfd);
+        sfd = -1;
+    }
+
+    freeaddrinfo(result);
+
+    if (sfd == -1) {
+        stringstream ss;
+        ss << "Failed bind(): " << errno << endl;
+        throw runtime_error(ss.str());
+    }
+
+    struct sockaddr_storage localAddr;
+    socklen_t slen = sizeof (localAddr);
+    err = getsockname(sfd, reinterpret_cast<struct sockaddr *>(&localAddr), &slen);
+    if (err) {
+        log("%s: Failed getsockname(): %d\n", __FUNCTION__, errno);
+        ::close(sfd);
+        return nullptr;
+    }
+
+    err = setnonblocking(sfd);
+    if (err) {
+        log("%s: Failed setnonblocking(): %d\n", __FUNCTION__, errno);
+        ::close(sfd);
+        return nullptr;
+    }
+
+    auto sock = make_shared<NDgram>(sfd);
+    sock->localAddr = localAddr;
+    sock->onRecv = recvFn;
+    sock->onError = errorFn;
+    sock->allocBuffers();
+
+    sock->monitorSocket();
+
+    return sock;
+}
+
+
+void NDgram::allocBuffers() {
+    recvPool.resize(batchNr * recvSlotSize);
+    recvMsgs.resize(batchNr);
+    recvIovs.resize(batchNr);
+    recvCtrls.resize(batchNr);
+    recvAddrs.resize(batchNr);
+
+    sendMsgs.resize(batchNr);
+    sendIovs.resize(batchNr);
+    sendCtrls.resize(batchNr);
+    sendMsgEntryNr.resize(batchNr);
+}
+
+
+void NDgram::setBatchSize(size_t n) {
+    assert(n > 0);
+    batchNr = n;
+    allocBuffers();
+}
+
+
+int NDgram::enableGso(uint16_t segSize) {
+    // flush() asks for segmentation per message with a UDP_SEGMENT cmsg, so
+    // that lone datagrams larger than segSize are left alone. Setting the
+    // socket option to 0 only checks that the kernel supports it.
+    int val = 0;
+    int err = setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val));
+    if (err) {
+        log("%s: failed setsockopt(UDP_SEGMENT): %d\n", __FUNCTION__, errno);
+        ++stat.sysErrorNr;
+        return -errno;
+    }
+
+    gsoSize = segSize;
+    return 0;
+}
+
+
+int NDgram::enableGro() {
+    int val = 1;
+    int err = setsockopt(sockfd, SOL_UDP, UDP_GRO, &val, sizeof(val));
+    if (err) {
+        log("%s: failed setsockopt(UDP_GRO): %d\n", __FUNCTION__, errno);
+        ++stat.sysErrorNr;
+        return -errno;
+    }
+
+    // A coalesced GRO packet can be as large as a datagram can be
+    groEnabled = true;
+    recvSlotSize = sMaxDgramSize;
+    allocBuffers();
+    return 0;
+}
+
+
+/*
+ * Queue a datagram, flushing the queue first if it is full.
+ */
+int NDgram::send(const uint8_t *buf, size_t bufLen, const struct sockaddr_storage &dest) {
+    if (bufLen > sMaxDgramSize) {
+        return -EMSGSIZE;
+    }
+
+    // With GSO, a batch entry may carry up to sMaxGsoSegments datagrams
+    size_t queueMax = batchNr * (gsoSize ? sMaxGsoSegments : 1);
+    if (sendQueue.size() >= queueMax) {
+        flush();
+        if (sendQueue.size() >= queueMax) {
+            return 0;
+        }
+    }
+
+    size_t offset = sendData.size();
+    sendData.insert(sendData.end(), buf, buf + bufLen);
+    sendQueue.push_back({offset, bufLen, dest});
+
+    if (sendQueue.size() >= queueMax && !sendBlocked) {
+        flush();
+    }
+
+    return bufLen;
+}
+
+
+/*
+ * Write the queued datagrams with sendmmsg().
+ */
+int NDgram::flush() {
+    size_t entryIdx = 0;
+    int sentNr = 0;
+
+    while (entryIdx < sendQueue.size()) {
+        // Build a batch of messages. With GSO, a run of segSize datagrams to
+        // the same destination (the last one may be shorter) becomes one
+        // message; they are back to back in sendData, so one iovec will do.
+        // An empty datagram can't be a segment and always goes on its own.
+        size_t msgNr = 0;
+        size_t idx = entryIdx;
+        while (msgNr < batchNr && idx < sendQueue.size()) {
+            const SendEntry &first = sendQueue[idx];
+            size_t segNr = 1;
+            size_t len = first.len;
+
+            if (gsoSize && first.len == gsoSize) {
+                while (idx + segNr < sendQueue.size() && segNr < sMaxGsoSegments) {
+                    const SendEntry &next = sendQueue[idx + segNr];
+                    if (!sameAddr(next.dest, first.dest) ||
+                        next.len > gsoSize || next.len == 0 ||
+                        len + next.len > sMaxDgramSize) {
+                        break;
+                    }
+                    len += next.len;
+                    ++segNr;
+                    if (next.len < gsoSize) {
+                        break;
+                    }
+                }
+            }
+
+            struct mmsghdr &mmsg = sendMsgs[msgNr];
+            memset(&mmsg, 0, sizeof(mmsg));
+            sendIovs[msgNr].iov_base = sendData.data() + first.offset;
+            sendIovs[msgNr].iov_len = len;
+            mmsg.msg_hdr.msg_iov = &sendIovs[msgNr];
+            mmsg.msg_hdr.msg_iovlen = 1;
+            mmsg.msg_hdr.msg_name = const_cast<struct sockaddr_storage *>(&first.dest);
+            mmsg.msg_hdr.msg_namelen = sockAddrLen(first.dest);
+
+            if (segNr > 1) {
+                mmsg.msg_hdr.msg_control = sendCtrls[msgNr].buf;
+                mmsg.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                struct cmsghdr *cm = CMSG_FIRSTHDR(&mmsg.msg_hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segSize = gsoSize;
+                memcpy(CMSG_DATA(cm), &segSize, sizeof(segSize));
+            }
+
+            sendMsgEntryNr[msgNr] = segNr;
+            idx += segNr;
+            ++msgNr;
+        }
+
+        int n = sendmmsg(sockfd, sendMsgs.data(), msgNr, 0);
+        ++stat.sendCallNr;
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sendBlocked = true;
+                break;
+            }
+
+            // Drop the offending message so we don't get stuck on it
+            log("%s: sendmmsg fatal error: %d\n", __FUNCTION__, errno);
+            ++stat.sendErrorNr;
+            entryIdx += sendMsgEntryNr[0];
+            handleError(errno);
+            if (sockfd == -1) {
+                // onError closed us
+                break;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            stat.sendPackets += sendMsgEntryNr[i];
+            stat.sendBytes += sendMsgs[i].msg_len;
+            sentNr += sendMsgEntryNr[i];
+            entryIdx += sendMsgEntryNr[i];
+        }
+
+        if ((size_t)n < msgNr) {
+            // The kernel is full, wait for EPOLLOUT
+            sendBlocked = true;
+            break;
+        }
+    }
+
+    // Remove what was sent, keep the rest at the front of sendData
+    if (entryIdx == sendQueue.size()) {
+        sendQueue.clear();
+        sendData.clear();
+    } else if (entryIdx) {
+        size_t base = sendQueue[entryIdx].offset;
+        sendData.erase(sendData.begin(), sendData.begin() + base);
+        sendQueue.erase(sendQueue.begin(), sendQueue.begin() + entryIdx);
+        for (auto &entry : sendQueue) {
+            entry.offset -= base;
+        }
+    }
+
+    return sentNr;
+}
+
+
+/*
+ * Receive datagrams in batches until the socket is drained, and call onRecv
+ * for each one.
+ */
+void NDgram::recvFromSocket() {
+    auto self = shared_from_this();
+
+    while (sockfd != -1) {
+        for (size_t i = 0; i < batchNr; i++) {
+            recvIovs[i].iov_base = recvPool.data() + i * recvSlotSize;
+            recvIovs[i].iov_len = recvSlotSize;
+
+            struct msghdr &hdr = recvMsgs[i].msg_hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_iov = &recvIovs[i];
+            hdr.msg_iovlen = 1;
+            hdr.msg_name = &recvAddrs[i];
+            hdr.msg_namelen = sizeof(recvAddrs[i]);
+            if (groEnabled) {
+                hdr.msg_control = recvCtrls[i].buf;
+                hdr.msg_controllen = sizeof(recvCtrls[i].buf);
+            }
+        }
+
+        int n = recvmmsg(sockfd, recvMsgs.data(), batchNr, MSG_DONTWAIT, nullptr);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+
+            log("%s: recvmmsg fatal error: %d\n", __FUNCTION__, errno);
+            ++stat.recvErrorNr;
+            handleError(errno);
+            return;
+        }
+
+        ++stat.recvCallNr;
+
+        for (int i = 0; i < n && sockfd != -1; i++) {
+            struct msghdr &hdr = recvMsgs[i].msg_hdr;
+            const uint8_t *buf = static_cast<const uint8_t *>(recvIovs[i].iov_base);
+            size_t len = recvMsgs[i].msg_len;
+
+            if (hdr.msg_flags & MSG_TRUNC) {
+                ++stat.recvTruncNr;
+            }
+
+            // A GRO packet carries several datagrams of segSize bytes
+            size_t segSize = len;
+            if (groEnabled) {
+                for (struct cmsghdr *cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+                    if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                        int gso;
+                        memcpy(&gso, CMSG_DATA(cm), sizeof(gso));
+                        segSize = gso;
+                    }
+                }
+            }
+
+            // An empty datagram is still a datagram: deliver it once
+            size_t off = 0;
+            do {
+                size_t segLen = min(segSize, len - off);
+                ++stat.recvPackets;
+                stat.recvBytes += segLen;
+                if (onRecv) {
+                    onRecv(self, buf + off, segLen, recvAddrs[i]);
+                }
+                off += segSize;
+            } while (off < len && sockfd != -1);
+        }
+
+        // A short batch means the socket is drained. New datagrams will
+        // trigger a new edge.
+        if ((size_t)n < batchNr) {
+            return;
+        }
+    }
+}
+
+
+void NDgram::handleError(int error) {
+    if (onError) {
+        onError(shared_from_this(), error);
+    }
+}
+
+
+void NDgram::monitorSocket() {
+    auto self = shared_from_this();
+    PollFunc cb = [=](int fd, uint32_t revents) -> void {
+        assert(fd == sockfd);
+
+        if ((EPOLLERR & revents)) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+            ++stat.sysErrorNr;
+            handleError(error);
+            return;
+        }
+
+        if (EPOLLIN & revents) {
+            self->recvFromSocket();
+        }
+
+        if ((EPOLLOUT & revents) && self->sendBlocked && sockfd != -1) {
+            self->sendBlocked = false;
+            self->flush();
+            if (self->sendQueue.empty() && onDrain) {
+                onDrain(self);
+            }
+        }
+    };
+
+    int err = npollAddFd(sockfd, EPOLLET|EPOLLIN|EPOLLOUT, cb);
+    if (err) {
+        ++stat.sysErrorNr;
+        handleError(errno);
+    }
+}
+
+
+void NDgram::close() {
+    if (sockfd == -1) {
+        return;
+    }
+
+    int err = npollRemoveFd(sockfd);
+    if (err) {
+        log("%s: failed npollRemoveFd\n", __FUNCTION__);
+    }
+
+    ::close(sockfd);
+    sockfd = -1;
+}
+
+
+}
@@ -0,0 +1,179 @@
+#ifndef _NDGRAM_H
+#define _NDGRAM_H
+
+#include <string>
+#include <sstream>
+#include <memory>
+#include <functional>
+#include <vector>
+
+#include <inttypes.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+
+namespace nsock {
+
+class NDgram;
+typedef std::shared_ptr<NDgram> NDgramPtr;
+typedef std::function<void (NDgramPtr sock, const uint8_t *buf, size_t len,
+                            const struct sockaddr_storage &from)> NDgramOnRecvFunc;
+typedef std::function<void (NDgramPtr sock)> NDgramOnDrainFunc;
+typedef std::function<void (NDgramPtr sock, int error)> NDgramOnErrorFunc;
+
+struct DgramStat {
+    uint64_t recvPackets = 0;
+    uint64_t recvBytes = 0;
+    uint64_t recvCallNr = 0;   // recvmmsg() calls
+    uint64_t recvTruncNr = 0;  // datagrams truncated by a small slot
+
+    uint64_t sendPackets = 0;
+    uint64_t sendBytes = 0;
+    uint64_t sendCallNr = 0;   // sendmmsg() calls
+
+    // errors
+    uint64_t sysErrorNr = 0;
+    uint64_t recvErrorNr = 0;
+    uint64_t sendErrorNr = 0;
+
+    std::string toString() const {
+        std::stringstream ss;
+
+        ss << "{"
+           << "recvPackets:" << recvPackets << ", "
+           << "recvBytes:" << recvBytes << ", "
+           << "recvCallNr:" << recvCallNr << ", "
+           << "recvTruncNr:" << recvTruncNr << ", "
+           << "sendPackets:" << sendPackets << ", "
+           << "sendBytes:" << sendBytes << ", "
+           << "sendCallNr:" << sendCallNr << ", "
+
+           << "sysErrorNr:" << sysErrorNr << ", "
+           << "recvErrorNr:" << recvErrorNr << ", "
+           << "sendErrorNr:" << sendErrorNr
+           << "}";
+
+        return ss.str();
+    }
+};
+
+/*
+ * A UDP socket. Datagrams are received in batches with recvmmsg() into a pool
+ * of fixed size slots, and onRecv is called once per datagram. Outgoing
+ * datagrams are queued by send() and written in batches with sendmmsg() when
+ * the batch is full, or on flush().
+ *
+ * With GSO enabled, consecutive queued datagrams of segSize bytes to the same
+ * destination go out as one UDP_SEGMENT super-packet. With GRO enabled, the
+ * kernel may hand us several datagrams in one slot, which are split up again
+ * before calling onRecv.
+ */
+class NDgram : public std::enable_shared_from_this<NDgram> {
+public:
+    static const size_t sDefaultBatchNr = 64;
+    static const size_t sDefaultSlotSize = 2048;
+    static const size_t sMaxGsoSegments = 64;
+
+    /*
+     * Create a UDP socket bound to host:port. Use port 0 for an ephemeral
+     * port.
+     */
+    static NDgramPtr bind(const std::string &host, unsigned short port,
+                          NDgramOnRecvFunc recvFn,
+                          NDgramOnErrorFunc errorFn);
+
+    /* Resolve host:port to a destination address for send() */
+    static bool resolve(const std::string &host, unsigned short port,
+                        struct sockaddr_storage &addr);
+
+    /*
+     * Queue one datagram. Return bufLen if queued, or 0 if the send queue is
+     * full and the kernel isn't taking any more right now. In that case, wait
+     * for onDrain.
+     */
+    int send(const uint8_t *buf, size_t bufLen, const struct sockaddr_storage &dest);
+
+    /* Write out the queued datagrams. Return the number of datagrams sent */
+    int flush();
+
+    /* Set the number of datagrams per recvmmsg()/sendmmsg() call */
+    void setBatchSize(size_t batchNr);
+
+    /* Coalesce sends of segSize byte datagrams with UDP_SEGMENT */
+    int enableGso(uint16_t segSize);
+
+    /* Enable UDP_GRO for receives */
+    int enableGro();
+
+    void setDrainFn(NDgramOnDrainFunc drainFn) {
+        onDrain = drainFn;
+    }
+
+    struct sockaddr_storage getLocalAddr() const {
+        return localAddr;
+    }
+
+    DgramStat getStats() const {
+        return stat;
+    }
+
+    void close();
+
+    /* Constructor - don't call directly, use bind() */
+    NDgram(int sfd);
+    ~NDgram();
+
+private:
+    struct SendEntry {
+        size_t offset;
+        size_t len;
+        struct sockaddr_storage dest;
+    };
+
+    struct CtrlBuf {
+        alignas(struct cmsghdr) uint8_t buf[CMSG_SPACE(sizeof(int))];
+    };
+
+    void allocBuffers();
+    void recvFromSocket();
+    void handleError(int error);
+    void monitorSocket();
+
+    int sockfd = -1;
+    struct sockaddr_storage localAddr = {0};
+
+    NDgramOnRecvFunc onRecv;
+    NDgramOnDrainFunc onDrain;
+    NDgramOnErrorFunc onError;
+
+    size_t batchNr = sDefaultBatchNr;
+    uint16_t gsoSize = 0;
+    bool groEnabled = false;
+
+    // Receive slot pool: batchNr slots of recvSlotSize each, and the
+    // recvmmsg() arrays pointing into it.
+    size_t recvSlotSize = sDefaultSlotSize;
+    std::vector<uint8_t> recvPool;
+    std::vector<struct mmsghdr> recvMsgs;
+    std::vector<struct iovec> recvIovs;
+    std::vector<CtrlBuf> recvCtrls;
+    std::vector<struct sockaddr_storage> recvAddrs;
+
+    // Queued datagrams, back to back in sendData, and the sendmmsg() arrays.
+    // Kept separate from the receive side since onRecv may call send().
+    std::vector<uint8_t> sendData;
+    std::vector<SendEntry> sendQueue;
+    std::vector<struct mmsghdr> sendMsgs;
+    std::vector<struct iovec> sendIovs;
+    std::vector<CtrlBuf> sendCtrls;
+    std::vector<size_t> sendMsgEntryNr;
+    bool sendBlocked = false;
+
+    DgramStat stat;
+};
+
+}
+
+#endif
@@ -0,0 +1,133 @@
+#include <algorithm>
+
+#include "negress.h"
+#include "npoll.h"
+#include "util.h"
+
+
+using namespace std;
+using namespace npoll;
+
+namespace nsock {
+
+
+NEgressSchedulerPtr NEgressScheduler::create(size_t bytesPerIteration, size_t quantum) {
+    return make_shared<NEgressScheduler>(bytesPerIteration, max<size_t>(quantum, 1));
+}
+
+
+NEgressScheduler::~NEgressScheduler() {
+    if (runTimer) {
+        npollCancelTimer(runTimer);
+    }
+}
+
+
+/*
+ * Queue the socket, and make sure a round runs at the end of this iteration.
+ */
+void NEgressScheduler::activate(NSockPtr sock) {
+    if (!sock->egressQueued) {
+        sock->egressQueued = true;
+        classQueues[sock->egressClass].push_back(sock);
+    }
+
+    scheduleRun();
+}
+
+
+/*
+ * Run a round at the end of this iteration, or if that is where we are,
+ * at the end of the next one. The loop doesn't block on a due timer.
+ */
+void NEgressScheduler::scheduleRun() {
+    if (runTimer) {
+        return;
+    }
+
+    weak_ptr<NEgressScheduler> weakSelf = shared_from_this();
+    runTimer = npollAddTimer(0, [weakSelf] () {
+        auto self = weakSelf.lock();
+        if (self) {
+            self->runTimer = 0;
+            self->run();
+        }
+    });
+}
+
+
+void NEgressScheduler::run() {
+    size_t budget = bytesPerIteration ? bytesPerIteration : SIZE_MAX;
+
+    ++stat.runNr;
+
+    for (auto &kv : classQueues) {
+        auto &queue = kv.second;
+
+        while (budget && !queue.empty()) {
+            auto sock = queue.front().lock();
+            queue.pop_front();
+            if (!sock || sock->egress.get() != this) {
+                continue;
+            }
+
+            sock->egressQueued = false;
+            if (sock->sendQueueEmpty()) {
+                sock->egressDeficit = 0;
+                continue;
+            }
+
+            // A socket that has to wait out the budget keeps its deficit,
+            // and goes first next time.
+            size_t credit = quantum * sock->egressWeight;
+            if (sock->egressDeficit < credit) {
+                sock->egressDeficit += credit;
+            }
+
+            bool blocked = false;
+            size_t sent = sock->scheduledWrite(min(sock->egressDeficit, budget), blocked);
+
+            sock->egressDeficit -= min(sent, sock->egressDeficit);
+            budget -= min(sent, budget);
+            stat.sendBytes += sent;
+            stat.classBytes[kv.first] += sent;
+
+            if (sock->egressQueued) {
+                // onDrain sent more, and queued it again
+                continue;
+            }
+
+            if (sock->sendQueueEmpty()) {
+                sock->egressDeficit = 0;
+            } else if (blocked || sent == 0) {
+                // Back on EPOLLOUT, or when a rate limit lets it go on
+            } else {
+                sock->egressQueued = true;
+                if (budget == 0 && sock->egressDeficit) {
+                    queue.push_front(sock);
+                } else {
+                    queue.push_back(sock);
+                }
+            }
+        }
+
+        if (budget == 0) {
+            break;
+        }
+    }
+
+    bool pending = false;
+    for (auto &kv : classQueues) {
+        pending = pending || !kv.second.empty();
+    }
+
+    if (pending) {
+        if (budget == 0) {
+            ++stat.capHitNr;
+        }
+
+        scheduleRun();
+    }
+}
+
+}
@@ -0,0 +1,107 @@
+#ifndef _NEGRESS_H
+#define _NEGRESS_H
+
+#include <string>
+#include <sstream>
+#include <memory>
+#include <map>
+#include <deque>
+#include <functional>
+
+#include <inttypes.h>
+
+#include "nsock.h"
+
+
+namespace nsock {
+
+struct EgressStat {
+    uint64_t runNr = 0;         // scheduling rounds, at most one per iteration
+    uint64_t sendBytes = 0;
+    uint64_t capHitNr = 0;      // rounds that stopped at bytesPerIteration
+
+    // Bytes sent per priority class
+    std::map<int, uint64_t> classBytes;
+
+    std::string toString() const {
+        std::stringstream ss;
+
+        ss << "{"
+           << "runNr:" << runNr << ", "
+           << "sendBytes:" << sendBytes << ", "
+           << "capHitNr:" << capHitNr << ", "
+           << "classBytes:{";
+        bool first = true;
+        for (auto &kv : classBytes) {
+            ss << (first ? "" : ", ") << kv.first << ":" << kv.second;
+            first = false;
+        }
+        ss << "}}";
+
+        return ss.str();
+    }
+};
+
+
+class NEgressScheduler;
+typedef std::shared_ptr<NEgressScheduler> NEgressSchedulerPtr;
+
+/*
+ * An egress scheduler shared by the sockets of a loop. Instead of writing as
+ * soon as send() is called, a socket with pending data queues up here, and
+ * once per loop iteration the scheduler flushes the queued sockets:
+ *
+ * - Higher priority classes go first, strictly.
+ * - Within a class, deficit round robin: each turn a socket may write
+ *   quantum * weight bytes more, so the bytes sent are shared by weight no
+ *   matter who calls send() most.
+ * - At most bytesPerIteration bytes go out per iteration (0: no cap). The
+ *   rest waits for the next iteration, which models a saturated uplink and
+ *   keeps one iteration from running long.
+ *
+ * A socket blocked by the kernel (EAGAIN) leaves the queue until EPOLLOUT.
+ */
+class NEgressScheduler : public std::enable_shared_from_this<NEgressScheduler> {
+public:
+    static const size_t sDefaultQuantum = 16 * 1024;
+
+    static NEgressSchedulerPtr create(size_t bytesPerIteration=0,
+                                      size_t quantum=sDefaultQuantum);
+
+    void setBytesPerIteration(size_t bytes) {
+        bytesPerIteration = bytes;
+    }
+
+    EgressStat getStats() const {
+        return stat;
+    }
+
+    NEgressScheduler(size_t bytesPerIteration, size_t quantum) :
+        bytesPerIteration(bytesPerIteration), quantum(quantum) {
+    }
+
+    ~NEgressScheduler();
+
+private:
+    friend class NSock;
+
+    /* A socket has data to send */
+    void activate(NSockPtr sock);
+
+    /* One scheduling round */
+    void run();
+    void scheduleRun();
+
+    size_t bytesPerIteration;
+    size_t quantum;
+
+    // The sockets with pending data, by priority class, highest first
+    std::map<int, std::deque<std::weak_ptr<NSock>>, std::greater<int>> classQueues;
+    uint64_t runTimer = 0;
+
+    EgressStat stat;
+};
+
+}
+
+#endif
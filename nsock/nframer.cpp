@@ -0,0 +1,297 @@
+#include <algorithm>
+
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+
+#include "nframer.h"
+#include "nscan.h"
+#include "util.h"
+
+
+using namespace std;
+
+namespace nsock {
+
+
+size_t NFramer::feed(NSockPtr sock, const uint8_t *buf, size_t bufLen) {
+    size_t off = 0;
+
+    if (failed) {
+        return bufLen;
+    }
+
+    // First finish the frame that started in an earlier read, by copying just
+    // enough of buf to complete it.
+    while (!partial.empty()) {
+        FrameInfo info;
+        auto res = scanFrame(partial.data(), partial.size(), partialScanned, info);
+
+        if (res == FrameComplete) {
+            // While looking for the end of the frame, we may have copied past
+            // it. Those bytes are left in buf.
+            size_t extra = partial.size() - info.frameLen;
+            assert(extra <= off);
+            off -= extra;
+
+            ++stat.frameNr;
+            stat.frameBytes += info.payloadLen;
+            ++stat.copiedFrameNr;
+            stat.copiedBytes += info.payloadLen;
+
+            bool keepGoing = onFrame(sock, partial.data() + info.payloadOff, info.payloadLen);
+            partial.clear();
+            partialScanned = 0;
+            if (!keepGoing || failed) {
+                return failed ? bufLen : off;
+            }
+            break;
+        }
+
+        if (res != FrameNeedMore) {
+            fail(sock, res);
+            return bufLen;
+        }
+
+        partialScanned = partial.size();
+        if (off == bufLen) {
+            return bufLen;
+        }
+
+        size_t take = info.needLen > partial.size() ? info.needLen - partial.size() : sScanStep;
+        take = min(take, bufLen - off);
+        partial.insert(partial.end(), buf + off, buf + off + take);
+        off += take;
+    }
+
+    // Deliver the frames that are contiguous in buf without copying
+    while (off < bufLen) {
+        FrameInfo info;
+        auto res = scanFrame(buf + off, bufLen - off, 0, info);
+
+        if (res == FrameComplete) {
+            ++stat.frameNr;
+            stat.frameBytes += info.payloadLen;
+
+            bool keepGoing = onFrame(sock, buf + off + info.payloadOff, info.payloadLen);
+            off += info.frameLen;
+            if (failed) {
+                return bufLen;
+            }
+            if (!keepGoing) {
+                return off;
+            }
+            continue;
+        }
+
+        if (res == FrameNeedMore) {
+            // Keep the start of the frame until the rest of it arrives
+            partial.assign(buf + off, buf + bufLen);
+            partialScanned = partial.size();
+            return bufLen;
+        }
+
+        fail(sock, res);
+        return bufLen;
+    }
+
+    return off;
+}
+
+
+NSockOnRecvFunc NFramer::recvFn() {
+    auto self = shared_from_this();
+    return [self] (NSockPtr sock, const uint8_t *buf, int recvLen) {
+        return self->feed(sock, buf, recvLen);
+    };
+}
+
+
+void NFramer::reset() {
+    partial.clear();
+    partialScanned = 0;
+    failed = false;
+}
+
+
+void NFramer::fail(NSockPtr sock, ScanResult res) {
+    int error;
+    if (res == FrameTooLarge) {
+        ++stat.tooLargeNr;
+        error = EMSGSIZE;
+    } else {
+        ++stat.malformedNr;
+        error = EBADMSG;
+    }
+
+    log("%s: framing error %d, dropping the rest of the stream\n", __FUNCTION__, error);
+
+    failed = true;
+    partial.clear();
+    partialScanned = 0;
+
+    if (onError) {
+        onError(sock, error);
+    }
+}
+
+
+NFixedHeaderFramer::NFixedHeaderFramer(NFrameFunc frameFn, size_t maxFrameLen,
+                                       size_t hdrLen, size_t lenOffset, size_t lenSize,
+                                       bool bigEndian, bool lenIncludesHeader) :
+    NFramer(frameFn, maxFrameLen),
+    hdrLen(hdrLen), lenOffset(lenOffset), lenSize(lenSize),
+    bigEndian(bigEndian), lenIncludesHeader(lenIncludesHeader) {
+    assert(lenSize == 1 || lenSize == 2 || lenSize == 4 || lenSize == 8);
+    assert(lenOffset + lenSize <= hdrLen);
+}
+
+
+NFramer::ScanResult NFixedHeaderFramer::scanFrame(const uint8_t *buf, size_t len,
+                                                  size_t scanned, FrameInfo &info) {
+    if (len < hdrLen) {
+        info.needLen = hdrLen;
+        return FrameNeedMore;
+    }
+
+    uint64_t val = 0;
+    for (size_t i = 0; i < lenSize; i++) {
+        size_t byteIdx = bigEndian ? i : lenSize - 1 - i;
+        val = (val << 8) | buf[lenOffset + byteIdx];
+    }
+
+    if (lenIncludesHeader) {
+        if (val < hdrLen) {
+            return FrameMalformed;
+        }
+        val -= hdrLen;
+    }
+
+    if (val > maxFrameLen) {
+        return FrameTooLarge;
+    }
+
+    info.payloadOff = hdrLen;
+    info.payloadLen = val;
+    info.frameLen = hdrLen + val;
+
+    if (len < info.frameLen) {
+        info.needLen = info.frameLen;
+        return FrameNeedMore;
+    }
+
+    return FrameComplete;
+}
+
+
+NFramer::ScanResult NVarintFramer::scanFrame(const uint8_t *buf, size_t len,
+                                             size_t scanned, FrameInfo &info) {
+    // A 64 bit varint is at most 10 bytes
+    const size_t maxVarintLen = 10;
+
+    uint64_t val = 0;
+    size_t hdrLen = 0;
+    for (size_t i = 0; i < len && i < maxVarintLen; i++) {
+        val |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+        if (!(buf[i] & 0x80)) {
+            hdrLen = i + 1;
+            break;
+        }
+    }
+
+    if (!hdrLen) {
+        if (len >= maxVarintLen) {
+            return FrameMalformed;
+        }
+        info.needLen = len + 1;
+        return FrameNeedMore;
+    }
+
+    if (val > maxFrameLen) {
+        return FrameTooLarge;
+    }
+
+    info.payloadOff = hdrLen;
+    info.payloadLen = val;
+    info.frameLen = hdrLen + val;
+
+    if (len < info.frameLen) {
+        info.needLen = info.frameLen;
+        return FrameNeedMore;
+    }
+
+    return FrameComplete;
+}
+
+
+NDelimiterFramer::NDelimiterFramer(NFrameFunc frameFn, size_t maxFrameLen,
+                                   const string &delimiter) :
+    NFramer(frameFn, maxFrameLen), delim(delimiter) {
+    assert(!delim.empty());
+}
+
+
+NFramer::ScanResult NDelimiterFramer::scanFrame(const uint8_t *buf, size_t len,
+                                                size_t scanned, FrameInfo &info) {
+    const size_t delimLen = delim.size();
+
+    // A delimiter may have started in the last delimLen-1 scanned bytes
+    size_t pos = scanned >= delimLen ? scanned - (delimLen - 1) : 0;
+
+    while (pos + delimLen <= len) {
+        auto found = scanByte(buf + pos, len - pos - delimLen + 1, delim[0]);
+        if (!found) {
+            break;
+        }
+
+        pos = found - buf;
+        if (!memcmp(found, delim.data(), delimLen)) {
+            if (pos > maxFrameLen) {
+                return FrameTooLarge;
+            }
+
+            info.payloadOff = 0;
+            info.payloadLen = pos;
+            info.frameLen = pos + delimLen;
+            return FrameComplete;
+        }
+        ++pos;
+    }
+
+    if (len > maxFrameLen + delimLen - 1) {
+        return FrameTooLarge;
+    }
+
+    info.needLen = 0;
+    return FrameNeedMore;
+}
+
+
+NFramer::ScanResult NLineFramer::scanFrame(const uint8_t *buf, size_t len,
+                                           size_t scanned, FrameInfo &info) {
+    auto found = scanByte(buf + scanned, len - scanned, '\n');
+    if (!found) {
+        // Allow for a '\r' on top of maxFrameLen
+        if (len > maxFrameLen + (stripCr ? 1 : 0)) {
+            return FrameTooLarge;
+        }
+        info.needLen = 0;
+        return FrameNeedMore;
+    }
+
+    size_t lineLen = found - buf;
+    info.frameLen = lineLen + 1;
+    if (stripCr && lineLen && buf[lineLen - 1] == '\r') {
+        --lineLen;
+    }
+
+    if (lineLen > maxFrameLen) {
+        return FrameTooLarge;
+    }
+
+    info.payloadOff = 0;
+    info.payloadLen = lineLen;
+    return FrameComplete;
+}
+
+}
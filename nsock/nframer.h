@@ -0,0 +1,219 @@
+#ifndef _NFRAMER_H
+#define _NFRAMER_H
+
+#include <string>
+#include <sstream>
+#include <memory>
+#include <functional>
+#include <vector>
+
+#include <inttypes.h>
+
+#include "nsock.h"
+
+
+namespace nsock {
+
+/*
+ * Framers turn the NSock byte stream into frames. Feed them from onRecv (see
+ * recvFn()), and they call back with one complete frame at a time.
+ *
+ * A frame that is contiguous in the receive buffer is delivered as a view
+ * straight into it. Only a frame that straddles two reads is copied into the
+ * framer's own buffer, and delivered from there. Either way the frame is only
+ * valid during the callback.
+ *
+ * The frame callback returns false to stop taking frames for now (e.g. the
+ * consumer is backed up). The rest of the data is then left unconsumed in the
+ * socket's receive buffer, as per the onRecv contract.
+ *
+ * A frame longer than maxFrameLen, or a malformed header, is a stream error:
+ * onError gets EMSGSIZE or EBADMSG, and the framer drops everything after it.
+ */
+
+typedef std::function<bool (NSockPtr sock, const uint8_t *frame, size_t frameLen)> NFrameFunc;
+
+struct FramerStat {
+    uint64_t frameNr = 0;
+    uint64_t frameBytes = 0;
+
+    // Frames that straddled reads, and had to be copied
+    uint64_t copiedFrameNr = 0;
+    uint64_t copiedBytes = 0;
+
+    // errors
+    uint64_t tooLargeNr = 0;
+    uint64_t malformedNr = 0;
+
+    std::string toString() const {
+        std::stringstream ss;
+
+        ss << "{"
+           << "frameNr:" << frameNr << ", "
+           << "frameBytes:" << frameBytes << ", "
+           << "copiedFrameNr:" << copiedFrameNr << ", "
+           << "copiedBytes:" << copiedBytes << ", "
+
+           << "tooLargeNr:" << tooLargeNr << ", "
+           << "malformedNr:" << malformedNr
+           << "}";
+
+        return ss.str();
+    }
+};
+
+
+class NFramer;
+typedef std::shared_ptr<NFramer> NFramerPtr;
+
+class NFramer : public std::enable_shared_from_this<NFramer> {
+public:
+    NFramer(NFrameFunc frameFn, size_t maxLen) :
+        maxFrameLen(maxLen), onFrame(frameFn) {
+    }
+
+    virtual ~NFramer() {
+    }
+
+    /*
+     * Feed received data. Return the number of bytes consumed, which is bufLen
+     * unless the frame callback asked to stop.
+     */
+    size_t feed(NSockPtr sock, const uint8_t *buf, size_t bufLen);
+
+    /* An onRecv callback that feeds this framer */
+    NSockOnRecvFunc recvFn();
+
+    void setErrorFn(NSockOnErrorFunc errorFn) {
+        onError = errorFn;
+    }
+
+    FramerStat getStats() const {
+        return stat;
+    }
+
+    /* Forget any partial frame, and clear an error */
+    void reset();
+
+protected:
+    enum ScanResult {
+        FrameComplete = 0,
+        FrameNeedMore,
+        FrameTooLarge,
+        FrameMalformed
+    };
+
+    /* Where a frame is, relative to the start of the scanned data */
+    struct FrameInfo {
+        size_t frameLen = 0;    // header + payload + trailer
+        size_t payloadOff = 0;
+        size_t payloadLen = 0;
+        size_t needLen = 0;     // FrameNeedMore: total bytes needed, 0 if unknown
+    };
+
+    /*
+     * Look for a frame at the start of buf. The first "scanned" bytes have
+     * been looked at before without finding the end of the frame.
+     */
+    virtual ScanResult scanFrame(const uint8_t *buf, size_t len, size_t scanned,
+                                 FrameInfo &info) = 0;
+
+    size_t maxFrameLen;
+
+private:
+    void fail(NSockPtr sock, ScanResult res);
+
+    // Bytes to copy at a time into the partial frame when the frame length
+    // is not known yet.
+    static const size_t sScanStep = 4096;
+
+    NFrameFunc onFrame;
+    NSockOnErrorFunc onError;
+
+    std::vector<uint8_t> partial;
+    size_t partialScanned = 0;
+    bool failed = false;
+
+    FramerStat stat;
+};
+
+
+/*
+ * A fixed size header with the payload length at lenOffset, lenSize bytes
+ * (1, 2, 4 or 8) wide. If lenIncludesHeader, the length field counts the
+ * header too.
+ */
+class NFixedHeaderFramer : public NFramer {
+public:
+    NFixedHeaderFramer(NFrameFunc frameFn, size_t maxFrameLen,
+                       size_t hdrLen, size_t lenOffset, size_t lenSize,
+                       bool bigEndian=true, bool lenIncludesHeader=false);
+
+protected:
+    ScanResult scanFrame(const uint8_t *buf, size_t len, size_t scanned,
+                         FrameInfo &info) override;
+
+private:
+    size_t hdrLen;
+    size_t lenOffset;
+    size_t lenSize;
+    bool bigEndian;
+    bool lenIncludesHeader;
+};
+
+
+/*
+ * The payload length as an unsigned LEB128 varint (protobuf style), followed
+ * by the payload.
+ */
+class NVarintFramer : public NFramer {
+public:
+    NVarintFramer(NFrameFunc frameFn, size_t maxFrameLen) :
+        NFramer(frameFn, maxFrameLen) {
+    }
+
+protected:
+    ScanResult scanFrame(const uint8_t *buf, size_t len, size_t scanned,
+                         FrameInfo &info) override;
+};
+
+
+/*
+ * Frames end with a delimiter, which is not part of the delivered frame.
+ */
+class NDelimiterFramer : public NFramer {
+public:
+    NDelimiterFramer(NFrameFunc frameFn, size_t maxFrameLen,
+                     const std::string &delimiter="\n");
+
+protected:
+    ScanResult scanFrame(const uint8_t *buf, size_t len, size_t scanned,
+                         FrameInfo &info) override;
+
+private:
+    std::string delim;
+};
+
+
+/*
+ * Lines ending with '\n'. With stripCr, a '\r' before it is dropped too, so
+ * both "\n" and "\r\n" line endings work. The line end is found with the
+ * SIMD scanByte().
+ */
+class NLineFramer : public NFramer {
+public:
+    NLineFramer(NFrameFunc frameFn, size_t maxFrameLen, bool stripCr=true) :
+        NFramer(frameFn, maxFrameLen), stripCr(stripCr) {
+    }
+
+protected:
+    ScanResult scanFrame(const uint8_t *buf, size_t len, size_t scanned,
+                         FrameInfo &info) override;
+
+private:
+    bool stripCr;
+};
+
+}
+
+#endif
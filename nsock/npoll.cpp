@@ -1,5 +1,8 @@
 #include <sstream>
 #include <map>
+#include <vector>
+#include <chrono>
+#include <algorithm>
 
 #include <unistd.h>
 #include <errno.h>
@@ -20,10 +23,23 @@ public:
 
     int addFd(int fd, uint32_t events, PollFunc callback);
     int removeFd(int fd);
+    int modifyFd(int fd, uint32_t events);
     int waitForEvents(int timeoutMs=-1);
+    void runReady();
+    void runTimers();
+    NPollTimerId addTimer(uint64_t delayMs, TimerFunc fn);
+    int cancelTimer(NPollTimerId id);
 
     int epollfd = -1;
     map<int, PollFunc> fdMap;
+    map<int, uint32_t> readyFds;
+    uint64_t iteration = 0;
+    NPollStat stat;
+
+    // Timers ordered by expiry time (ms), and the expiry of each timer id
+    map<pair<uint64_t, NPollTimerId>, TimerFunc> timers;
+    map<NPollTimerId, uint64_t> timerExpiry;
+    NPollTimerId lastTimerId = 0;
     struct epoll_event *epollEvents = nullptr;
     int epollEventsNr = 0;
 };
@@ -43,6 +59,41 @@ int npollRemoveFd(int fd) {
 }
 
 
+int npollModifyFd(int fd, uint32_t events) {
+    return sNPollObj.modifyFd(fd, events);
+}
+
+
+NPollStat npollGetStats() {
+    return sNPollObj.stat;
+}
+
+
+NPollTimerId npollAddTimer(uint64_t delayMs, TimerFunc fn) {
+    return sNPollObj.addTimer(delayMs, fn);
+}
+
+
+int npollCancelTimer(NPollTimerId id) {
+    return sNPollObj.cancelTimer(id);
+}
+
+
+int npollSetReady(int fd, uint32_t revents) {
+    if (sNPollObj.fdMap.find(fd) == sNPollObj.fdMap.end()) {
+        return -1;
+    }
+
+    sNPollObj.readyFds[fd] |= revents;
+    return 0;
+}
+
+
+uint64_t npollGetIteration() {
+    return sNPollObj.iteration;
+}
+
+
 void npollLoop(bool &exitLoop) {
     const int timerResMs = 1000;
 
@@ -54,6 +105,12 @@ void npollLoop(bool &exitLoop) {
 }
 
 
+static uint64_t nowMs() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
 NPollStruct::NPollStruct() {
     epollfd = epoll_create1(0);
     if (epollfd == -1) {
@@ -81,13 +138,54 @@ NPollStruct::~NPollStruct() {
 }
 
 
+/*
+ * Call back the fds on the ready list. The ones that are still not done put
+ * themselves back on it.
+ */
+void NPollStruct::runReady() {
+    map<int, uint32_t> ready;
+    ready.swap(readyFds);
+
+    for (auto &kv : ready) {
+        auto it = fdMap.find(kv.first);
+        if (it == fdMap.end()) {
+            continue;
+        }
+
+        ++stat.readyNr;
+        auto cb = it->second;
+        cb(kv.first, kv.second);
+    }
+}
+
+
 int NPollStruct::waitForEvents(int timeoutMs) {
     int eventsNr = fdMap.size();
 
-    if (eventsNr == 0) {
+    if (eventsNr == 0 && timers.empty()) {
         return 0;
     }
 
+    ++iteration;
+
+    if (!readyFds.empty()) {
+        runReady();
+    }
+
+    // Don't block if someone still has work to do, or past the next timer
+    if (!readyFds.empty()) {
+        timeoutMs = 0;
+    } else if (!timers.empty()) {
+        uint64_t now = nowMs();
+        uint64_t expiry = timers.begin()->first.first;
+        int untilMs = expiry > now ? (int)min<uint64_t>(expiry - now, INT32_MAX) : 0;
+        if (timeoutMs < 0 || untilMs < timeoutMs) {
+            timeoutMs = untilMs;
+        }
+    }
+
+    // epoll_wait wants room for at least one event
+    eventsNr = max<int>(fdMap.size(), 1);
     if (eventsNr > epollEventsNr) {
         epollEvents = (struct epoll_event *)reallocarray(epollEvents, eventsNr,
                                                          sizeof(struct epoll_event));
@@ -95,30 +193,99 @@ int NPollStruct::waitForEvents(int timeoutMs) {
         epollEventsNr = eventsNr;
     }
 
+    ++stat.waitNr;
     int nfds = epoll_wait(epollfd, epollEvents, eventsNr, timeoutMs);
     if (nfds == -1) {
         nsock::log("%s: failed epoll_wait: %d\n", __FUNCTION__, errno);
         return -1;
     }
 
+    if (nfds) {
+        ++stat.wakeupNr;
+    }
+
     int cnt = 0;
     for (int n = 0; n < nfds; n++) {
         auto evtFd = epollEvents[n].data.fd;
         auto it = fdMap.find(evtFd);
         if (it == fdMap.end()) {
+            // Removed by an earlier callback in this batch
             nsock::log("%s: epoll_wait returned unknown fd=%d!\n", __FUNCTION__, evtFd);
+            continue;
         }
 
+        ++stat.eventNr;
         auto evtCb = it->second;
         evtCb(evtFd, epollEvents[n].events);
 
         ++cnt;
     }
 
+    runTimers();
+
     return cnt;
 }
 
 
+/*
+ * Run the expired timers. Timers added by the callbacks run on a later
+ * iteration, even with a 0 delay.
+ */
+void NPollStruct::runTimers() {
+    uint64_t now = nowMs();
+    vector<NPollTimerId> expired;
+
+    for (auto &kv : timers) {
+        if (kv.first.first > now) {
+            break;
+        }
+        expired.push_back(kv.first.second);
+    }
+
+    for (auto id : expired) {
+        // A callback may have cancelled it
+        auto it = timerExpiry.find(id);
+        if (it == timerExpiry.end()) {
+            continue;
+        }
+
+        auto timerIt = timers.find({it->second, id});
+        auto fn = timerIt->second;
+        timers.erase(timerIt);
+        timerExpiry.erase(it);
+
+        ++stat.timerNr;
+        fn();
+    }
+}
+
+
+NPollTimerId NPollStruct::addTimer(uint64_t delayMs, TimerFunc fn) {
+    NPollTimerId id = ++lastTimerId;
+
+    // nowMs() rounds down, so add a ms to never fire early
+    uint64_t expiry = nowMs() + delayMs + (delayMs ? 1 : 0);
+
+    timers.insert({{expiry, id}, fn});
+    timerExpiry[id] = expiry;
+
+    return id;
+}
+
+
+int NPollStruct::cancelTimer(NPollTimerId id) {
+    auto it = timerExpiry.find(id);
+    if (it == timerExpiry.end()) {
+        return -1;
+    }
+
+    timers.erase({it->second, id});
+    timerExpiry.erase(it);
+
+    return 0;
+}
+
+
 int NPollStruct::addFd(int fd, uint32_t events, PollFunc callback) {
     auto it = fdMap.find(fd);
 
@@ -144,6 +311,26 @@ int NPollStruct::addFd(int fd, uint32_t events, PollFunc callback) {
 }
 
 
+int NPollStruct::modifyFd(int fd, uint32_t events) {
+    if (fdMap.find(fd) == fdMap.end()) {
+        nsock::log("%s: fd %d is not being monitored\n", __FUNCTION__, fd);
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.fd = fd;
+    int err = epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+    if (err) {
+        nsock::log("%s: failed epoll_ctl for fd %d: error=%d\n", __FUNCTION__, fd, errno);
+        return -1;
+    }
+
+    ++stat.modifyNr;
+    return 0;
+}
+
+
 int NPollStruct::removeFd(int fd) {
     auto it = fdMap.find(fd);
 
@@ -159,6 +346,7 @@ int NPollStruct::removeFd(int fd) {
     }
 
     fdMap.erase(fd);
+    readyFds.erase(fd);
 
     return 0;
 }
@@ -3,6 +3,7 @@
 
 #include <functional>
 #include <string>
+#include <sstream>
 
 #include <inttypes.h>
 #include <sys/epoll.h>
@@ -10,11 +11,61 @@
 namespace npoll {
 
 typedef std::function<void (int fd, uint32_t revents)> PollFunc;
+typedef std::function<void ()> TimerFunc;
+typedef uint64_t NPollTimerId;
+
+struct NPollStat {
+    uint64_t waitNr = 0;        // epoll_wait calls
+    uint64_t wakeupNr = 0;      // epoll_wait calls that returned events
+    uint64_t eventNr = 0;       // callbacks for epoll events
+    uint64_t readyNr = 0;       // callbacks for the ready list
+    uint64_t modifyNr = 0;      // interest changes
+    uint64_t timerNr = 0;       // timer callbacks
+
+    std::string toString() const {
+        std::stringstream ss;
+
+        ss << "{"
+           << "waitNr:" << waitNr << ", "
+           << "wakeupNr:" << wakeupNr << ", "
+           << "eventNr:" << eventNr << ", "
+           << "readyNr:" << readyNr << ", "
+           << "modifyNr:" << modifyNr << ", "
+           << "timerNr:" << timerNr
+           << "}";
+
+        return ss.str();
+    }
+};
 
 int npollAddFd(int fd, uint32_t events, PollFunc callback);
 int npollRemoveFd(int fd);
 void npollLoop(bool &exitLoop);
 
+/* Change the events fd is monitored for */
+int npollModifyFd(int fd, uint32_t events);
+
+NPollStat npollGetStats();
+
+/*
+ * Put fd on the ready list: its callback is called with revents on the next
+ * loop iteration, before the loop blocks in epoll_wait again. For sockets that
+ * stopped early to give others a turn, since with EPOLLET no new event would
+ * come.
+ */
+int npollSetReady(int fd, uint32_t revents);
+
+/*
+ * One-shot timers, run by the loop with ms resolution, no earlier than
+ * delayMs from now. A 0 delay runs at the end of the current iteration.
+ * Return a non-zero id, which can be used to cancel the timer before it fires.
+ */
+NPollTimerId npollAddTimer(uint64_t delayMs, TimerFunc fn);
+int npollCancelTimer(NPollTimerId id);
+
+/* The number of the current loop iteration */
+uint64_t npollGetIteration();
+
 }
 
 #endif
@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <cmath>
+
+#include "nrate.h"
+
+
+using namespace std;
+
+namespace nsock {
+
+
+NTokenBucket::NTokenBucket(uint64_t ratePerSec, uint64_t burstTokens) :
+    rate(ratePerSec), burst(burstTokens) {
+    if (rate > 0 && burst == 0) {
+        burst = max(1.0, rate / 10);
+    }
+
+    // Start full
+    tokens = burst;
+    lastRefill = Clock::now();
+}
+
+
+void NTokenBucket::refill() {
+    auto now = Clock::now();
+    double elapsed = chrono::duration<double>(now - lastRefill).count();
+    lastRefill = now;
+
+    tokens = min(burst, tokens + elapsed * rate);
+}
+
+
+uint64_t NTokenBucket::available() {
+    if (!limited()) {
+        return UINT64_MAX;
+    }
+
+    refill();
+    return tokens > 0 ? (uint64_t)tokens : 0;
+}
+
+
+void NTokenBucket::take(uint64_t n) {
+    if (limited()) {
+        tokens -= n;
+    }
+}
+
+
+uint64_t NTokenBucket::msUntil(uint64_t n) {
+    refill();
+
+    double missing = min((double)n, burst) - tokens;
+    if (missing <= 0) {
+        return 1;
+    }
+
+    return max<uint64_t>(1, ceil(missing * 1000 / rate));
+}
+
+}
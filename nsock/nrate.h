@@ -0,0 +1,61 @@
+#ifndef _NRATE_H
+#define _NRATE_H
+
+#include <chrono>
+
+#include <inttypes.h>
+
+
+namespace nsock {
+
+/*
+ * Rate limits for one direction of a socket. 0 means no limit. The bursts
+ * default to a tenth of a second worth of tokens.
+ */
+struct NRateLimit {
+    uint64_t bytesPerSec = 0;
+    uint64_t burstBytes = 0;
+    uint64_t msgsPerSec = 0;
+    uint64_t burstMsgs = 0;
+};
+
+
+/*
+ * A token bucket: filled at ratePerSec, holding at most burst tokens. take()
+ * may run it into debt (e.g. a message longer than the burst), which is paid
+ * back before any more tokens are available.
+ */
+class NTokenBucket {
+public:
+    NTokenBucket(uint64_t ratePerSec=0, uint64_t burst=0);
+
+    bool limited() const {
+        return rate > 0;
+    }
+
+    /* Whole tokens available now */
+    uint64_t available();
+
+    void take(uint64_t n);
+
+    /* Time until n tokens (at most burst) are available, at least 1ms */
+    uint64_t msUntil(uint64_t n);
+
+    uint64_t getBurst() const {
+        return (uint64_t)burst;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void refill();
+
+    double rate = 0;
+    double burst = 0;
+    double tokens = 0;
+    Clock::time_point lastRefill;
+};
+
+}
+
+#endif
@@ -0,0 +1,199 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NSCAN_X86 1
+#endif
+
+#include "nscan.h"
+
+
+namespace nsock {
+
+
+static const uint8_t *scanByteScalar(const uint8_t *buf, size_t len, uint8_t c) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == c) {
+            return buf + i;
+        }
+    }
+
+    return nullptr;
+}
+
+
+#ifdef NSCAN_X86
+
+/*
+ * Compare 16 bytes at a time, and use the movemask bits to find the first
+ * match. The tail is done with unaligned loads that overlap what was already
+ * scanned, rather than a byte loop.
+ */
+__attribute__((target("sse2")))
+static const uint8_t *scanByteSse2(const uint8_t *buf, size_t len, uint8_t c) {
+    if (len < 16) {
+        return scanByteScalar(buf, len, c);
+    }
+
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+
+    if (i < len) {
+        i = len - 16;
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+
+    return nullptr;
+}
+
+
+/*
+ * Same as SSE2 with 32 byte vectors, two at a time in the main loop.
+ */
+__attribute__((target("avx2")))
+static const uint8_t *scanByteAvx2(const uint8_t *buf, size_t len, uint8_t c) {
+    if (len < 32) {
+        return scanByteSse2(buf, len, c);
+    }
+
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i)),
+                                        needle);
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i + 32)),
+                                        needle);
+        if (!_mm256_testz_si256(_mm256_or_si256(eq0, eq1), _mm256_or_si256(eq0, eq1))) {
+            uint32_t mask = _mm256_movemask_epi8(eq0);
+            if (mask) {
+                return buf + i + __builtin_ctz(mask);
+            }
+            mask = _mm256_movemask_epi8(eq1);
+            return buf + i + 32 + __builtin_ctz(mask);
+        }
+    }
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+
+    if (i < len) {
+        i = len - 32;
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+
+    return nullptr;
+}
+
+#endif
+
+
+bool scanImplSupported(NScanImpl impl) {
+#ifdef NSCAN_X86
+    // We may be called from static initializers
+    __builtin_cpu_init();
+#endif
+
+    switch (impl) {
+    case NScanScalar:
+        return true;
+#ifdef NSCAN_X86
+    case NScanSse2:
+        return __builtin_cpu_supports("sse2");
+    case NScanAvx2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+
+const uint8_t *scanByteWith(NScanImpl impl, const uint8_t *buf, size_t len, uint8_t c) {
+    switch (impl) {
+#ifdef NSCAN_X86
+    case NScanSse2:
+        return scanByteSse2(buf, len, c);
+    case NScanAvx2:
+        return scanByteAvx2(buf, len, c);
+#endif
+    default:
+        return scanByteScalar(buf, len, c);
+    }
+}
+
+
+static NScanImpl pickImpl() {
+    if (scanImplSupported(NScanAvx2)) {
+        return NScanAvx2;
+    } else if (scanImplSupported(NScanSse2)) {
+        return NScanSse2;
+    }
+
+    return NScanScalar;
+}
+
+
+typedef const uint8_t *(*ScanFunc)(const uint8_t *buf, size_t len, uint8_t c);
+
+static ScanFunc pickScanFunc() {
+#ifdef NSCAN_X86
+    switch (pickImpl()) {
+    case NScanAvx2:
+        return scanByteAvx2;
+    case NScanSse2:
+        return scanByteSse2;
+    default:
+        break;
+    }
+#endif
+    return scanByteScalar;
+}
+
+static const NScanImpl sScanImpl = pickImpl();
+static const ScanFunc sScanFunc = pickScanFunc();
+
+
+const uint8_t *scanByte(const uint8_t *buf, size_t len, uint8_t c) {
+    return sScanFunc(buf, len, c);
+}
+
+
+NScanImpl scanImpl() {
+    return sScanImpl;
+}
+
+
+const char *scanImplName(NScanImpl impl) {
+    switch (impl) {
+    case NScanSse2:
+        return "sse2";
+    case NScanAvx2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+}
@@ -0,0 +1,34 @@
+#ifndef _NSCAN_H
+#define _NSCAN_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+
+namespace nsock {
+
+/*
+ * Byte scanning for delimiter based framing. scanByte() is memchr(): it
+ * returns the first c in buf, or nullptr. It uses AVX2 or SSE2 when the CPU
+ * has them, picked once at run time, and plain C otherwise.
+ */
+
+enum NScanImpl {
+    NScanScalar = 0,
+    NScanSse2,
+    NScanAvx2
+};
+
+const uint8_t *scanByte(const uint8_t *buf, size_t len, uint8_t c);
+
+/* The implementation scanByte() uses */
+NScanImpl scanImpl();
+const char *scanImplName(NScanImpl impl);
+
+/* Use a particular implementation, for tests and benchmarks */
+bool scanImplSupported(NScanImpl impl);
+const uint8_t *scanByteWith(NScanImpl impl, const uint8_t *buf, size_t len, uint8_t c);
+
+}
+
+#endif
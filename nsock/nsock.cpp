@@ -7,8 +7,15 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 #include "nsock.h"
+#include "ntls.h"
+#include "negress.h"
+#include "naccept.h"
+#include "ntimer.h"
 #include "npoll.h"
 #include "util.h"
 
@@ -22,13 +29,16 @@ uint64_t NSock::sNSockId = 0;
 
 NSock::NSock(int sfd, int sndBufSz) :
     id(getNextNSockId()), sockfd(sfd),
-    sendBuffer(sndBufSz) {
+    sendBuffer(sndBufSz, nallocUsingMirroredBuffers()) {
 }
 
 
 NSock::~NSock() {
     log("%s: sockId=%lu\n", __FUNCTION__, getId());
-    end();
+    destroy();
+    if (!recvSlices) {
+        nallocFreeBuffer(recvBuf, recvBufSize);
+    }
 }
 
 
@@ -80,15 +90,97 @@ NSockPtr NSock::listen(const string &host, unsigned short port,
 
     freeaddrinfo(result);
 
+    return createListenSocket(sfd, connectFn);
+}
+
+
+/*
+ * Fill in a unix domain socket address. A leading '@' means the abstract
+ * namespace.
+ */
+static bool makeUnixAddr(const string &path, struct sockaddr_un &addr,
+                         socklen_t &addrLen) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    }
+
+    addrLen = offsetof(struct sockaddr_un, sun_path) + path.size();
+    if (path[0] != '@') {
+        // Include the terminating null for pathname sockets
+        ++addrLen;
+    }
+
+    return true;
+}
+
+
+/*
+ * Create a unix domain server (listen) socket.
+ */
+NSockPtr NSock::listenUnix(const string &path, NSockOnConnectFunc connectFn,
+                           int sockType) {
+    struct sockaddr_un addr;
+    socklen_t addrLen;
+    if (!makeUnixAddr(path, addr, addrLen)) {
+        stringstream ss;
+        ss << "Invalid unix socket path: " << path << endl;
+        throw runtime_error(ss.str());
+    }
+
+    int sfd = socket(AF_UNIX, sockType, 0);
+    if (sfd == -1) {
+        stringstream ss;
+        ss << "Failed socket(): " << errno << endl;
+        throw runtime_error(ss.str());
+    }
+
+    // Remove a stale socket file left behind by a previous run
+    if (path[0] != '@') {
+        ::unlink(path.c_str());
+    }
+
+    int err = bind(sfd, reinterpret_cast<struct sockaddr *>(&addr), addrLen);
+    if (err) {
+        ::close(sfd);
+        stringstream ss;
+        ss << "Failed bind(): " << errno << endl;
+        throw runtime_error(ss.str());
+    }
+
+    auto listenSocket = createListenSocket(sfd, connectFn);
+    if (listenSocket && path[0] != '@') {
+        listenSocket->unixPath = path;
+    }
+
+    return listenSocket;
+}
+
+
+/*
+ * Finish setting up a server socket: listen() and add to poll.
+ */
+NSockPtr NSock::createListenSocket(int sfd, NSockOnConnectFunc connectFn) {
     struct sockaddr_storage localAddr;
     socklen_t slen = sizeof (localAddr);
-    err = getsockname(sfd, reinterpret_cast<struct sockaddr *>(&localAddr), &slen);
+    int err = getsockname(sfd, reinterpret_cast<struct sockaddr *>(&localAddr), &slen);
     if (err) {
         log("Failed getsockname(): %d\n", __FUNCTION__, errno);
         ::close(sfd);
         return nullptr;
     }
 
+    int sockType = SOCK_STREAM;
+    slen = sizeof(sockType);
+    getsockopt(sfd, SOL_SOCKET, SO_TYPE, &sockType, &slen);
+
     // Do listen
     err = ::listen(sfd, 512);
     if (err) {
@@ -105,8 +197,9 @@ NSockPtr NSock::listen(const string &host, unsigned short port,
     }
 
     assert(sfd != -1);
-    auto listenSocket = make_shared<NSock>(sfd);
+    auto listenSocket = allocate_shared<NSock>(NSlabAllocator<NSock>(), sfd);
     listenSocket->isServer = true;
+    listenSocket->sockType = sockType;
     listenSocket->localAddr = localAddr;
     listenSocket->onConnect = connectFn;
 
@@ -177,15 +270,198 @@ NSockPtr NSock::connect(std::string const &host, unsigned short port,
 
     freeaddrinfo(result);
 
+    return createConnectedSocket(sfd, recvFn, errorFn);
+}
+
+
+/*
+ * Start connecting a client socket.
+ */
+NSockPtr NSock::connectAsync(std::string const &host, unsigned short port,
+                             NSockOnConnectFunc connectFn,
+                             NSockOnErrorFunc errorFn) {
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;     // Allow IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM; // stream socket
+
+    struct addrinfo *result, *rp;
+    int err = getaddrinfo(host.empty() ? NULL : host.c_str(),
+                          to_string(port).c_str(),
+                          &hints,
+                          &result);
+    if (err) {
+        log("%s: Failed getaddrinfo(): %s\n", __FUNCTION__, gai_strerror(err));
+        return nullptr;
+    }
+
+    // Only a synchronous failure moves on to the next address
+    int sfd = -1;
+    struct sockaddr_storage remoteAddr = {0};
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        sfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK, rp->ai_protocol);
+        if (sfd == -1) {
+            continue;
+        }
+
+        err = ::connect(sfd, rp->ai_addr, rp->ai_addrlen);
+        if (err == 0 || errno == EINPROGRESS) {
+            memcpy(&remoteAddr, rp->ai_addr, rp->ai_addrlen);
+            break;
+        }
+
+        log("%s: Failed connect(): %s\n", __FUNCTION__, strerror(errno));
+        ::close(sfd);
+        sfd = -1;
+    }
+
+    freeaddrinfo(result);
+
+    if (sfd == -1) {
+        return nullptr;
+    }
+
+    // Connected or not, EPOLLOUT tells
+    auto sock = allocate_shared<NSock>(NSlabAllocator<NSock>(), sfd);
+    sock->state = NSockConnecting;
+    sock->connecting = true;
+    sock->remoteAddr = remoteAddr;
+    sock->onConnect = connectFn;
+    sock->onError = errorFn;
+
+    sock->monitorSocket();
+
+    return sock;
+}
+
+
+void NSock::finishConnect() {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+        error = errno;
+    }
+
+    if (error == EINPROGRESS) {
+        return;
+    }
+
+    if (error) {
+        log("%s: socket %lu failed to connect: %d\n", __FUNCTION__, getId(), error);
+        ++stat.sysErrorNr;
+        handleError(error);
+        return;
+    }
+
+    auto self = shared_from_this();
+    connecting = false;
+    socklen_t slen = sizeof(localAddr);
+    getsockname(sockfd, reinterpret_cast<struct sockaddr *>(&localAddr), &slen);
+
+    // Ended while connecting: flush, then send the FIN
+    if (state == NSockClosing) {
+        writeToSocket();
+        if (sockfd != -1) {
+            recvFromSocket();
+        }
+        return;
+    }
+
+    state = NSockConnected;
+    if (onConnect) {
+        onConnect(self);
+    }
+
+    // Send what was queued (and the FIN, after shutdown()), and see what's
+    // there already
+    if (sockfd != -1 && state == NSockConnected) {
+        writeToSocket();
+        recvFromSocket();
+    }
+}
+
+
+/*
+ * Create a connected unix domain (client) socket.
+ */
+NSockPtr NSock::connectUnix(const string &path,
+                            NSockOnRecvFunc recvFn,
+                            NSockOnErrorFunc errorFn,
+                            int sockType) {
+    struct sockaddr_un addr;
+    socklen_t addrLen;
+    if (!makeUnixAddr(path, addr, addrLen)) {
+        stringstream ss;
+        ss << "Invalid unix socket path: " << path << endl;
+        throw runtime_error(ss.str());
+    }
+
+    int sfd = socket(AF_UNIX, sockType, 0);
+    if (sfd == -1) {
+        log("%s: Failed socket(): %s\n", __FUNCTION__, strerror(errno));
+        return nullptr;
+    }
+
+    int err = ::connect(sfd, reinterpret_cast<struct sockaddr *>(&addr), addrLen);
+    if (err) {
+        log("%s: Failed connect(): %s\n", __FUNCTION__, strerror(errno));
+        ::close(sfd);
+        return nullptr;
+    }
+
+    return createConnectedSocket(sfd, recvFn, errorFn);
+}
+
+
+/*
+ * Create a pair of connected sockets.
+ */
+pair<NSockPtr, NSockPtr> NSock::pair(int sockType) {
+    int sv[2];
+    int err = socketpair(AF_UNIX, sockType, 0, sv);
+    if (err) {
+        log("%s: Failed socketpair(): %s\n", __FUNCTION__, strerror(errno));
+        return {nullptr, nullptr};
+    }
+
+    auto sock0 = createConnectedSocket(sv[0], nullptr, nullptr);
+    if (!sock0) {
+        ::close(sv[1]);
+        return {nullptr, nullptr};
+    }
+
+    auto sock1 = createConnectedSocket(sv[1], nullptr, nullptr);
+    if (!sock1) {
+        return {nullptr, nullptr};
+    }
+
+    return {sock0, sock1};
+}
+
+
+/*
+ * Finish setting up a connected socket: make it non-blocking and add it to
+ * poll.
+ */
+NSockPtr NSock::createConnectedSocket(int sfd,
+                                      NSockOnRecvFunc recvFn,
+                                      NSockOnErrorFunc errorFn) {
     struct sockaddr_storage localAddr;
     socklen_t slen = sizeof (localAddr);
-    err = getsockname(sfd, reinterpret_cast<struct sockaddr *>(&localAddr), &slen);
+    int err = getsockname(sfd, reinterpret_cast<struct sockaddr *>(&localAddr), &slen);
     if (err) {
         log("Failed getsockname(): %d\n", __FUNCTION__, errno);
         ::close(sfd);
         return nullptr;
     }
 
+    struct sockaddr_storage remoteAddr = {0};
+    slen = sizeof (remoteAddr);
+    getpeername(sfd, reinterpret_cast<struct sockaddr *>(&remoteAddr), &slen);
+
+    int sockType = SOCK_STREAM;
+    slen = sizeof(sockType);
+    getsockopt(sfd, SOL_SOCKET, SO_TYPE, &sockType, &slen);
+
     // Set to non-blocking
     err = setnonblocking(sfd);
     if (err) {
@@ -195,8 +471,11 @@ NSockPtr NSock::connect(std::string const &host, unsigned short port,
     }
 
     assert(sfd != -1);
-    auto sock = make_shared<NSock>(sfd);
+    auto sock = allocate_shared<NSock>(NSlabAllocator<NSock>(), sfd);
+    sock->sockType = sockType;
+    sock->state = NSockConnected;
     sock->localAddr = localAddr;
+    sock->remoteAddr = remoteAddr;
     sock->onRecv = recvFn;
     sock->onError = errorFn;
 
@@ -211,11 +490,54 @@ NSockPtr NSock::connect(std::string const &host, unsigned short port,
  * less than bufLen, then the socket buffer is full, and the caller should wait
  * a bit before trying again.
  */
-int NSock::send(const uint8_t *buf, size_t bufLen) {
+int NSock::send(const uint8_t *buf, size_t bufLen, size_t lane) {
     size_t written = 0;
 
+    if (sockfd == -1 || state == NSockClosing || sendEnded) {
+        return -EPIPE;
+    }
+
+    if (lane > extraLanes.size()) {
+        return -EINVAL;
+    }
+
+    if (sendMsgsBucket.limited()) {
+        if (sendMsgsBucket.available() < 1) {
+            throttleSend(sendMsgsBucket.msUntil(1));
+            return 0;
+        }
+    }
+
+    // The write deadline counts from when there is something to write
+    if (writeTimeoutMs && sendQueueEmpty()) {
+        lastSendMs = NTimerWheel::nowMs();
+    }
+
+    if (sendsMessages()) {
+        // A message is queued whole or not at all
+        CircularBuffer &buffer = laneBuffer(lane);
+        if (bufLen == 0 || bufLen > buffer.dataBufSize - buffer.dataLen) {
+            return 0;
+        }
+
+        written = buffer.put(buf, bufLen);
+        assert(written == bufLen);
+        laneMsgLens(lane).push(bufLen);
+        sendMsgsBucket.take(1);
+        writeToSocket();
+
+        return written;
+    }
+
     while (written < bufLen) {
         size_t len = sendBuffer.put(buf + written, bufLen - written);
+        if (len && !sendSegs.empty()) {
+            // Behind the shared buffers queued before
+            if (sendSegs.back().slice.getBuffer()) {
+                sendSegs.emplace_back();
+            }
+            sendSegs.back().copyLen += len;
+        }
         if (len == 0) {
             log("%s: Socket send buffer full after writing %d bytes\n",
                 __FUNCTION__, written);
@@ -228,14 +550,139 @@ int NSock::send(const uint8_t *buf, size_t bufLen) {
         writeToSocket();
     }
 
+    if (written) {
+        sendMsgsBucket.take(1);
+    }
+
     return written;
 }
 
 
 /*
- * Shutdown and close the socket
+ * Queue a reference to a shared buffer.
+ */
+int NSock::send(const NBufSlice &slice) {
+    if (sockfd == -1 || state == NSockClosing || sendEnded) {
+        return -EPIPE;
+    }
+
+    if (sendsMessages()) {
+        return -EINVAL;
+    }
+
+    if (slice.empty()) {
+        return 0;
+    }
+
+    if (sendMsgsBucket.limited()) {
+        if (sendMsgsBucket.available() < 1) {
+            throttleSend(sendMsgsBucket.msUntil(1));
+            return 0;
+        }
+    }
+
+    if (writeTimeoutMs && sendQueueEmpty()) {
+        lastSendMs = NTimerWheel::nowMs();
+    }
+
+    // What is in sendBuffer already goes first
+    if (sendSegs.empty() && sendBuffer.dataLen) {
+        sendSegs.emplace_back();
+        sendSegs.back().copyLen = sendBuffer.dataLen;
+    }
+
+    sendSegs.emplace_back();
+    sendSegs.back().slice = slice;
+    sendSharedLen += slice.size();
+    sendMsgsBucket.take(1);
+
+    writeToSocket();
+
+    return slice.size();
+}
+
+
+/*
+ * After end(): drop what is received, only to see the peer's FIN.
+ */
+void NSock::discardRecv() {
+    onRecv = [] (NSockPtr sock, const uint8_t *buf, int len) {
+        return (size_t)len;
+    };
+    onRecvSlice = nullptr;
+    recvDiscarding = true;
+}
+
+
+/*
+ * Start a graceful close.
  */
 void NSock::end() {
+    if (sockfd == -1 || state == NSockClosing) {
+        return;
+    }
+
+    if (isServer) {
+        destroy();
+        return;
+    }
+
+    log("%s: closing socket %lu(%d), %lu bytes to flush\n", __FUNCTION__,
+        getId(), sockfd, sendQueueLen());
+
+    state = NSockClosing;
+
+    // No more callbacks. From now on we only read to see the peer's FIN.
+    // What is in our pipe still goes to its destination. Called from onRecv,
+    // onRecv is replaced once it returns.
+    pipeOut.reset();
+    if (!inRecvFn) {
+        discardRecv();
+    }
+    onDrain = nullptr;
+    onTimeout = nullptr;
+    onTlsReady = nullptr;
+    recvPaused = false;
+    recvBytesBucket = NTokenBucket();
+    recvMsgsBucket = NTokenBucket();
+
+    if (timeoutTimer) {
+        NTimerWheel::get().cancel(timeoutTimer);
+        timeoutTimer = 0;
+    }
+
+    weak_ptr<NSock> weakSelf = shared_from_this();
+    closeTimer = NTimerWheel::get().add(closeTimeoutMs, [weakSelf] () {
+        auto self = weakSelf.lock();
+        if (self) {
+            self->closeTimer = 0;
+            log("%s: socket %lu close timed out\n", __FUNCTION__, self->getId());
+            self->destroy();
+        }
+    });
+
+    auto self = shared_from_this();
+    if (connecting) {
+        // finishConnect() flushes, and shuts down the write side
+    } else if (outputEmpty()) {
+        shutdownWrite();
+    } else {
+        // Shuts down the write side once the queue is drained
+        writeToSocket();
+    }
+    updatePollEvents();
+
+    // From onRecv, its loop reads on once it returns
+    if (sockfd != -1 && !inRecvFn) {
+        recvFromSocket();
+    }
+}
+
+
+/*
+ * Close the socket now.
+ */
+void NSock::destroy() {
     if (sockfd == -1) {
         return;
     }
@@ -243,18 +690,98 @@ void NSock::end() {
     log("%s: closing socket %lu(%d)\n", __FUNCTION__,
         getId(), sockfd);
 
+    size_t queued = sendQueueLen() + (pipeIn ? pipeIn->bytes : 0);
+    if (queued) {
+        log("%s: discarding %lu queued bytes\n", __FUNCTION__, queued);
+        stat.discardedBytes += queued;
+    }
+
+    // Let go of the shared buffers
+    sendSegs.clear();
+    sendSharedLen = 0;
+
+    // A source still splicing to us gets EPIPE
+    if (pipeIn) {
+        auto src = pipeIn->src.lock();
+        if (src && src->pipeOut == pipeIn && src->sockfd != -1) {
+            npollSetReady(src->sockfd, EPOLLIN);
+        }
+        pipeIn.reset();
+    }
+    pipeOut.reset();
+
+    if (timeoutTimer) {
+        NTimerWheel::get().cancel(timeoutTimer);
+        timeoutTimer = 0;
+    }
+    if (closeTimer) {
+        NTimerWheel::get().cancel(closeTimer);
+        closeTimer = 0;
+    }
+    if (recvThrottleTimer) {
+        npollCancelTimer(recvThrottleTimer);
+        recvThrottleTimer = 0;
+    }
+    if (sendThrottleTimer) {
+        npollCancelTimer(sendThrottleTimer);
+        sendThrottleTimer = 0;
+    }
+
     // remove from poll
     int err = npollRemoveFd(sockfd);
     if (err) {
         log("%s: failed npollRemoveFd\n", __FUNCTION__);
     }
 
-    if (!isServer) {
-        ::shutdown(sockfd, SHUT_WR);
-    }
-
     ::close(sockfd);
     sockfd = -1;
+    state = NSockClosed;
+
+    auto server = listener.lock();
+    if (server) {
+        server->connClosed();
+    }
+    listener.reset();
+
+    if (!unixPath.empty()) {
+        ::unlink(unixPath.c_str());
+    }
+}
+
+
+/*
+ * Half-close: stop sending, but keep receiving.
+ */
+void NSock::shutdown() {
+    if (sockfd == -1 || isServer || sendEnded || state == NSockClosing) {
+        return;
+    }
+
+    // While connecting, finishConnect() sends the FIN after the queue
+    sendEnded = true;
+    if (connecting) {
+        return;
+    }
+    if (outputEmpty()) {
+        shutdownWrite();
+    } else {
+        writeToSocket();
+    }
+}
+
+
+void NSock::shutdownWrite() {
+    if (!writeShut) {
+        writeShut = true;
+        if (::shutdown(sockfd, SHUT_WR)) {
+            log("%s: failed shutdown on socket %lu: %d\n", __FUNCTION__, getId(), errno);
+        }
+    }
+
+    if (readShut) {
+        // The peer is done already
+        destroy();
+    }
 }
 
 
@@ -269,6 +796,13 @@ void NSock::onAcceptCb(uint32_t revents) {
         return;
     }
 
+    while (maxConnections && stat.connNr >= maxConnections) {
+        if (!shedIdle || !shedIdleConnection()) {
+            pauseAccept(true);
+            return;
+        }
+    }
+
     struct sockaddr_storage remAddr = {0};
     socklen_t remAddrLen = sizeof remAddr;
     int connfd = ::accept(sockfd, (struct sockaddr *)(&remAddr), &remAddrLen);
@@ -278,6 +812,12 @@ void NSock::onAcceptCb(uint32_t revents) {
         return;
     }
 
+    if (acceptFilter && !acceptFilter->admit(remAddr)) {
+        ++stat.filteredNr;
+        ::close(connfd);
+        return;
+    }
+
     struct sockaddr_storage localAddr;
     socklen_t slen = sizeof (localAddr);
     int err = getsockname(connfd, reinterpret_cast<struct sockaddr *>(&localAddr), &slen);
@@ -297,173 +837,1408 @@ void NSock::onAcceptCb(uint32_t revents) {
 
     /* Create a new socket and hand over ownership to caller */
     ++stat.acceptNr;
-    auto connSock = make_shared<NSock>(connfd);
+    auto connSock = allocate_shared<NSock>(NSlabAllocator<NSock>(), connfd);
+    connSock->sockType = sockType;
+    connSock->state = NSockConnected;
+    connSock->closeTimeoutMs = closeTimeoutMs;
+    connSock->allowHalfOpen = allowHalfOpen;
+    connSock->recvBudget = recvBudget;
+    connSock->sendBudget = sendBudget;
+    connSock->setRecvRateLimit(recvLimit);
+    connSock->setSendRateLimit(sendLimit);
+    connSock->setEgressScheduler(egress, egressWeight, egressClass);
+    connSock->setTimeouts(idleTimeoutMs, readTimeoutMs, writeTimeoutMs);
     connSock->localAddr = localAddr;
     connSock->remoteAddr = remAddr;
     connSock->monitorSocket();
 
+    connSock->listener = shared_from_this();
+    ++stat.connNr;
+    stat.peakConnNr = max(stat.peakConnNr, stat.connNr);
+    if (maxConnections) {
+        connSock->trackActivity = true;
+        connSock->lastRecvMs = connSock->lastSendMs = NTimerWheel::nowMs();
+        if (conns.size() >= 2 * stat.connNr) {
+            auto closed = [] (const weak_ptr<NSock> &conn) {
+                return conn.expired() || conn.lock()->sockfd == -1;
+            };
+            conns.erase(remove_if(conns.begin(), conns.end(), closed), conns.end());
+        }
+        conns.push_back(connSock);
+    }
+
     onConnect(connSock);
 }
 
+NSock::SplicePipe::~SplicePipe() {
+    for (int fd : fds) {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+}
+
+
 /*
- * Set the recv callback. If recvFn is null, then socket recv is paused. This is
- * useful for a server that needs to throttle incoming traffic. For example, a
- * proxy server would want to pause receiving from the inlet when the outlet is
- * full.
+ * Splice what we receive to dest, through a pipe.
  */
-void NSock::setRecvFn(NSockOnRecvFunc recvFn) {
-    onRecv = recvFn;
+int NSock::pipe(NSockPtr dest, size_t pipeSize) {
+    if (!dest) {
+        // Back to onRecv. dest keeps the pipe until it has sent what is in it.
+        pipeOut.reset();
+        recvFromSocket();
+        return 0;
+    }
 
-    if (recvFn == nullptr) {
-        log("%s: setting recvFn to null, socket receive is now paused\n",
-            __FUNCTION__);
-        return;
+    if (sockfd == -1 || dest->sockfd == -1 || isServer || dest->isServer ||
+        dest.get() == this) {
+        return -EINVAL;
+    }
+
+    if (sockType != SOCK_STREAM || dest->sockType != SOCK_STREAM) {
+        return -EINVAL;
+    }
+
+    if (!dest->outputEmpty() && dest->pipeIn) {
+        // Another pipe is still draining into it
+        return -EBUSY;
+    }
+
+    auto newPipe = make_shared<SplicePipe>();
+    if (::pipe2(newPipe->fds, O_NONBLOCK | O_CLOEXEC)) {
+        int err = errno;
+        log("%s: failed pipe2(): %d\n", __FUNCTION__, err);
+        ++stat.sysErrorNr;
+        return -err;
+    }
+
+    if (pipeSize && fcntl(newPipe->fds[1], F_SETPIPE_SZ, pipeSize) == -1) {
+        log("%s: failed F_SETPIPE_SZ %lu: %d\n", __FUNCTION__, pipeSize, errno);
     }
+    int capacity = fcntl(newPipe->fds[1], F_GETPIPE_SZ);
+    newPipe->capacity = capacity > 0 ? capacity : 64*1024;
+
+    newPipe->src = shared_from_this();
+    newPipe->dest = dest;
+    pipeOut = newPipe;
+    dest->pipeIn = newPipe;
+
+    log("%s: socket %lu piped to %lu, pipe size %lu\n", __FUNCTION__,
+        getId(), dest->getId(), newPipe->capacity);
 
     recvFromSocket();
+    return 0;
 }
 
+
 /*
- * Recieve data from the socket and invoke onRecv.
+ * Source side of pipe(): splice from the socket into the pipe, and have the
+ * destination send it on, until the socket is empty or the pipe full.
  */
-void NSock::recvFromSocket() {
-    // We must drain the socket receive buffer by reading until we encounter
-    // EAGAIN. Otherwise, epoll_wait will not notify us about any remaining data
-    // in the socket.
-    while (true) {
-        if (!onRecv) {
-            return;
-        }
+void NSock::spliceFromSocket() {
+    auto self = shared_from_this();
+    auto curPipe = pipeOut;
+    auto dest = curPipe->dest.lock();
+    if (!dest || dest->sockfd == -1 || dest->state == NSockClosing || dest->sendEnded) {
+        log("%s: socket %lu: pipe destination is gone\n", __FUNCTION__, getId());
+        pipeOut.reset();
+        handleError(EPIPE);
+        return;
+    }
 
-        size_t consumed = 0;
+    // What came in before the pipe goes first
+    if (recvLen) {
+        int n = dest->send(recvBuf + recvOffset, recvLen);
+        if (n > 0) {
+            recvLen -= n;
+            recvOffset = recvLen ? recvOffset + n : 0;
+        }
         if (recvLen) {
-            // Invoke onRecv if there's some data in recvBuf.
-            assert(recvOffset + recvLen < sizeof(recvBuf));
-            consumed = onRecv(shared_from_this(), recvBuf + recvOffset, recvLen);
-            consumed = min(consumed, recvLen);
-
-            recvLen -= consumed;
-            recvOffset = (recvOffset + consumed) % sizeof(recvBuf);
+            curPipe->srcBlocked = true;
+            ++stat.pipeFullNr;
+            return;
+        }
+    }
 
-            if (recvLen) {
-                // Receiver couldn't consume the entire recvBuf
+    // pipe() takes streams only, so room can be cut to the budget
+    while (pipeOut == curPipe && sockfd != -1 && !recvPaused && !readShut) {
+        size_t room = curPipe->capacity - min(curPipe->bytes, curPipe->capacity);
+        if (recvBudget) {
+            refreshIoBudget();
+            if (recvBudgetUsed >= recvBudget) {
+                ++stat.recvBudgetHitNr;
+                npollSetReady(sockfd, EPOLLIN);
                 return;
             }
-
-            // Reset offset to the beginner of recvBuf
-            recvOffset = 0;
+            room = min(room, recvBudget - recvBudgetUsed);
         }
 
-        assert(recvOffset == 0);
-        assert(recvLen == 0);
-
-        int len = ::recv(sockfd, recvBuf, sizeof(recvBuf), 0);
+        if (room == 0) {
+            // Wait for the destination to drain it
+            curPipe->srcBlocked = true;
+            ++stat.pipeFullNr;
+            return;
+        }
 
+        ssize_t len = ::splice(sockfd, NULL, curPipe->fds[1], NULL, room,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
         if (len == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                //log("%s: recv not available: %d\n", __FUNCTION__, errno);
+                // Nothing to read, or the pipe is out of buffers before our
+                // byte count says so. In the latter case draining it gets
+                // us back here.
+                if (curPipe->bytes) {
+                    curPipe->srcBlocked = true;
+                }
                 return;
             }
 
-            log("%s: recv fatal error: %d\n", __FUNCTION__, errno);
+            log("%s: splice fatal error: %d\n", __FUNCTION__, errno);
             ++stat.recvErrorNr;
-            handleError();
+            handleError(errno);
             return;
         }
 
         if (len == 0) {
-            log("%s: peer closed socket: %d\n", __FUNCTION__, errno);
-            handleError();
+            log("%s: peer shut down socket %lu\n", __FUNCTION__, getId());
+            handleEnd();
             return;
         }
 
-        recvLen = len;
+        curPipe->bytes += len;
+        recvBudgetUsed += len;
+        stat.recvBytes += len;
+        stat.splicedBytes += len;
+        if (timeoutTimer || trackActivity) {
+            lastRecvMs = NTimerWheel::nowMs();
+            timeoutsFired &= ~((1 << NSockIdleTimeout) | (1 << NSockReadTimeout));
+        }
 
-        stat.recvBytes += recvLen;
+        dest->writeToSocket();
     }
 }
 
+
 /*
- * Write data to the socket.
+ * Destination side of pipe(): splice from the pipe to the socket. Return true
+ * once the pipe is empty.
  */
-bool NSock::writeToSocket() {
-    bool drained = false;
+bool NSock::writePipe() {
+    auto curPipe = pipeIn;
 
-    // We must drain the socket send buffer by writing until we encounter
-    // EAGAIN. Otherwise, epoll_wait will not notify us about availabe writes.
-    while (true) {
-        uint8_t *buf;
-        size_t bufLen;
+    while (curPipe->bytes) {
+        ssize_t len = ::splice(curPipe->fds[0], NULL, sockfd, NULL, curPipe->bytes,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sendBlocked = true;
+                return false;
+            }
 
-        bufLen = sendBuffer.get(&buf);
-        if (!buf) {
-            drained = true;
-            break;
+            log("%s: splice fatal error: %d\n", __FUNCTION__, errno);
+            ++stat.sendErrorNr;
+            handleError(errno);
+            return false;
         }
 
-        int sentLen = ::send(sockfd, buf, bufLen, 0);
-        if (sentLen == -1) {
-            if (!(errno == EAGAIN || errno == EWOULDBLOCK)) {
-                handleError();
-            }
-            break;
-        } else if (sentLen == 0) {
-            log("%s: sent 0 bytes, remote socket closed\n", __FUNCTION__);
-            handleError();
-            break;
+        curPipe->bytes -= len;
+        stat.sendBytes += len;
+        stat.splicedBytes += len;
+        if (timeoutTimer || trackActivity) {
+            lastSendMs = NTimerWheel::nowMs();
+            timeoutsFired &= ~((1 << NSockIdleTimeout) | (1 << NSockWriteTimeout));
         }
+    }
 
-        log("%s: sent %d bytes\n", __FUNCTION__, sentLen);
-        stat.sendBytes += sentLen;
+    // Room again: wake the source up, or let go of a pipe it has left
+    auto src = curPipe->src.lock();
+    if (src && src->pipeOut == curPipe) {
+        if (curPipe->srcBlocked && src->sockfd != -1) {
+            curPipe->srcBlocked = false;
+            npollSetReady(src->sockfd, EPOLLIN);
+        }
+    } else if (pipeIn == curPipe) {
+        pipeIn.reset();
     }
 
-    return drained;
+    return true;
 }
 
 
 /*
- * Handle socket errors.
+ * Listening socket: cap the number of open accepted connections.
  */
-void NSock::handleError() {
-    if (onError) {
-        onError(shared_from_this(), errno);
+void NSock::setMaxConnections(size_t maxConn, bool shed) {
+    maxConnections = maxConn;
+    shedIdle = shed;
+
+    if (!maxConnections) {
+        conns.clear();
     }
+
+    pauseAccept(maxConnections && stat.connNr >= maxConnections && !shedIdle);
 }
 
 
 /*
- * Poll socket descriptor for read|write events.
+ * Listening socket: an accepted connection closed, and frees its slot.
  */
-void NSock::monitorSocket() {
-    // Add to poll
-    auto self = shared_from_this();
-    PollFunc cb = [=](int fd, uint32_t revents) -> void {
-        assert(fd == sockfd);
+void NSock::connClosed() {
+    assert(stat.connNr > 0);
+    --stat.connNr;
 
-        if ((EPOLLERR & revents)) {
-            ++stat.sysErrorNr;
-            handleError();
-            return;
+    if (acceptPaused && stat.connNr < maxConnections) {
+        pauseAccept(false);
+    }
+}
+
+
+/*
+ * Listening socket: stop|restart polling the listen fd. It is level triggered,
+ * so the connections waiting in the backlog show up right away on restart.
+ */
+void NSock::pauseAccept(bool pause) {
+    if (pause == acceptPaused || sockfd == -1) {
+        return;
+    }
+
+    int err = npollModifyFd(sockfd, pause ? 0 : EPOLLIN);
+    if (err) {
+        log("%s: failed npollModifyFd on socket %lu\n", __FUNCTION__, getId());
+        ++stat.sysErrorNr;
+        return;
+    }
+
+    acceptPaused = pause;
+    if (pause) {
+        log("%s: socket %lu at %lu connections, not accepting\n", __FUNCTION__,
+            getId(), stat.connNr);
+        ++stat.acceptPauseNr;
+    }
+}
+
+
+/*
+ * Listening socket: close the connection idle the longest, if any is idle.
+ */
+bool NSock::shedIdleConnection() {
+    NSockPtr victim;
+    uint64_t victimActiveMs = UINT64_MAX;
+
+    for (auto it = conns.begin(); it != conns.end(); ) {
+        auto conn = it->lock();
+        if (!conn || conn->sockfd == -1) {
+            it = conns.erase(it);
+            continue;
         }
+        ++it;
 
-        if (EPOLLIN & revents) {
-            self->recvFromSocket();
+        if (conn->state != NSockConnected || !conn->outputEmpty()) {
+            continue;
         }
 
-        if (EPOLLOUT & revents) {
-            bool drained = self->writeToSocket();
-            if (drained && onDrain) {
-                onDrain(shared_from_this());
-            }
+        uint64_t activeMs = max(conn->lastRecvMs, conn->lastSendMs);
+        if (activeMs < victimActiveMs) {
+            victim = conn;
+            victimActiveMs = activeMs;
         }
-    };
+    }
 
-    int err = npollAddFd(sockfd, EPOLLET|EPOLLIN|EPOLLOUT, cb);
-    if (err) {
-        ++stat.sysErrorNr;
-        handleError();
+    if (!victim) {
+        return false;
+    }
+
+    log("%s: shedding connection %lu, idle for %lu ms\n", __FUNCTION__,
+        victim->getId(), NTimerWheel::nowMs() - victimActiveMs);
+    ++stat.shedNr;
+    victim->destroy();
+    if (victim->onError) {
+        victim->onError(victim, ECONNABORTED);
+    }
+
+    return true;
+}
+
+
+/*
+ * Set the recv callback. If recvFn is null, then socket recv is paused. This is
+ * useful for a server that needs to throttle incoming traffic. For example, a
+ * proxy server would want to pause receiving from the inlet when the outlet is
+ * full.
+ */
+void NSock::setRecvFn(NSockOnRecvFunc recvFn) {
+    onRecv = recvFn;
+
+    if (recvFn == nullptr) {
+        log("%s: setting recvFn to null, socket receive is now paused\n",
+            __FUNCTION__);
+        return;
+    }
+
+    recvFromSocket();
+}
+
+
+void NSock::setRecvSliceFn(NSockOnRecvSliceFunc recvFn) {
+    if (!recvSlices) {
+        // Unconsumed data moves to a shared buffer
+        if (recvBuf) {
+            replaceRecvBuf(max(recvLen, sRecvBufInitSize));
+        }
+        recvSlices = true;
+    }
+
+    onRecvSlice = recvFn;
+    if (recvFn == nullptr) {
+        setRecvFn(nullptr);
+        return;
+    }
+
+    setRecvFn([] (NSockPtr sock, const uint8_t *buf, int len) {
+        NBufSlice slice(sock->recvShared, buf - sock->recvBuf, len);
+        return sock->onRecvSlice(sock, slice);
+    });
+}
+
+/*
+ * Pause receiving at the kernel level: stop polling for EPOLLIN.
+ */
+void NSock::pause() {
+    recvPaused = true;
+    updatePollEvents();
+}
+
+
+/*
+ * Resume receiving, starting with whatever is already buffered.
+ */
+void NSock::resume() {
+    if (!recvPaused) {
+        return;
+    }
+
+    recvPaused = false;
+    lastRecvMs = NTimerWheel::nowMs();
+    updatePollEvents();
+    recvFromSocket();
+}
+
+
+/*
+ * Set how far the receive buffer may grow while onRecv lags behind.
+ */
+void NSock::setRecvBufferLimit(size_t limit) {
+    recvBufLimit = max(limit, sRecvBufInitSize);
+}
+
+
+/*
+ * Receive into a new shared buffer of size bytes, starting with the
+ * unconsumed data.
+ */
+void NSock::replaceRecvBuf(size_t size) {
+    auto buffer = allocate_shared<NBuffer>(NSlabAllocator<NBuffer>(), size);
+
+    if (recvLen) {
+        memcpy(buffer->buf, recvBuf + recvOffset, recvLen);
+    }
+    if (!recvSlices) {
+        nallocFreeBuffer(recvBuf, recvBufSize);
+    }
+
+    recvShared = buffer;
+    recvBuf = buffer->buf;
+    recvBufSize = size;
+    recvOffset = 0;
+}
+
+
+/*
+ * Move the unconsumed data to the start of a new receive buffer of size
+ * bytes.
+ */
+void NSock::resizeRecvBuf(size_t size) {
+    auto buf = static_cast<uint8_t *>(nallocBuffer(size));
+    if (recvLen) {
+        memcpy(buf, recvBuf + recvOffset, recvLen);
+    }
+    nallocFreeBuffer(recvBuf, recvBufSize);
+
+    recvBuf = buf;
+    recvBufSize = size;
+    recvOffset = 0;
+}
+
+
+/*
+ * Make room at the end of the receive buffer for another recv(). Return false
+ * if the buffer is at its limit.
+ */
+bool NSock::makeRecvRoom() {
+    if (!recvBuf) {
+        if (recvSlices) {
+            replaceRecvBuf(sRecvBufInitSize);
+            return true;
+        }
+        recvBufSize = sRecvBufInitSize;
+        recvBuf = static_cast<uint8_t *>(nallocBuffer(recvBufSize));
+        return true;
+    }
+
+    size_t tailRoom = recvBufSize - recvOffset - recvLen;
+    if (tailRoom >= recvBufSize / 4) {
+        return true;
+    }
+
+    // Move the unconsumed data back to the start, if that frees up enough.
+    // Data before it that is still held as slices can't be written over:
+    // then it goes to a new buffer instead.
+    if (recvOffset >= recvBufSize / 4) {
+        if (recvBufHeld()) {
+            replaceRecvBuf(recvBufSize);
+            ++stat.recvBufSwapNr;
+        } else {
+            memmove(recvBuf, recvBuf + recvOffset, recvLen);
+            recvOffset = 0;
+        }
+        return true;
+    }
+
+    if (recvBufSize < recvBufLimit) {
+        size_t size = min(recvBufSize * 2, recvBufLimit);
+        if (recvSlices) {
+            replaceRecvBuf(size);
+        } else {
+            resizeRecvBuf(size);
+        }
+        ++stat.recvBufGrowNr;
+        return true;
+    }
+
+    return tailRoom > 0;
+}
+
+
+/*
+ * Make room at the end of the receive buffer for a whole message of msgLen
+ * bytes. Return false if it won't fit within recvBufLimit.
+ */
+bool NSock::makeRecvMsgRoom(size_t msgLen) {
+    if (recvBufSize - recvOffset - recvLen >= msgLen) {
+        return true;
+    }
+
+    if (recvLen + msgLen > recvBufLimit) {
+        return false;
+    }
+
+    size_t size = recvBufSize;
+    while (size < recvLen + msgLen) {
+        size = min(size * 2, recvBufLimit);
+    }
+
+    if (size == recvBufSize && !recvBufHeld()) {
+        memmove(recvBuf, recvBuf + recvOffset, recvLen);
+        recvOffset = 0;
+        return true;
+    }
+
+    if (recvSlices) {
+        replaceRecvBuf(size);
+    } else {
+        resizeRecvBuf(size);
+    }
+    if (size > recvBufSize) {
+        ++stat.recvBufGrowNr;
+    } else {
+        ++stat.recvBufSwapNr;
+    }
+    return true;
+}
+
+
+/*
+ * Recieve data from the socket and invoke onRecv.
+ */
+void NSock::recvFromSocket() {
+    if (tlsHandshake || connecting) {
+        return;
+    }
+
+    if (pipeOut) {
+        spliceFromSocket();
         return;
     }
+
+    // We must drain the socket receive buffer by reading until we encounter
+    // EAGAIN. Otherwise, epoll_wait will not notify us about any remaining data
+    // in the socket. The exception is running out of recvBudget: then the
+    // socket is on npoll's ready list, which gets us back here.
+    //
+    // If onRecv doesn't consume everything, keep reading behind the
+    // unconsumed data (up to recvBufLimit), so a momentarily slow consumer
+    // doesn't shrink the TCP window. The next onRecv gets all unconsumed data
+    // in one contiguous piece.
+    while (true) {
+        if (!onRecv || recvPaused) {
+            return;
+        }
+
+        if (recvLen) {
+            // Invoke onRecv if there's some data in recvBuf.
+            assert(recvOffset + recvLen <= recvBufSize);
+            if (recvMsgsBucket.limited()) {
+                if (recvMsgsBucket.available() < 1) {
+                    throttleRecv(recvMsgsBucket.msUntil(1));
+                    return;
+                }
+                recvMsgsBucket.take(1);
+            }
+
+            inRecvFn = true;
+            size_t consumed = onRecv(shared_from_this(), recvBuf + recvOffset, recvLen);
+            consumed = min(consumed, recvLen);
+            inRecvFn = false;
+            if (state == NSockClosing && !recvDiscarding) {
+                discardRecv();
+            }
+
+            recvLen -= consumed;
+            recvOffset += consumed;
+
+            if (recvLen == 0 && recvSlices) {
+                // A held buffer is received into past the held part. Else,
+                // like below, except a grown one is let go of, for one of
+                // the initial size on the next recv().
+                if (recvBufSize > sRecvBufInitSize) {
+                    recvShared.reset();
+                    recvBuf = nullptr;
+                    recvBufSize = 0;
+                    recvOffset = 0;
+                } else if (!recvBufHeld()) {
+                    recvOffset = 0;
+                }
+            } else if (recvLen == 0) {
+                // Reset offset to the beginning of recvBuf, and give back
+                // what a lagging consumer made us grow.
+                recvOffset = 0;
+                if (recvBufSize > sRecvBufInitSize) {
+                    resizeRecvBuf(sRecvBufInitSize);
+                }
+            } else if (sockType == SOCK_SEQPACKET) {
+                // Don't merge messages
+                return;
+            }
+
+            if (sockfd == -1 || !onRecv || recvPaused) {
+                return;
+            }
+        }
+
+        if (readShut) {
+            return;
+        }
+
+        if (!makeRecvRoom()) {
+            // The consumer is a whole buffer behind. Stop reading, and let
+            // TCP flow control push back on the peer.
+            ++stat.recvBufFullNr;
+            return;
+        }
+
+        if (sockType == SOCK_SEQPACKET) {
+            // recv() cuts off what doesn't fit, so peek at how long the next
+            // message is, and make room for all of it.
+            ssize_t msgLen = ::recv(sockfd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+            if (msgLen == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (msgLen > 0 && !makeRecvMsgRoom(msgLen)) {
+                log("%s: %ld byte message over the receive buffer limit\n",
+                    __FUNCTION__, msgLen);
+                ++stat.recvErrorNr;
+                handleError(EMSGSIZE);
+                return;
+            }
+        }
+
+        size_t room = recvBufSize - recvOffset - recvLen;
+        if (recvBudget) {
+            // Out of budget: yield, and pick up where we left off on the next
+            // iteration. A shorter recv() would cut a message off, so one is
+            // read whole, and charged after.
+            refreshIoBudget();
+            if (recvBudgetUsed >= recvBudget) {
+                ++stat.recvBudgetHitNr;
+                npollSetReady(sockfd, EPOLLIN);
+                return;
+            }
+            if (sockType != SOCK_SEQPACKET) {
+                room = min(room, recvBudget - recvBudgetUsed);
+            }
+        }
+
+        if (recvBytesBucket.limited()) {
+            // Wait for a decent chunk rather than trickle in a few bytes. A
+            // message is read whole, even if that runs the bucket into debt.
+            uint64_t tokens = recvBytesBucket.available();
+            uint64_t chunk = max<uint64_t>(1, recvBytesBucket.getBurst() / 4);
+            if (tokens < min<uint64_t>(chunk, room)) {
+                throttleRecv(recvBytesBucket.msUntil(chunk));
+                return;
+            }
+            if (sockType != SOCK_SEQPACKET) {
+                room = min<uint64_t>(room, tokens);
+            }
+        }
+
+        int len;
+        if (tlsRecords) {
+            // Application data only, and 0 on close_notify too
+            len = tlsRecords->recv(sockfd, recvBuf + recvOffset + recvLen, room);
+        } else {
+            // MSG_TRUNC makes a message that still got cut off show up as
+            // longer than the room, rather than pass for a whole one.
+            int flags = sockType == SOCK_SEQPACKET ? MSG_TRUNC : 0;
+            len = ::recv(sockfd, recvBuf + recvOffset + recvLen, room, flags);
+        }
+
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                //log("%s: recv not available: %d\n", __FUNCTION__, errno);
+                return;
+            }
+
+            log("%s: recv fatal error: %d\n", __FUNCTION__, errno);
+            ++stat.recvErrorNr;
+            handleError(errno);
+            return;
+        }
+
+        if (len == 0) {
+            if (state == NSockClosing) {
+                // Both sides are done
+                destroy();
+                return;
+            }
+
+            log("%s: peer shut down socket %lu\n", __FUNCTION__, getId());
+            handleEnd();
+            return;
+        }
+
+        if ((size_t)len > room) {
+            log("%s: %d byte message truncated to %lu\n", __FUNCTION__, len, room);
+            ++stat.recvErrorNr;
+            handleError(EMSGSIZE);
+            return;
+        }
+
+        recvLen += len;
+        recvBudgetUsed += len;
+        if (timeoutTimer || trackActivity) {
+            lastRecvMs = NTimerWheel::nowMs();
+            timeoutsFired &= ~((1 << NSockIdleTimeout) | (1 << NSockReadTimeout));
+        }
+        recvBytesBucket.take(len);
+
+        stat.recvBytes += len;
+    }
+}
+
+/*
+ * Write data to the socket.
+ */
+bool NSock::writeToSocket() {
+    bool drained = false;
+
+    if (tlsHandshake || connecting) {
+        return false;
+    }
+
+    if (egress && !egressWriting && !sendQueueEmpty()) {
+        // Wait for our turn
+        egress->activate(shared_from_this());
+        updatePollEvents();
+        return false;
+    }
+
+    // We must drain the socket send buffer by writing until we encounter
+    // EAGAIN. Otherwise, epoll_wait will not notify us about availabe writes.
+    // In latency mode, the kernel returns EAGAIN as soon as its unsent backlog
+    // reaches notSentLowat, so we only pull from sendBuffer when it is below.
+    // Running out of sendBudget puts the socket on npoll's ready list instead.
+    while (true) {
+        int sentLen;
+        size_t budgetLeft = SIZE_MAX;
+
+        if (sendQueueEmpty()) {
+            drained = true;
+            break;
+        }
+
+        // Pick the message to write next: at a message boundary, the one at
+        // the head of the highest lane.
+        if (sendsMessages() && sendMsgLeft == 0) {
+            sendLane = extraLanes.size();
+            while (laneMsgLens(sendLane).empty()) {
+                --sendLane;
+            }
+            sendMsgLeft = laneMsgLens(sendLane).front();
+
+            if (sendLane < stat.laneSendBytes.size()) {
+                for (size_t lane = 0; lane < sendLane; lane++) {
+                    if (!laneMsgLens(lane).empty()) {
+                        ++stat.laneJumpNr;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (sendBudget) {
+            refreshIoBudget();
+            if (sendBudgetUsed >= sendBudget) {
+                ++stat.sendBudgetHitNr;
+                npollSetReady(sockfd, EPOLLOUT);
+                break;
+            }
+            budgetLeft = sendBudget - sendBudgetUsed;
+        }
+
+        if (sendBytesBucket.limited()) {
+            // A datagram goes out whole, a stream in decent chunks
+            uint64_t tokens = sendBytesBucket.available();
+            uint64_t chunk = max<uint64_t>(1, sendBytesBucket.getBurst() / 4);
+            if (sockType == SOCK_SEQPACKET) {
+                chunk = min<uint64_t>(sendMsgLeft, sendBytesBucket.getBurst());
+            }
+            if (tokens < min<uint64_t>(chunk, sendQueueLen())) {
+                throttleSend(sendBytesBucket.msUntil(chunk));
+                break;
+            }
+            budgetLeft = min<uint64_t>(budgetLeft, tokens);
+        }
+
+        if (egressWriting) {
+            if (egressAllowance == 0) {
+                break;
+            }
+            budgetLeft = min(budgetLeft, egressAllowance);
+        }
+
+        size_t lane = sendsMessages() ? sendLane : 0;
+        CircularBuffer &buffer = laneBuffer(lane);
+
+        if (sockType == SOCK_SEQPACKET) {
+            // Send one whole message at a time, even if it wraps around
+            struct iovec iov[2];
+            struct msghdr msg = {0};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = buffer.peekv(iov, sendMsgLeft);
+            sentLen = ::sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+            if (sentLen > 0) {
+                assert((size_t)sentLen == sendMsgLeft);
+            }
+        } else {
+            uint8_t *buf;
+            size_t bufLen;
+
+            if (!sendSegs.empty() && sendSegs.front().slice.getBuffer()) {
+                buf = const_cast<uint8_t *>(sendSegs.front().slice.data());
+                bufLen = sendSegs.front().slice.size();
+            } else {
+                bufLen = buffer.peek(&buf);
+                if (!sendSegs.empty()) {
+                    bufLen = min(bufLen, sendSegs.front().copyLen);
+                }
+            }
+            assert(buf);
+
+            // Stop at the end of the message, to look at the lanes again
+            if (sendsMessages()) {
+                bufLen = min(bufLen, sendMsgLeft);
+            }
+
+            // Don't hand the kernel more than the low water mark in one call,
+            // otherwise a single send() could overshoot it by a whole chunk.
+            if (notSentLowat) {
+                bufLen = min(bufLen, (size_t)notSentLowat);
+            }
+            bufLen = min(bufLen, budgetLeft);
+
+            sentLen = ::send(sockfd, buf, bufLen, MSG_NOSIGNAL);
+        }
+
+        if (sentLen == -1) {
+            if (!(errno == EAGAIN || errno == EWOULDBLOCK)) {
+                handleError(errno);
+            } else {
+                sendBlocked = true;
+            }
+            break;
+        } else if (sentLen == 0) {
+            log("%s: sent 0 bytes, remote socket closed\n", __FUNCTION__);
+            handleError(EPIPE);
+            break;
+        }
+
+        if (sendSegs.empty()) {
+            buffer.consume(sentLen);
+        } else {
+            SendSeg &seg = sendSegs.front();
+            if (seg.slice.getBuffer()) {
+                seg.slice.advance(sentLen);
+                sendSharedLen -= sentLen;
+                stat.sharedSendBytes += sentLen;
+            } else {
+                buffer.consume(sentLen);
+                seg.copyLen -= sentLen;
+            }
+            if (seg.slice.empty() && seg.copyLen == 0) {
+                sendSegs.pop_front();
+            }
+        }
+        if (sendsMessages()) {
+            sendMsgLeft -= sentLen;
+            if (sendMsgLeft == 0) {
+                laneMsgLens(lane).pop();
+            }
+        }
+        if (lane < stat.laneSendBytes.size()) {
+            stat.laneSendBytes[lane] += sentLen;
+        }
+
+        sendBudgetUsed += sentLen;
+        sendBytesBucket.take(sentLen);
+        if (timeoutTimer || trackActivity) {
+            lastSendMs = NTimerWheel::nowMs();
+            timeoutsFired &= ~((1 << NSockIdleTimeout) | (1 << NSockWriteTimeout));
+        }
+        if (egressWriting) {
+            egressAllowance -= min((size_t)sentLen, egressAllowance);
+        }
+
+        log("%s: sent %d bytes\n", __FUNCTION__, sentLen);
+        stat.sendBytes += sentLen;
+    }
+
+    // Spliced data goes after what was queued before it
+    if (drained && pipeIn) {
+        drained = writePipe();
+    }
+
+    if (drained && (state == NSockClosing || sendEnded)) {
+        shutdownWrite();
+    }
+
+    updatePollEvents();
+
+    return drained;
+}
+
+
+/*
+ * Set the per iteration byte budgets.
+ */
+void NSock::setIoBudget(size_t recvBytes, size_t sendBytes) {
+    recvBudget = recvBytes;
+    sendBudget = sendBytes;
+}
+
+
+/*
+ * Budgets are per loop iteration: start over when a new one began.
+ */
+void NSock::refreshIoBudget() {
+    uint64_t iteration = npollGetIteration();
+    if (iteration != budgetIteration) {
+        budgetIteration = iteration;
+        recvBudgetUsed = 0;
+        sendBudgetUsed = 0;
+    }
+}
+
+
+bool NSock::sendQueueEmpty() const {
+    if (!sendBuffer.empty() || sendSharedLen) {
+        return false;
+    }
+
+    for (auto &lane : extraLanes) {
+        if (!lane->buffer.empty()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool NSock::outputEmpty() const {
+    return sendQueueEmpty() && (!pipeIn || pipeIn->bytes == 0);
+}
+
+
+size_t NSock::sendQueueLen() const {
+    size_t len = sendBuffer.dataLen + sendSharedLen;
+    for (auto &lane : extraLanes) {
+        len += lane->buffer.dataLen;
+    }
+
+    return len;
+}
+
+
+/*
+ * Set up the send lanes.
+ */
+int NSock::setSendLanes(size_t laneNr, size_t laneBufSize) {
+    if (laneNr == 0) {
+        return -EINVAL;
+    }
+
+    if (!sendQueueEmpty()) {
+        return -EBUSY;
+    }
+
+    extraLanes.clear();
+    for (size_t i = 1; i < laneNr; i++) {
+        extraLanes.emplace_back(new SendLane(laneBufSize));
+    }
+
+    sendLane = 0;
+    sendMsgLeft = 0;
+    stat.laneSendBytes.assign(laneNr > 1 ? laneNr : 0, 0);
+
+    return 0;
+}
+
+
+/*
+ * Set the deadlines, counting from now.
+ */
+void NSock::setTimeouts(uint64_t idleMs, uint64_t readMs, uint64_t writeMs) {
+    idleTimeoutMs = idleMs;
+    readTimeoutMs = readMs;
+    writeTimeoutMs = writeMs;
+
+    lastRecvMs = lastSendMs = NTimerWheel::nowMs();
+    timeoutsFired = 0;
+
+    if (timeoutTimer) {
+        NTimerWheel::get().cancel(timeoutTimer);
+        timeoutTimer = 0;
+    }
+
+    if (isServer || sockfd == -1) {
+        return;
+    }
+
+    uint64_t first = UINT64_MAX;
+    for (uint64_t ms : {idleMs, readMs, writeMs}) {
+        if (ms) {
+            first = min(first, ms);
+        }
+    }
+
+    if (first != UINT64_MAX) {
+        scheduleTimeoutCheck(first);
+    }
+}
+
+
+void NSock::scheduleTimeoutCheck(uint64_t delayMs) {
+    weak_ptr<NSock> weakSelf = shared_from_this();
+    timeoutTimer = NTimerWheel::get().add(delayMs, [weakSelf] () {
+        auto self = weakSelf.lock();
+        if (self) {
+            self->timeoutTimer = 0;
+            self->checkTimeouts();
+        }
+    });
+}
+
+
+/*
+ * See which deadlines have passed, and when to look again: at the next
+ * deadline, or a full period later for a deadline that isn't running (e.g.
+ * nothing to write) or has fired already.
+ */
+void NSock::checkTimeouts() {
+    if (sockfd == -1) {
+        return;
+    }
+
+    uint64_t now = NTimerWheel::nowMs();
+    uint64_t next = UINT64_MAX;
+    vector<NSockTimeout> expired;
+
+    auto check = [&] (NSockTimeout type, uint64_t limitMs, bool running, uint64_t sinceMs) {
+        if (!limitMs) {
+            return;
+        }
+
+        uint64_t bit = 1 << type;
+        if (!running || (timeoutsFired & bit)) {
+            next = min(next, limitMs);
+        } else if (now - sinceMs >= limitMs) {
+            timeoutsFired |= bit;
+            expired.push_back(type);
+            next = min(next, limitMs);
+        } else {
+            next = min(next, sinceMs + limitMs - now);
+        }
+    };
+
+    check(NSockIdleTimeout, idleTimeoutMs, true, max(lastRecvMs, lastSendMs));
+    check(NSockReadTimeout, readTimeoutMs, !recvPaused, lastRecvMs);
+    check(NSockWriteTimeout, writeTimeoutMs, !outputEmpty(), lastSendMs);
+
+    scheduleTimeoutCheck(next);
+
+    auto self = shared_from_this();
+    for (auto type : expired) {
+        if (type == NSockIdleTimeout) {
+            ++stat.idleTimeoutNr;
+        } else if (type == NSockReadTimeout) {
+            ++stat.readTimeoutNr;
+        } else {
+            ++stat.writeTimeoutNr;
+        }
+
+        log("%s: socket %lu timed out, type %d\n", __FUNCTION__, getId(), type);
+
+        if (onTimeout) {
+            onTimeout(self, type);
+        } else {
+            handleError(ETIMEDOUT);
+        }
+
+        if (sockfd == -1) {
+            break;
+        }
+    }
+}
+
+
+/*
+ * Join|leave an egress scheduler.
+ */
+void NSock::setEgressScheduler(shared_ptr<NEgressScheduler> sched,
+                               uint32_t weight, int priorityClass) {
+    egress = sched;
+    egressWeight = max<uint32_t>(weight, 1);
+    egressClass = priorityClass;
+    egressDeficit = 0;
+
+    // A queued socket is dropped by the old scheduler once it sees it moved
+    egressQueued = false;
+
+    if (!isServer && sockfd != -1) {
+        writeToSocket();
+    }
+}
+
+
+/*
+ * The egress scheduler's turn for us: write up to maxBytes. Return the bytes
+ * written, and whether the kernel pushed back.
+ */
+size_t NSock::scheduledWrite(size_t maxBytes, bool &blocked) {
+    uint64_t sentBefore = stat.sendBytes;
+
+    egressWriting = true;
+    egressAllowance = maxBytes;
+    sendBlocked = false;
+    bool drained = writeToSocket();
+    egressWriting = false;
+
+    blocked = sendBlocked;
+    size_t sent = stat.sendBytes - sentBefore;
+
+    if (drained && sent && onDrain) {
+        onDrain(shared_from_this());
+    }
+
+    return sent;
+}
+
+
+/*
+ * Set the rate limits, starting with full buckets.
+ */
+void NSock::setRecvRateLimit(const NRateLimit &limit) {
+    recvLimit = limit;
+    recvBytesBucket = NTokenBucket(limit.bytesPerSec, limit.burstBytes);
+    recvMsgsBucket = NTokenBucket(limit.msgsPerSec, limit.burstMsgs);
+}
+
+
+void NSock::setSendRateLimit(const NRateLimit &limit) {
+    sendLimit = limit;
+    sendBytesBucket = NTokenBucket(limit.bytesPerSec, limit.burstBytes);
+    sendMsgsBucket = NTokenBucket(limit.msgsPerSec, limit.burstMsgs);
+}
+
+
+/*
+ * Out of receive tokens: stop reading, and come back once there are enough.
+ */
+void NSock::throttleRecv(uint64_t waitMs) {
+    if (recvThrottleTimer) {
+        return;
+    }
+
+    ++stat.recvThrottleNr;
+    recvThrottleStart = chrono::steady_clock::now();
+
+    weak_ptr<NSock> weakSelf = shared_from_this();
+    recvThrottleTimer = npollAddTimer(waitMs, [weakSelf] () {
+        auto self = weakSelf.lock();
+        if (!self) {
+            return;
+        }
+
+        self->recvThrottleTimer = 0;
+        self->stat.recvThrottledUs += chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - self->recvThrottleStart).count();
+        self->recvFromSocket();
+    });
+}
+
+
+/*
+ * Out of send tokens: stop writing, and come back once there are enough.
+ */
+void NSock::throttleSend(uint64_t waitMs) {
+    if (sendThrottleTimer) {
+        return;
+    }
+
+    ++stat.sendThrottleNr;
+    sendThrottleStart = chrono::steady_clock::now();
+
+    weak_ptr<NSock> weakSelf = shared_from_this();
+    sendThrottleTimer = npollAddTimer(waitMs, [weakSelf] () {
+        auto self = weakSelf.lock();
+        if (!self) {
+            return;
+        }
+
+        self->sendThrottleTimer = 0;
+        self->stat.sendThrottledUs += chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - self->sendThrottleStart).count();
+        bool drained = self->writeToSocket();
+        if (drained && self->onDrain) {
+            self->onDrain(self);
+        }
+    });
+}
+
+
+/*
+ * Enable (lowat > 0) or disable latency mode.
+ */
+int NSock::setNotSentLowat(uint32_t lowat) {
+    // 0 means "no limit" to the application, but the kernel wants UINT_MAX
+    // for that.
+    uint32_t val = lowat ? lowat : UINT32_MAX;
+    int err = setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val, sizeof(val));
+    if (err) {
+        log("%s: failed setsockopt(TCP_NOTSENT_LOWAT): %d\n", __FUNCTION__, errno);
+        ++stat.sysErrorNr;
+        return -errno;
+    }
+
+    notSentLowat = lowat;
+    return 0;
+}
+
+
+int NSock::getKernelUnsentBytes() const {
+    int unsent = 0;
+    if (ioctl(sockfd, SIOCOUTQNSD, &unsent) == -1) {
+        return -1;
+    }
+
+    return unsent;
+}
+
+
+/*
+ * Start the TLS handshake.
+ */
+void NSock::startTls(shared_ptr<NTlsContext> ctx, bool asServer,
+                     NSockOnConnectFunc readyFn, const string &hostname) {
+    assert(!isServer);
+
+    onTlsReady = readyFn;
+    tlsHandshake.reset(new NTlsHandshake(ctx, sockfd, asServer, hostname));
+    updatePollEvents();
+    continueTlsHandshake();
+}
+
+
+/*
+ * Make progress on the handshake, then hand the keys to the kernel.
+ */
+void NSock::continueTlsHandshake() {
+    int err = tlsHandshake->step();
+    if (err == 0) {
+        // Wait for the socket
+        return;
+    }
+
+    if (err == 1) {
+        err = tlsHandshake->installKernelKeys();
+    }
+
+    tlsHandshake.reset();
+    updatePollEvents();
+
+    if (err) {
+        log("%s: TLS setup failed on socket %lu: %d\n", __FUNCTION__, getId(), -err);
+        ++stat.tlsErrorNr;
+        handleError(-err);
+        return;
+    }
+
+    tlsRecords.reset(new NTlsRecords());
+    if (onTlsReady) {
+        onTlsReady(shared_from_this());
+    }
+
+    // Flush what was queued during the handshake, and pick up anything the
+    // peer has sent already.
+    writeToSocket();
+    recvFromSocket();
+}
+
+
+/*
+ * Handle socket errors.
+ */
+void NSock::handleError(int error) {
+    if (state == NSockClosing) {
+        // Nobody is listening anymore: the graceful close is over
+        destroy();
+        return;
+    }
+
+    if (onError) {
+        onError(shared_from_this(), error);
+    }
+}
+
+
+/*
+ * Handle the peer's FIN: nothing more to read, but we may still send.
+ */
+void NSock::handleEnd() {
+    auto self = shared_from_this();
+
+    readShut = true;
+    updatePollEvents();
+
+    if (onEnd) {
+        onEnd(self);
+    } else if (onError) {
+        onError(self, 0);
+    }
+
+    if (!allowHalfOpen || sendEnded) {
+        // Flushes what's queued, then closes
+        end();
+    }
+}
+
+
+/*
+ * Poll socket descriptor for read|write events.
+ */
+void NSock::monitorSocket() {
+    // Add to poll
+    auto self = shared_from_this();
+    PollFunc cb = [=](int fd, uint32_t revents) -> void {
+        assert(fd == sockfd);
+
+        if ((EPOLLERR & revents)) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+            ++stat.sysErrorNr;
+            handleError(error);
+            return;
+        }
+
+        if (self->connecting) {
+            if (EPOLLOUT & revents) {
+                self->finishConnect();
+            }
+            return;
+        }
+
+        if (self->tlsHandshake) {
+            self->continueTlsHandshake();
+            return;
+        }
+
+        if (EPOLLIN & revents) {
+            self->recvFromSocket();
+        }
+
+        if (EPOLLOUT & revents) {
+            bool drained = self->writeToSocket();
+            if (drained && onDrain) {
+                onDrain(shared_from_this());
+            }
+        }
+    };
+
+    pollEvents = EPOLLET|EPOLLIN;
+    if (connecting) {
+        pollEvents |= EPOLLOUT;
+    }
+    int err = npollAddFd(sockfd, pollEvents, cb);
+    if (err) {
+        ++stat.sysErrorNr;
+        handleError(errno);
+        return;
+    }
+}
+
+
+/*
+ * With EPOLLET, re-arming an event with npollModifyFd reports it right away if
+ * the socket is ready, so nothing is missed while it was off. The TLS
+ * handshake may wait on either direction, so it polls for both.
+ */
+void NSock::updatePollEvents() {
+    if (sockfd == -1 || isServer || !pollEvents) {
+        return;
+    }
+
+    uint32_t events = EPOLLET;
+    if ((!recvPaused && !readShut) || tlsHandshake) {
+        events |= EPOLLIN;
+    }
+    if (!outputEmpty() || tlsHandshake || connecting) {
+        events |= EPOLLOUT;
+    }
+
+    if (events == pollEvents) {
+        return;
+    }
+
+    int err = npollModifyFd(sockfd, events);
+    if (err) {
+        log("%s: failed npollModifyFd on socket %lu\n", __FUNCTION__, getId());
+        ++stat.sysErrorNr;
+        return;
+    }
+
+    pollEvents = events;
 }
 
 
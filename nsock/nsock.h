@@ -8,6 +8,9 @@
 #include <functional>
 #include <algorithm>
 #include <queue>
+#include <deque>
+#include <chrono>
+#include <vector>
 
 #include <string.h>
 #include <inttypes.h>
@@ -15,13 +18,24 @@
 
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 
+#include "nrate.h"
+#include "nbuffer.h"
+#include "nalloc.h"
 
 namespace nsock {
 
+class NTlsContext;
+class NTlsHandshake;
+class NTlsRecords;
+class NEgressScheduler;
+class NAcceptFilter;
+
 enum NSockState {
     NSockInit = 0,
     NSockConnecting,
@@ -30,18 +44,73 @@ enum NSockState {
     NSockClosed
 };
 
+enum NSockTimeout {
+    NSockIdleTimeout = 0,   // no data either way
+    NSockReadTimeout,       // no data received
+    NSockWriteTimeout       // queued data not going out
+};
+
 class NSock;
 typedef std::shared_ptr<NSock> NSockPtr;
 typedef std::function<size_t (NSockPtr sock, const uint8_t *buf, int recvLen)> NSockOnRecvFunc;
+typedef std::function<size_t (NSockPtr sock, const NBufSlice &slice)> NSockOnRecvSliceFunc;
 typedef std::function<void (NSockPtr sock)> NSockOnDrainFunc;
 typedef std::function<void (NSockPtr sock, int error)> NSockOnErrorFunc;
 typedef std::function<void (NSockPtr sock)> NSockOnConnectFunc;
+typedef std::function<void (NSockPtr sock, NSockTimeout type)> NSockOnTimeoutFunc;
+typedef std::function<void (NSockPtr sock)> NSockOnEndFunc;
 
 struct SockStat {
     uint64_t acceptNr = 0;
+
+    // listening socket: accepted connections still open, and the most at
+    // once; times accepting stopped at maxConnections, and idle
+    // connections closed to make room
+    uint64_t connNr = 0;
+    uint64_t peakConnNr = 0;
+    uint64_t acceptPauseNr = 0;
+    uint64_t shedNr = 0;
+    uint64_t filteredNr = 0;    // closed by the accept filter
     uint64_t recvBytes = 0;
     uint64_t sendBytes = 0;
 
+    // receive buffer
+    uint64_t recvBufGrowNr = 0;
+    uint64_t recvBufFullNr = 0;
+    uint64_t recvBufSwapNr = 0;     // replaced, as slices of it were held
+
+    // fairness: times a budget ran out and the socket yielded
+    uint64_t recvBudgetHitNr = 0;
+    uint64_t sendBudgetHitNr = 0;
+
+    // rate limits: times throttled, and time spent throttled
+    uint64_t recvThrottleNr = 0;
+    uint64_t recvThrottledUs = 0;
+    uint64_t sendThrottleNr = 0;
+    uint64_t sendThrottledUs = 0;
+
+    // send lanes: bytes sent per lane, and messages that went ahead of
+    // queued lower lane data
+    std::vector<uint64_t> laneSendBytes;
+    uint64_t laneJumpNr = 0;
+
+    // timeouts
+    uint64_t idleTimeoutNr = 0;
+    uint64_t readTimeoutNr = 0;
+    uint64_t writeTimeoutNr = 0;
+
+    // queued bytes thrown away by destroy(), or a graceful end() that hit
+    // its deadline
+    uint64_t discardedBytes = 0;
+
+    // pipe(): bytes received (source) or sent (destination) with splice(),
+    // and times the source stopped reading because the pipe was full
+    uint64_t splicedBytes = 0;
+    uint64_t pipeFullNr = 0;
+
+    // send(NBufSlice): bytes sent from shared buffers, without a copy
+    uint64_t sharedSendBytes = 0;
+
     // errors
     uint64_t sysErrorNr = 0;
     uint64_t listenErrorNr = 0;
@@ -49,20 +118,57 @@ struct SockStat {
 
     uint64_t recvErrorNr = 0;
     uint64_t sendErrorNr = 0;
+    uint64_t tlsErrorNr = 0;
 
     std::string toString() const {
         std::stringstream ss;
 
         ss << "{"
            << "acceptNr:" << acceptNr << ", "
+           << "connNr:" << connNr << ", "
+           << "peakConnNr:" << peakConnNr << ", "
+           << "acceptPauseNr:" << acceptPauseNr << ", "
+           << "shedNr:" << shedNr << ", "
+           << "filteredNr:" << filteredNr << ", "
            << "recvBytes:" << recvBytes << ", "
            << "sendBytes:" << sendBytes << ", "
 
+           << "recvBufGrowNr:" << recvBufGrowNr << ", "
+           << "recvBufFullNr:" << recvBufFullNr << ", "
+           << "recvBufSwapNr:" << recvBufSwapNr << ", "
+
+           << "recvBudgetHitNr:" << recvBudgetHitNr << ", "
+           << "sendBudgetHitNr:" << sendBudgetHitNr << ", "
+
+           << "recvThrottleNr:" << recvThrottleNr << ", "
+           << "recvThrottledUs:" << recvThrottledUs << ", "
+           << "sendThrottleNr:" << sendThrottleNr << ", "
+           << "sendThrottledUs:" << sendThrottledUs << ", "
+
+           << "laneSendBytes:[";
+        for (size_t i = 0; i < laneSendBytes.size(); i++) {
+            ss << (i ? ", " : "") << laneSendBytes[i];
+        }
+        ss << "], "
+           << "laneJumpNr:" << laneJumpNr << ", "
+
+           << "idleTimeoutNr:" << idleTimeoutNr << ", "
+           << "readTimeoutNr:" << readTimeoutNr << ", "
+           << "writeTimeoutNr:" << writeTimeoutNr << ", "
+
+           << "discardedBytes:" << discardedBytes << ", "
+
+           << "splicedBytes:" << splicedBytes << ", "
+           << "pipeFullNr:" << pipeFullNr << ", "
+
+           << "sharedSendBytes:" << sharedSendBytes << ", "
+
            << "sysErrorNr:" << sysErrorNr << ", "
            << "listenErrorNr:" << listenErrorNr << ", "
            << "acceptErrorNr:" << acceptErrorNr << ", "
            << "recvErrorNr:" << recvErrorNr << ", "
-           << "sendErrorNr:" << sendErrorNr
+           << "sendErrorNr:" << sendErrorNr << ", "
+           << "tlsErrorNr:" << tlsErrorNr
            << "}";
 
         return ss.str();
@@ -70,18 +176,38 @@ struct SockStat {
 };
 
 /*
- * A circular buffer.
+ * A circular buffer, in a buffer from nallocBuffer().
+ *
+ * Mirrored, it is in a buffer from nallocMirroredBuffer() instead, its size
+ * rounded up to whole pages. The data is always at dataBuf + dataStart, in
+ * one piece, even where it wraps around: a put() is one memcpy, and a peek()
+ * or get() returns everything. If the mirror can't be mapped, it falls back
+ * to a plain buffer.
  */
 struct CircularBuffer {
-    CircularBuffer(size_t bufSize=64*1024) :
-        dataBufSize(bufSize) {
-        dataBuf = new uint8_t[bufSize];
+    CircularBuffer(size_t bufSize=64*1024, bool mirrored=false) :
+        dataBufSize(mirrored ? nallocMirrorSize(bufSize) : bufSize) {
+        if (mirrored) {
+            dataBuf = static_cast<uint8_t *>(nallocMirroredBuffer(dataBufSize));
+            viewSize = dataBuf ? 2 * dataBufSize : 0;
+        }
+        if (!dataBuf) {
+            dataBuf = static_cast<uint8_t *>(nallocBuffer(dataBufSize));
+            viewSize = dataBufSize;
+        }
     }
 
     ~CircularBuffer() {
-        delete [] dataBuf;
+        if (isMirrored()) {
+            nallocFreeMirroredBuffer(dataBuf, dataBufSize);
+        } else {
+            nallocFreeBuffer(dataBuf, dataBufSize);
+        }
     }
 
+    CircularBuffer(const CircularBuffer &) = delete;
+    CircularBuffer &operator=(const CircularBuffer &) = delete;
+
     bool full() const {
         return dataLen == dataBufSize;
     }
@@ -90,6 +216,10 @@ struct CircularBuffer {
         return dataLen == 0;
     }
 
+    bool isMirrored() const {
+        return viewSize > dataBufSize;
+    }
+
     size_t put(const uint8_t *buf, size_t bufLen) {
 
         size_t freeLen = dataBufSize - dataLen;
@@ -100,7 +230,7 @@ struct CircularBuffer {
             assert(dataLen <= dataBufSize);
 
             size_t freeStart = (dataStart + dataLen) % dataBufSize;
-            size_t len = std::min(wlen, dataBufSize - freeStart);
+            size_t len = std::min(wlen, viewSize - freeStart);
             memcpy(dataBuf + freeStart, buf + offset, len);
             dataLen += len;
             offset += len;
@@ -110,6 +240,47 @@ struct CircularBuffer {
         return offset;
     }
 
+    /*
+     * Peek at the contiguous data at the head of the buffer without consuming
+     * it. Use consume() once the data has actually been used.
+     */
+    size_t peek(uint8_t **bufPtr) const {
+        if (dataLen == 0) {
+            *bufPtr = nullptr;
+            return 0;
+        }
+
+        *bufPtr = dataBuf + dataStart;
+        return std::min(dataLen, viewSize - dataStart);
+    }
+
+    /*
+     * Like peek(), but describe up to maxLen bytes from the head with up to 2
+     * iovecs (the data may wrap around, unless mirrored). Return the number
+     * of iovecs used.
+     */
+    int peekv(struct iovec iov[2], size_t maxLen) const {
+        size_t len = std::min(dataLen, maxLen);
+        int iovNr = 0;
+
+        while (len && iovNr < 2) {
+            size_t start = (dataStart + (iovNr ? iov[0].iov_len : 0)) % dataBufSize;
+            size_t segLen = std::min(len, viewSize - start);
+            iov[iovNr].iov_base = dataBuf + start;
+            iov[iovNr].iov_len = segLen;
+            len -= segLen;
+            ++iovNr;
+        }
+
+        return iovNr;
+    }
+
+    void consume(size_t len) {
+        assert(len <= dataLen);
+        dataStart = (dataStart + len) % dataBufSize;
+        dataLen -= len;
+    }
+
     size_t get(uint8_t **bufPtr) {
         if (dataLen == 0) {
             *bufPtr = nullptr;
@@ -117,7 +288,7 @@ struct CircularBuffer {
         }
 
         *bufPtr = dataBuf + dataStart;
-        size_t rlen = std::min(dataLen, dataBufSize - dataStart);
+        size_t rlen = std::min(dataLen, viewSize - dataStart);
         dataStart = (dataStart + rlen) % dataBufSize;
         dataLen -= rlen;
         return rlen;
@@ -128,10 +299,14 @@ struct CircularBuffer {
         return (dataBufSize - dataLen);
     }
 
-    uint8_t *dataBuf;
+    uint8_t *dataBuf = nullptr;
     const size_t dataBufSize = 0;
     size_t dataStart = 0;
     size_t dataLen = 0;
+
+    // How far from dataBuf the data can run on: dataBufSize, or twice that
+    // when mirrored
+    size_t viewSize = 0;
 };
 
 
@@ -146,12 +321,42 @@ public:
                             NSockOnRecvFunc recvFn,
                             NSockOnErrorFunc errorFn);
 
+    /*
+     * The same, without blocking on connect(): the socket is NSockConnecting
+     * until connectFn is called, or onError if the connection fails. Data
+     * sent (or piped) meanwhile is queued. The host name is still resolved
+     * synchronously, so pass an address on a busy loop.
+     */
+    static NSockPtr connectAsync(std::string const &host, unsigned short port,
+                                 NSockOnConnectFunc connectFn,
+                                 NSockOnErrorFunc errorFn);
+
     /*
      * Create a server socket by listening on a network interface.
      */
     static NSockPtr listen(const std::string &host, unsigned short port,
                            NSockOnConnectFunc connectFn);
 
+    /*
+     * Unix domain sockets. sockType is SOCK_STREAM or SOCK_SEQPACKET. A path
+     * starting with '@' is in the abstract namespace. For SOCK_SEQPACKET, each
+     * send() is sent as one message and each onRecv gets one message.
+     */
+    static NSockPtr connectUnix(const std::string &path,
+                                NSockOnRecvFunc recvFn,
+                                NSockOnErrorFunc errorFn,
+                                int sockType=SOCK_STREAM);
+
+    static NSockPtr listenUnix(const std::string &path,
+                               NSockOnConnectFunc connectFn,
+                               int sockType=SOCK_STREAM);
+
+    /*
+     * Create a pair of connected sockets with socketpair(), for in-process
+     * pipelines. Set the callbacks on both ends before running the loop.
+     */
+    static std::pair<NSockPtr, NSockPtr> pair(int sockType=SOCK_STREAM);
+
     /* Get socket state */
     enum NSockState getState() const {
         return state;
@@ -167,10 +372,38 @@ public:
         return stat;
     }
 
+    /* Get socket addresses */
+    struct sockaddr_storage getLocalAddr() const {
+        return localAddr;
+    }
+
+    struct sockaddr_storage getRemoteAddr() const {
+        return remoteAddr;
+    }
+
     /* Set the OnRecv callback */
     void setRecvFn(NSockOnRecvFunc recvFn);
 
-    /* Set the OnError callback */
+    /*
+     * Set an OnRecv callback that gets the data as a slice of a reference
+     * counted receive buffer, instead of a pointer only valid during the
+     * call. The consumed part may be kept, sliced, or passed on to another
+     * socket's send(NBufSlice), without a copy. While any of it is held, the
+     * socket receives past it, or into a new buffer, but never over
+     * it. From then on the socket's receive buffers are NBuffers, even if
+     * setRecvFn() is called again.
+     */
+    void setRecvSliceFn(NSockOnRecvSliceFunc recvFn);
+
+    /*
+     * Set how much unconsumed data the receive buffer may hold. While onRecv
+     * leaves data unconsumed, the socket keeps reading from the kernel until
+     * the buffer holds this much. For SOCK_SEQPACKET, it is also the largest
+     * message: a longer one fails the socket with EMSGSIZE.
+     */
+    void setRecvBufferLimit(size_t limit);
+
+    /* Set the OnError callback. It gets the errno value of the failure. */
     void setErrorFn(NSockOnErrorFunc errorFn) {
         onError = errorFn;
     }
@@ -180,11 +413,206 @@ public:
         onDrain = drainFn;
     }
 
-    /* Shutdown and close the socket gracefully */
+    /*
+     * Set the onEnd callback: the peer shut down its send side (FIN), after
+     * everything it sent was received. Data onRecv left unconsumed is still
+     * delivered. Without an onEnd, onError gets error 0 instead.
+     */
+    void setEndFn(NSockOnEndFunc endFn) {
+        onEnd = endFn;
+    }
+
+    /*
+     * Keep the socket open for sending after the peer's FIN, until end() or
+     * shutdown() is called. Otherwise the socket end()s itself after onEnd.
+     * Sockets accepted by a listening socket inherit the setting.
+     */
+    void setAllowHalfOpen(bool allow) {
+        allowHalfOpen = allow;
+    }
+
+    /* Has the peer shut down its send side */
+    bool isReadShut() const {
+        return readShut;
+    }
+
+    /*
+     * Stop|restart receiving. Unlike setRecvFn(nullptr), pause() takes EPOLLIN
+     * out of the poll interest set, so the peer's data doesn't keep waking up
+     * the loop. Data not consumed yet stays in the receive buffer, and is
+     * delivered on resume().
+     */
+    void pause();
+    void resume();
+
+    bool isPaused() const {
+        return recvPaused;
+    }
+
+    /*
+     * Latency mode: set TCP_NOTSENT_LOWAT so the kernel holds at most
+     * notSentLowat unsent bytes. Everything else stays in the user send queue,
+     * and onDrain only fires once the kernel backlog is below the threshold.
+     * Pass 0 to go back to the default (fill the kernel until EAGAIN).
+     */
+    int setNotSentLowat(uint32_t lowat);
+
+    /* Unsent bytes in the kernel send queue, or -1 on error */
+    int getKernelUnsentBytes() const;
+
+    /*
+     * Fairness: read|write at most this many bytes per loop iteration, then
+     * let the other sockets have a turn, and continue on the next iteration.
+     * 0 means no limit (read|write until EAGAIN). Sockets accepted by a
+     * listening socket get its budgets.
+     */
+    void setIoBudget(size_t recvBytes, size_t sendBytes);
+
+    /*
+     * Rate limit receiving|sending with token buckets. Bytes count what is
+     * read from|written to the kernel, messages count onRecv calls|send()
+     * calls. Out of tokens, the socket stops reading (TCP flow control then
+     * pushes back on the peer) or writing until a loop timer finds enough
+     * tokens again. A send() refused for lack of message tokens returns 0,
+     * and onDrain fires once sending may go on. Sockets accepted by a
+     * listening socket get its limits, each with its own buckets.
+     */
+    void setRecvRateLimit(const NRateLimit &limit);
+    void setSendRateLimit(const NRateLimit &limit);
+
+    /*
+     * Deadlines, in ms, 0 for none: idle is no data either way, read is no
+     * data received (not counting while paused), write is queued data not
+     * making progress. They are checked on the loop's shared timer wheel, so
+     * they fire up to a wheel tick late. Each fires once, until there is
+     * activity again. Sockets accepted by a listening socket get its
+     * deadlines.
+     */
+    void setTimeouts(uint64_t idleMs, uint64_t readMs, uint64_t writeMs);
+
+    /* Set the onTimeout callback. Without one, onError gets ETIMEDOUT. */
+    void setTimeoutFn(NSockOnTimeoutFunc timeoutFn) {
+        onTimeout = timeoutFn;
+    }
+
+    /*
+     * Listening socket: accept at most maxConn connections at once (0 is no
+     * limit). At the limit the listen fd is taken out of poll, so further
+     * connections wait in (or are refused by) the kernel backlog, and
+     * accepting resumes as connections close. With shedIdle, the connections
+     * idle the longest (nothing queued to send) are closed to make room
+     * instead; their onError gets ECONNABORTED. Every accepted connection
+     * counts toward the limit, but only those accepted while a limit is set
+     * can be shed.
+     */
+    void setMaxConnections(size_t maxConn, bool shedIdle=false);
+
+    /*
+     * Listening socket: vet each connection's remote address right after
+     * accept() (see naccept.h). Rejected ones are closed before anything is
+     * allocated for them. Pass nullptr to let everyone in again.
+     */
+    void setAcceptFilter(std::shared_ptr<NAcceptFilter> filter) {
+        acceptFilter = filter;
+    }
+
+    /*
+     * Leave writing to an egress scheduler shared with other sockets (see
+     * negress.h): queued data goes out in the scheduler's weighted order
+     * rather than straight from send(). A higher priorityClass always goes
+     * first. Pass nullptr to write directly again. Sockets accepted by a
+     * listening socket join its scheduler, with its weight and class.
+     */
+    void setEgressScheduler(std::shared_ptr<NEgressScheduler> sched,
+                            uint32_t weight=1, int priorityClass=0);
+
+    /*
+     * Move everything received from here on to dest, without copying it to
+     * user space: splice() into a pipe, and from it into dest. onRecv is not
+     * called meanwhile; data it left unconsumed goes to dest first, and dest
+     * sends what it has queued before the spliced data. When dest can't keep
+     * up and the pipe is full (pipeSize, or the system default), reading
+     * stops until dest drains it. The spliced data skips send lanes, rate
+     * limits and egress schedulers. The peer's FIN is reported as usual
+     * (onEnd); a proxy would then call dest->shutdown(), which waits for the
+     * pipe to empty. Pass nullptr to go back to onRecv. Stream sockets only.
+     */
+    int pipe(NSockPtr dest, size_t pipeSize=0);
+
+    /*
+     * Start TLS on a connected TCP socket, with the session offloaded to the
+     * kernel (kTLS) once the handshake is done. readyFn is called then; data
+     * passed to send() in the meantime is held back until after it. On
+     * failure, onError is called. A server should call this from its
+     * onConnect, before setRecvFn(). A client passes the server's hostname,
+     * which its certificate must match (see NTlsHandshake).
+     */
+    void startTls(std::shared_ptr<NTlsContext> ctx, bool asServer,
+                  NSockOnConnectFunc readyFn, const std::string &hostname="");
+
+    /* Is the socket using kernel TLS */
+    bool isTls() const {
+        return tlsRecords != nullptr;
+    }
+
+    /*
+     * Close the socket gracefully: the socket goes to NSockClosing, and no
+     * more callbacks are made. What is queued is still sent, then the write
+     * side is shut down, and the socket is closed once the peer closes its
+     * side too (data received meanwhile is dropped), or after the close
+     * timeout. A listening socket is closed right away.
+     */
     void end();
 
-    /* Send some data */
-    int send(const uint8_t *buf, size_t bufLen);
+    /* Close the socket right away, dropping whatever is still queued */
+    void destroy();
+
+    /*
+     * Half-close: what is queued is still sent, then the write side is shut
+     * down, so the peer sees the end of the stream. Receiving goes on, and
+     * the socket end()s itself once the peer is done too.
+     */
+    void shutdown();
+
+    /* How long a graceful end() may take, in ms */
+    void setCloseTimeout(uint64_t ms) {
+        closeTimeoutMs = ms;
+    }
+
+    /*
+     * Send some data. With send lanes, on the given lane: 0 is the default,
+     * higher lanes go first.
+     */
+    int send(const uint8_t *buf, size_t bufLen, size_t lane=0);
+
+    /*
+     * Send a shared buffer: a reference is queued, not a copy, and dropped
+     * once it is written. It is always queued whole, after what was sent
+     * before, so watch getQueuedBytes() for a slow peer. Stream sockets
+     * without send lanes only (else -EINVAL).
+     */
+    int send(const NBufSlice &slice);
+
+    /* Bytes queued here, not handed to the kernel yet */
+    size_t getQueuedBytes() const {
+        return sendQueueLen();
+    }
+
+    /* Of those, the bytes of shared buffers */
+    size_t getQueuedSharedBytes() const {
+        return sendSharedLen;
+    }
+
+    /*
+     * Split the send queue into laneNr priority lanes, each with its own
+     * laneBufSize buffer. Every send() is then a message, queued whole or
+     * not at all, and between messages the highest lane with one queued goes
+     * next. So a heartbeat waits for at most the message being written, not
+     * for all the queued bulk data. Data already in the kernel is not
+     * overtaken: keep that small with setNotSentLowat(). Only while nothing is
+     * queued (else -EBUSY). laneNr 1 goes back to a single stream.
+     */
+    int setSendLanes(size_t laneNr, size_t laneBufSize=64*1024);
 
     /* Constructor - don't call directly, use listen(), or connect() */
     NSock(int sfd=-1, int sndBufSz=64*1024);
@@ -193,19 +621,68 @@ public:
     ~NSock();
 
 private:
+    friend class NEgressScheduler;
+
+    /* Finish setting up a bound socket, or a connected socket */
+    static NSockPtr createListenSocket(int sfd, NSockOnConnectFunc connectFn);
+    static NSockPtr createConnectedSocket(int sfd,
+                                          NSockOnRecvFunc recvFn,
+                                          NSockOnErrorFunc errorFn);
+
     /* Server socket only: the callback on new connection */
     void onAcceptCb(uint32_t revents);
 
+    /* connectAsync(): the connect() is done, one way or another */
+    void finishConnect();
+
     /* Low level socket read|write */
     void recvFromSocket();
+    void discardRecv();
+    bool makeRecvRoom();
+    bool makeRecvMsgRoom(size_t msgLen);
+    void resizeRecvBuf(size_t size);
+    void replaceRecvBuf(size_t size);
+    bool recvBufHeld() const {
+        return recvShared && recvShared.use_count() > 1;
+    }
     bool writeToSocket();
+    bool sendQueueEmpty() const;
+    size_t sendQueueLen() const;
+    size_t scheduledWrite(size_t maxBytes, bool &blocked);
+    void refreshIoBudget();
+    void scheduleTimeoutCheck(uint64_t delayMs);
+    void checkTimeouts();
+    void throttleRecv(uint64_t waitMs);
+    void throttleSend(uint64_t waitMs);
+
+    /* Drive the TLS handshake on socket events */
+    void continueTlsHandshake();
+
+    /* Shut down the write side, once all is sent on a graceful end() */
+    void shutdownWrite();
+
+    /* pipe(): the source and destination sides */
+    void spliceFromSocket();
+    bool writePipe();
+    bool outputEmpty() const;
+
+    /* Listening socket: connection limits */
+    void connClosed();
+    void pauseAccept(bool pause);
+    bool shedIdleConnection();
 
     /* Handle errors */
-    void handleError();
+    void handleError(int error);
+
+    /* The peer shut down its send side */
+    void handleEnd();
 
     /* Monitor socket for read|write events */
     void monitorSocket();
 
+    /* Poll for EPOLLIN unless paused, and EPOLLOUT only while sends are queued */
+    void updatePollEvents();
+
     static NSOCKID sNSockId;
     static NSOCKID getNextNSockId() {
         return ++sNSockId;
@@ -214,23 +691,164 @@ private:
     NSOCKID id = 0;
     bool isServer = false;
     int sockfd = -1;
+    int sockType = SOCK_STREAM;
     enum NSockState state = NSockInit;
+    bool connecting = false;        // connectAsync() in progress, even if ended
+    uint32_t pollEvents = 0;
+    bool recvPaused = false;
     struct sockaddr_storage localAddr = {0};
     struct sockaddr_storage remoteAddr = {0};
 
     // Callbacks
-    NSockOnConnectFunc onConnect; // server socket only
+    NSockOnConnectFunc onConnect; // server, or connectAsync() socket
     NSockOnErrorFunc onError;
     NSockOnRecvFunc onRecv;
+    NSockOnRecvSliceFunc onRecvSlice;
+    bool inRecvFn = false;          // onRecv can't be replaced while it runs
+    bool recvDiscarding = false;
     NSockOnDrainFunc onDrain;
-
-    // Recv buffer
-    uint8_t recvBuf[64*1024];
+    NSockOnTimeoutFunc onTimeout;
+    NSockOnEndFunc onEnd;
+
+    // Recv buffer, allocated on the first recv. Unconsumed data is at
+    // [recvOffset, recvOffset + recvLen). It grows up to recvBufLimit while
+    // onRecv lags behind, and shrinks back once everything is consumed.
+    static constexpr size_t sRecvBufInitSize = 64*1024;
+    uint8_t *recvBuf = nullptr;
+    size_t recvBufSize = 0;
+    size_t recvBufLimit = 256*1024;
     size_t recvOffset = 0;
     size_t recvLen = 0;
 
+    // With setRecvSliceFn(), recvBuf is recvShared's, and handed out
+    bool recvSlices = false;
+    std::shared_ptr<NBuffer> recvShared;
+
     // Send buffer
     CircularBuffer sendBuffer;
+    uint32_t notSentLowat = 0;
+    std::queue<size_t> sendMsgLens; // SOCK_SEQPACKET, or with send lanes
+
+    // Shared buffers queued with send(NBufSlice), in order with the copies
+    // in sendBuffer: while there are any, each segment is either a slice, or
+    // copyLen bytes of sendBuffer. Without any, it's all in sendBuffer.
+    struct SendSeg {
+        NBufSlice slice;
+        size_t copyLen = 0;
+    };
+    std::deque<SendSeg> sendSegs;
+    size_t sendSharedLen = 0;
+
+    // Send lanes above the default one (sendBuffer|sendMsgLens). The message
+    // being written is sendMsgLeft bytes short of done, on lane sendLane.
+    struct SendLane {
+        SendLane(size_t bufSize) : buffer(bufSize, nallocUsingMirroredBuffers()) {
+        }
+
+        CircularBuffer buffer;
+        std::queue<size_t> msgLens;
+    };
+    std::vector<std::unique_ptr<SendLane>> extraLanes;
+    size_t sendLane = 0;
+    size_t sendMsgLeft = 0;
+
+    bool sendsMessages() const {
+        return sockType == SOCK_SEQPACKET || !extraLanes.empty();
+    }
+
+    CircularBuffer &laneBuffer(size_t lane) {
+        return lane ? extraLanes[lane - 1]->buffer : sendBuffer;
+    }
+
+    std::queue<size_t> &laneMsgLens(size_t lane) {
+        return lane ? extraLanes[lane - 1]->msgLens : sendMsgLens;
+    }
+
+    // Per loop iteration byte budgets, and what was used in budgetIteration
+    size_t recvBudget = 0;
+    size_t sendBudget = 0;
+    uint64_t budgetIteration = 0;
+    size_t recvBudgetUsed = 0;
+    size_t sendBudgetUsed = 0;
+
+    // Rate limits. While throttled, a timer is pending to pick up again.
+    NRateLimit recvLimit;
+    NRateLimit sendLimit;
+    NTokenBucket recvBytesBucket;
+    NTokenBucket recvMsgsBucket;
+    NTokenBucket sendBytesBucket;
+    NTokenBucket sendMsgsBucket;
+    uint64_t recvThrottleTimer = 0;
+    uint64_t sendThrottleTimer = 0;
+    std::chrono::steady_clock::time_point recvThrottleStart;
+    std::chrono::steady_clock::time_point sendThrottleStart;
+
+    // Deadlines, checked by one timer wheel entry, and the last progress.
+    // Activity only updates the times; the entry looks at them when it fires.
+    uint64_t idleTimeoutMs = 0;
+    uint64_t readTimeoutMs = 0;
+    uint64_t writeTimeoutMs = 0;
+    uint64_t lastRecvMs = 0;
+    uint64_t lastSendMs = 0;
+    uint32_t timeoutsFired = 0;     // bits by NSockTimeout
+    uint64_t timeoutTimer = 0;
+
+    // Graceful end()
+    uint64_t closeTimeoutMs = 5000;
+    uint64_t closeTimer = 0;
+    bool writeShut = false;
+
+    // Listening socket: connection limit. Accepted sockets point back at it,
+    // to give their slot back on close. With a limit, it keeps a list of
+    // them too, to pick one to shed.
+    size_t maxConnections = 0;
+    bool shedIdle = false;
+    bool acceptPaused = false;
+    std::vector<std::weak_ptr<NSock>> conns;
+    std::weak_ptr<NSock> listener;
+    std::shared_ptr<NAcceptFilter> acceptFilter;
+    bool trackActivity = false;
+
+    // pipe(): a source socket splices into pipeOut, which its destination
+    // has as pipeIn. The destination keeps it until it is drained, even if
+    // the source goes away.
+    struct SplicePipe {
+        int fds[2] = {-1, -1};
+        size_t capacity = 0;
+        size_t bytes = 0;           // spliced in, not out yet
+        bool srcBlocked = false;    // the source waits for room
+        std::weak_ptr<NSock> src;
+        std::weak_ptr<NSock> dest;
+
+        ~SplicePipe();
+    };
+    std::shared_ptr<SplicePipe> pipeOut;
+    std::shared_ptr<SplicePipe> pipeIn;
+
+    // Half-close: shutdown() by us, FIN from the peer
+    bool sendEnded = false;
+    bool readShut = false;
+    bool allowHalfOpen = false;
+
+    // Egress scheduler, if any, and this socket's place in it. Writes only
+    // happen in scheduledWrite(), up to egressAllowance bytes.
+    std::shared_ptr<NEgressScheduler> egress;
+    uint32_t egressWeight = 1;
+    int egressClass = 0;
+    size_t egressDeficit = 0;
+    bool egressQueued = false;
+    bool egressWriting = false;
+    size_t egressAllowance = 0;
+    bool sendBlocked = false;       // the last write got EAGAIN
+
+    // Unix domain listen socket only: unlinked on end()
+    std::string unixPath;
+
+    // TLS: the handshake in progress, if any, then the records that come
+    // in once the kernel has the session
+    std::unique_ptr<NTlsHandshake> tlsHandshake;
+    NSockOnConnectFunc onTlsReady;
+    std::unique_ptr<NTlsRecords> tlsRecords;
 
     // Stats
     SockStat stat;
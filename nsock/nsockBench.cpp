@@ -0,0 +1,1288 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "nsock.h"
+#include "ndgram.h"
+#include "ntls.h"
+#include "nframer.h"
+#include "nscan.h"
+#include "negress.h"
+#include "naccept.h"
+#include "nalloc.h"
+#include "npoll.h"
+#include "util.h"
+
+
+using namespace std;
+using namespace nsock;
+using namespace npoll;
+
+/*
+ * Loopback micro benchmarks for the nsock library.
+ *
+ * Usage: nsockBench <benchmark> [args...]
+ */
+
+typedef chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+
+/*
+ * An always-readable eventfd in poll, so that tickFn is called once per loop
+ * iteration. Lets a single-threaded benchmark keep generating load while the
+ * loop services the receivers.
+ */
+class BenchTicker {
+public:
+    BenchTicker(function<void ()> tickFn) {
+        fd = eventfd(1, EFD_NONBLOCK);
+        npollAddFd(fd, EPOLLIN, [=] (int, uint32_t) {
+            tickFn();
+        });
+    }
+
+    ~BenchTicker() {
+        npollRemoveFd(fd);
+        close(fd);
+    }
+
+private:
+    int fd = -1;
+};
+
+
+/*
+ * UDP packets per second over loopback: one datagram per syscall, batched
+ * recvmmsg/sendmmsg, and batched with GSO/GRO.
+ */
+static void udpPpsRun(const string &name, size_t batchNr, bool gso,
+                      double seconds, size_t payload) {
+    uint64_t rxPackets = 0;
+    auto rx = NDgram::bind("127.0.0.1", 0,
+                           [&] (NDgramPtr, const uint8_t *, size_t, const struct sockaddr_storage &) {
+                               ++rxPackets;
+                           },
+                           nullptr);
+    auto tx = NDgram::bind("127.0.0.1", 0, nullptr, nullptr);
+    rx->setBatchSize(batchNr);
+    tx->setBatchSize(batchNr);
+
+    if (gso) {
+        if (tx->enableGso(payload) || rx->enableGro()) {
+            printf("%-8s: GSO/GRO not supported, skipped\n", name.c_str());
+            return;
+        }
+    }
+
+    auto dest = rx->getLocalAddr();
+    vector<uint8_t> buf(payload, 'u');
+    bool exitLoop = false;
+    auto start = Clock::now();
+
+    BenchTicker ticker([&] () {
+        if (secondsSince(start) >= seconds) {
+            exitLoop = true;
+            return;
+        }
+
+        // A burst per loop iteration, then give the receiver a turn
+        for (size_t i = 0; i < batchNr * 4; i++) {
+            if (tx->send(buf.data(), buf.size(), dest) <= 0) {
+                break;
+            }
+        }
+        tx->flush();
+    });
+
+    npollLoop(exitLoop);
+    double elapsed = secondsSince(start);
+
+    auto txStat = tx->getStats();
+    auto rxStat = rx->getStats();
+    printf("%-8s: tx %.0f pps (%.1f pkts/call), rx %.0f pps (%.1f pkts/call), %.2f Gbit/s\n",
+           name.c_str(),
+           txStat.sendPackets / elapsed,
+           txStat.sendCallNr ? (double)txStat.sendPackets / txStat.sendCallNr : 0.0,
+           rxPackets / elapsed,
+           rxStat.recvCallNr ? (double)rxStat.recvPackets / rxStat.recvCallNr : 0.0,
+           rxStat.recvBytes * 8 / elapsed / 1e9);
+
+    tx->close();
+    rx->close();
+}
+
+static int benchUdpPps(const vector<string> &args) {
+    double seconds = args.size() > 0 ? stod(args[0]) : 2;
+    size_t payload = args.size() > 1 ? stoul(args[1]) : 1200;
+
+    printf("UDP loopback, %zu byte datagrams, %.1fs per run\n", payload, seconds);
+    udpPpsRun("single", 1, false, seconds, payload);
+    udpPpsRun("batch", NDgram::sDefaultBatchNr, false, seconds, payload);
+    udpPpsRun("gso/gro", NDgram::sDefaultBatchNr, true, seconds, payload);
+
+    return 0;
+}
+
+
+static unsigned short localPort(NSockPtr sock) {
+    auto addr = sock->getLocalAddr();
+    if (addr.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_port);
+    }
+    return ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+}
+
+
+/*
+ * TCP stream throughput over loopback, in plain text or with kernel TLS.
+ */
+static void tcpStreamRun(const string &name, NTlsContextPtr serverCtx,
+                         NTlsContextPtr clientCtx, double seconds, size_t chunk) {
+    uint64_t rxBytes = 0;
+    bool exitLoop = false;
+    bool failed = false;
+    NSockPtr serverConn;
+    Clock::time_point start;
+
+    auto onError = [&] (NSockPtr sock, int error) {
+        printf("%-8s: socket error %d (%s)\n", name.c_str(), error, strerror(error));
+        failed = true;
+        exitLoop = true;
+    };
+
+    auto onRecv = [&] (NSockPtr sock, const uint8_t *buf, int len) {
+        rxBytes += len;
+        return (size_t)len;
+    };
+
+    auto listenSock = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        serverConn = sock;
+        sock->setErrorFn(onError);
+        if (serverCtx) {
+            sock->startTls(serverCtx, true, [&] (NSockPtr sock) {
+                sock->setRecvFn(onRecv);
+            });
+        } else {
+            sock->setRecvFn(onRecv);
+        }
+    });
+
+    vector<uint8_t> buf(chunk, 't');
+    auto pump = [&] (NSockPtr sock) {
+        while (!exitLoop) {
+            if (secondsSince(start) >= seconds) {
+                exitLoop = true;
+                break;
+            }
+            if (sock->send(buf.data(), buf.size()) < (int)buf.size()) {
+                break;
+            }
+        }
+    };
+
+    auto client = NSock::connect("127.0.0.1", localPort(listenSock), nullptr, onError);
+    client->setDrainFn(pump);
+    start = Clock::now();
+    if (clientCtx) {
+        client->startTls(clientCtx, false, pump);
+    } else {
+        pump(client);
+    }
+
+    npollLoop(exitLoop);
+    double elapsed = secondsSince(start);
+
+    if (!failed) {
+        printf("%-8s: %.2f Gbit/s\n", name.c_str(), rxBytes * 8 / elapsed / 1e9);
+    }
+
+    client->end();
+    if (serverConn) {
+        serverConn->end();
+    }
+    listenSock->end();
+}
+
+static int benchTlsThroughput(const vector<string> &args) {
+    double seconds = args.size() > 0 ? stod(args[0]) : 2;
+    size_t chunk = args.size() > 1 ? stoul(args[1]) : 16 * 1024;
+
+    printf("TCP loopback stream, %zu byte sends, %.1fs per run\n", chunk, seconds);
+    tcpStreamRun("plain", nullptr, nullptr, seconds, chunk);
+    tcpStreamRun("ktls", NTlsContext::createSelfSignedServer("localhost"),
+                 NTlsContext::createClient(false), seconds, chunk);
+
+    return 0;
+}
+
+
+/*
+ * Fairness: one elephant streaming bulk data, and many mice doing small
+ * request/response round trips, all on one loop. Report the mice's round trip
+ * latency, with and without per-iteration I/O budgets.
+ */
+static void fairnessRun(const string &name, size_t budget, double seconds,
+                        size_t miceNr, size_t pingLen) {
+    bool exitLoop = false;
+    uint64_t elephantBytes = 0;
+    vector<double> rttUs;
+    vector<NSockPtr> socks;
+    Clock::time_point start = Clock::now();
+
+    auto onError = [&] (NSockPtr sock, int error) {
+        printf("%-8s: socket error %d (%s)\n", name.c_str(), error, strerror(error));
+        exitLoop = true;
+    };
+
+    // Server side: a sink for the elephant, an echo server for the mice
+    auto sinkListen = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        socks.push_back(sock);
+        sock->setErrorFn(onError);
+        sock->setRecvFn([&] (NSockPtr, const uint8_t *, int len) {
+            elephantBytes += len;
+            return (size_t)len;
+        });
+    });
+    auto echoListen = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        socks.push_back(sock);
+        sock->setErrorFn(onError);
+        sock->setRecvFn([] (NSockPtr sock, const uint8_t *buf, int len) {
+            return (size_t)sock->send(buf, len);
+        });
+    });
+    sinkListen->setIoBudget(budget, budget);
+    echoListen->setIoBudget(budget, budget);
+
+    vector<uint8_t> chunk(64 * 1024, 'e');
+    auto pump = [&] (NSockPtr sock) {
+        while (!exitLoop && sock->send(chunk.data(), chunk.size()) == (int)chunk.size()) {
+        }
+    };
+    auto elephant = NSock::connect("127.0.0.1", localPort(sinkListen), nullptr, onError);
+    elephant->setIoBudget(budget, budget);
+    elephant->setDrainFn(pump);
+    socks.push_back(elephant);
+
+    vector<uint8_t> ping(pingLen, 'm');
+    for (size_t i = 0; i < miceNr; i++) {
+        auto sent = make_shared<Clock::time_point>(Clock::now());
+        auto got = make_shared<size_t>(0);
+        auto mouse = NSock::connect("127.0.0.1", localPort(echoListen),
+                                    [&, sent, got] (NSockPtr sock, const uint8_t *, int len) {
+                                        *got += len;
+                                        if (*got < pingLen) {
+                                            return (size_t)len;
+                                        }
+
+                                        auto now = Clock::now();
+                                        rttUs.push_back(chrono::duration<double, micro>(now - *sent).count());
+                                        if (secondsSince(start) >= seconds) {
+                                            exitLoop = true;
+                                        }
+                                        *got = 0;
+                                        *sent = now;
+                                        sock->send(ping.data(), ping.size());
+                                        return (size_t)len;
+                                    },
+                                    onError);
+        mouse->send(ping.data(), ping.size());
+        socks.push_back(mouse);
+    }
+
+    pump(elephant);
+    npollLoop(exitLoop);
+    double elapsed = secondsSince(start);
+
+    sort(rttUs.begin(), rttUs.end());
+    auto pct = [&] (double p) {
+        return rttUs.empty() ? 0.0 : rttUs[min(rttUs.size() - 1, (size_t)(p * rttUs.size()))];
+    };
+    printf("%-8s: mice %zu round trips, p50 %.0fus, p99 %.0fus, max %.0fus; elephant %.2f Gbit/s\n",
+           name.c_str(), rttUs.size(), pct(0.5), pct(0.99),
+           rttUs.empty() ? 0.0 : rttUs.back(), elephantBytes * 8 / elapsed / 1e9);
+
+    for (auto &sock : socks) {
+        sock->end();
+    }
+    sinkListen->end();
+    echoListen->end();
+}
+
+static int benchFairness(const vector<string> &args) {
+    double seconds = args.size() > 0 ? stod(args[0]) : 2;
+    size_t miceNr = args.size() > 1 ? stoul(args[1]) : 32;
+    size_t budget = args.size() > 2 ? stoul(args[2]) : 64 * 1024;
+
+    printf("1 elephant, %zu mice over TCP loopback, %.1fs per run\n", miceNr, seconds);
+    fairnessRun("nobudget", 0, seconds, miceNr, 64);
+    fairnessRun("budget", budget, seconds, miceNr, 64);
+
+    return 0;
+}
+
+
+/*
+ * A proxy whose downstream is slow: an in-loop source pumps into the proxy,
+ * which forwards to a reader thread that sips from a blocking socket. Count
+ * the loop wakeups while the proxy holds back its upstream, either with
+ * setRecvFn(nullptr) or with pause().
+ */
+static void pauseRun(const string &name, bool usePause, double seconds,
+                     size_t sipBytes, int sipIntervalUs) {
+    bool exitLoop = false;
+    NSockPtr inSock, outSock;
+    uint64_t downBytes = 0;
+    atomic<bool> stopReader(false);
+    Clock::time_point start = Clock::now();
+
+    auto onError = [&] (NSockPtr sock, int error) {
+        printf("%-8s: socket error %d (%s)\n", name.c_str(), error, strerror(error));
+        exitLoop = true;
+    };
+
+    function<size_t (NSockPtr, const uint8_t *, int)> forward =
+        [&] (NSockPtr sock, const uint8_t *buf, int len) {
+            int n = outSock ? outSock->send(buf, len) : 0;
+            if (n < len) {
+                if (usePause) {
+                    sock->pause();
+                } else {
+                    sock->setRecvFn(nullptr);
+                }
+            }
+            return (size_t)max(n, 0);
+        };
+
+    auto outListen = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        outSock = sock;
+        sock->setErrorFn(onError);
+        sock->setDrainFn([&] (NSockPtr) {
+            if (secondsSince(start) >= seconds) {
+                exitLoop = true;
+            }
+            if (!inSock) {
+                return;
+            }
+            if (usePause) {
+                inSock->resume();
+            } else {
+                inSock->setRecvFn(forward);
+            }
+        });
+    });
+    auto inListen = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        inSock = sock;
+        sock->setErrorFn(onError);
+        sock->setRecvFn(forward);
+    });
+
+    // The slow downstream
+    int readerFd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(localPort(outListen));
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (::connect(readerFd, reinterpret_cast<struct sockaddr *>(&addr), sizeof addr)) {
+        printf("%-8s: failed connect: %s\n", name.c_str(), strerror(errno));
+        close(readerFd);
+        return;
+    }
+
+    thread reader([&] () {
+        vector<uint8_t> buf(sipBytes);
+        while (!stopReader) {
+            ssize_t n = ::recv(readerFd, buf.data(), buf.size(), MSG_DONTWAIT);
+            if (n > 0) {
+                downBytes += n;
+            } else if (n == 0) {
+                break;
+            }
+            usleep(sipIntervalUs);
+        }
+    });
+
+    vector<uint8_t> chunk(64 * 1024, 'p');
+    auto pump = [&] (NSockPtr sock) {
+        while (!exitLoop && sock->send(chunk.data(), chunk.size()) == (int)chunk.size()) {
+        }
+    };
+    auto source = NSock::connect("127.0.0.1", localPort(inListen), nullptr, onError);
+    source->setDrainFn(pump);
+    pump(source);
+
+    auto before = npollGetStats();
+    npollLoop(exitLoop);
+    double elapsed = secondsSince(start);
+    auto after = npollGetStats();
+
+    stopReader = true;
+    reader.join();
+    close(readerFd);
+
+    printf("%-8s: %.0f wakeups/s, %.0f callbacks/s, %.0f interest changes/s, downstream %.1f MB/s\n",
+           name.c_str(),
+           (after.wakeupNr - before.wakeupNr) / elapsed,
+           (after.eventNr + after.readyNr - before.eventNr - before.readyNr) / elapsed,
+           (after.modifyNr - before.modifyNr) / elapsed,
+           downBytes / elapsed / 1e6);
+
+    source->end();
+    if (inSock) {
+        inSock->end();
+    }
+    if (outSock) {
+        outSock->end();
+    }
+    inListen->end();
+    outListen->end();
+}
+
+static int benchPauseWakeups(const vector<string> &args) {
+    double seconds = args.size() > 0 ? stod(args[0]) : 2;
+    size_t sipBytes = args.size() > 1 ? stoul(args[1]) : 4096;
+    int sipIntervalUs = args.size() > 2 ? stoi(args[2]) : 100;
+
+    printf("Proxy with a downstream reading %zu bytes every %dus, %.1fs per run\n",
+           sipBytes, sipIntervalUs, seconds);
+    pauseRun("recvFn", false, seconds, sipBytes, sipIntervalUs);
+    pauseRun("pause", true, seconds, sipBytes, sipIntervalUs);
+
+    return 0;
+}
+
+
+/*
+ * Egress scheduling under overload: bulk senders keep their queues full,
+ * while a premium connection sends a small timestamped message every ms. All
+ * share an egress scheduler capped at capBytes per iteration. Report the
+ * premium messages' latency with plain round robin, and with the premium
+ * connection in a higher priority class.
+ */
+static void egressRun(const string &name, NEgressSchedulerPtr sched, int premiumClass,
+                      double seconds, size_t bulkNr) {
+    bool exitLoop = false;
+    vector<double> latencyUs;
+    uint64_t bulkBytes = 0;
+    vector<NSockPtr> socks;
+    const size_t msgLen = 64;
+
+    auto onError = [&] (NSockPtr sock, int error) {
+        printf("%-8s: socket error %d (%s)\n", name.c_str(), error, strerror(error));
+        exitLoop = true;
+    };
+
+    auto sink = [&] (NSockPtr, const uint8_t *, int len) {
+        bulkBytes += len;
+        return (size_t)len;
+    };
+
+    vector<uint8_t> chunk(64 * 1024, 'b');
+    auto pump = [&] (NSockPtr sock) {
+        while (!exitLoop && sock->send(chunk.data(), chunk.size()) == (int)chunk.size()) {
+        }
+    };
+
+    for (size_t i = 0; i < bulkNr; i++) {
+        auto [bulk, peer] = NSock::pair();
+        peer->setRecvFn(sink);
+        peer->setErrorFn(onError);
+        bulk->setErrorFn(onError);
+        bulk->setEgressScheduler(sched, 1, 0);
+        bulk->setDrainFn(pump);
+        socks.push_back(bulk);
+        socks.push_back(peer);
+        pump(bulk);
+    }
+
+    auto [premium, premiumPeer] = NSock::pair();
+    premium->setErrorFn(onError);
+    premium->setEgressScheduler(sched, 1, premiumClass);
+    premiumPeer->setErrorFn(onError);
+    premiumPeer->setRecvFn([&] (NSockPtr, const uint8_t *buf, int len) {
+        size_t off = 0;
+        for (; off + msgLen <= (size_t)len; off += msgLen) {
+            Clock::rep sentAt;
+            memcpy(&sentAt, buf + off, sizeof sentAt);
+            auto delay = Clock::now() - Clock::time_point(Clock::duration(sentAt));
+            latencyUs.push_back(chrono::duration<double, micro>(delay).count());
+        }
+        return off;
+    });
+    socks.push_back(premium);
+    socks.push_back(premiumPeer);
+
+    auto start = Clock::now();
+    function<void ()> tick = [&] () {
+        if (secondsSince(start) >= seconds) {
+            exitLoop = true;
+            return;
+        }
+        uint8_t msg[msgLen] = {0};
+        Clock::rep now = Clock::now().time_since_epoch().count();
+        memcpy(msg, &now, sizeof now);
+        premium->send(msg, sizeof msg);
+        npollAddTimer(1, tick);
+    };
+    tick();
+
+    npollLoop(exitLoop);
+    double elapsed = secondsSince(start);
+
+    sort(latencyUs.begin(), latencyUs.end());
+    auto pct = [&] (double p) {
+        return latencyUs.empty() ? 0.0 : latencyUs[min(latencyUs.size() - 1, (size_t)(p * latencyUs.size()))];
+    };
+    printf("%-8s: premium %zu msgs, p50 %.0fus, p99 %.0fus, max %.0fus; bulk %.2f Gbit/s\n",
+           name.c_str(), latencyUs.size(), pct(0.5), pct(0.99),
+           latencyUs.empty() ? 0.0 : latencyUs.back(), bulkBytes * 8 / elapsed / 1e9);
+
+    for (auto &sock : socks) {
+        sock->end();
+    }
+}
+
+static int benchEgress(const vector<string> &args) {
+    double seconds = args.size() > 0 ? stod(args[0]) : 2;
+    size_t bulkNr = args.size() > 1 ? stoul(args[1]) : 16;
+    size_t cap = args.size() > 2 ? stoul(args[2]) : 256 * 1024;
+
+    printf("%zu bulk senders + 1 premium, egress capped at %zu bytes/iteration, %.1fs per run\n",
+           bulkNr, cap, seconds);
+    egressRun("drr", NEgressScheduler::create(cap), 0, seconds, bulkNr);
+    egressRun("priority", NEgressScheduler::create(cap), 1, seconds, bulkNr);
+
+    return 0;
+}
+
+
+/*
+ * Proxying a TCP stream over loopback: client -> proxy -> sink, with the
+ * proxy copying through onRecv/send(), or splicing with pipe().
+ */
+static void proxyRun(const string &name, bool splice, double seconds, size_t chunk) {
+    uint64_t rxBytes = 0;
+    bool exitLoop = false;
+    bool failed = false;
+    NSockPtr sinkConn, proxyIn, proxyOut;
+    Clock::time_point start;
+
+    auto onError = [&] (NSockPtr sock, int error) {
+        printf("%-8s: socket error %d (%s)\n", name.c_str(), error, strerror(error));
+        failed = true;
+        exitLoop = true;
+    };
+
+    auto sinkListen = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        sinkConn = sock;
+        sock->setErrorFn(onError);
+        sock->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+            rxBytes += len;
+            return (size_t)len;
+        });
+    });
+
+    auto proxyListen = NSock::listen("127.0.0.1", 0, [&] (NSockPtr sock) {
+        proxyIn = sock;
+        sock->setErrorFn(onError);
+        proxyOut = NSock::connect("127.0.0.1", localPort(sinkListen), nullptr, onError);
+        if (splice) {
+            sock->pipe(proxyOut, 1024 * 1024);
+            return;
+        }
+
+        proxyOut->setDrainFn([&] (NSockPtr) {
+            proxyIn->resume();
+        });
+        sock->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+            int n = proxyOut->send(buf, len);
+            if (n < len) {
+                sock->pause();
+            }
+            return (size_t)max(n, 0);
+        });
+    });
+
+    vector<uint8_t> buf(chunk, 'p');
+    auto pump = [&] (NSockPtr sock) {
+        while (!exitLoop) {
+            if (secondsSince(start) >= seconds) {
+                exitLoop = true;
+                break;
+            }
+            if (sock->send(buf.data(), buf.size()) < (int)buf.size()) {
+                break;
+            }
+        }
+    };
+
+    auto client = NSock::connect("127.0.0.1", localPort(proxyListen), nullptr, onError);
+    client->setDrainFn(pump);
+    start = Clock::now();
+    pump(client);
+
+    npollLoop(exitLoop);
+    double elapsed = secondsSince(start);
+
+    if (!failed) {
+        printf("%-8s: %.2f Gbit/s", name.c_str(), rxBytes * 8 / elapsed / 1e9);
+        if (splice && proxyIn) {
+            printf(", %lu bytes spliced, pipe full %lu times",
+                   proxyIn->getStats().splicedBytes, proxyIn->getStats().pipeFullNr);
+        }
+        printf("\n");
+    }
+
+    for (auto &sock : {client, proxyIn, proxyOut, sinkConn, proxyListen, sinkListen}) {
+        if (sock) {
+            sock->destroy();
+        }
+    }
+}
+
+static int benchSplice(const vector<string> &args) {
+    double seconds = args.size() > 0 ? stod(args[0]) : 2;
+    size_t chunk = args.size() > 1 ? stoul(args[1]) : 64 * 1024;
+
+    printf("TCP loopback client -> proxy -> sink, %zu byte sends, %.1fs per run\n",
+           chunk, seconds);
+    proxyRun("copy", false, seconds, chunk);
+    proxyRun("splice", true, seconds, chunk);
+
+    return 0;
+}
+
+/*
+ * One publisher fanning messages out to subNr subscribers (socket pairs),
+ * with a copy per subscriber, or one shared NBuffer for all of them. One
+ * subscriber in ten never reads: a subscriber with a few messages queued
+ * already is skipped, so those hold that much each.
+ */
+static void fanOutRun(const string &name, bool shared, size_t subNr,
+                      double seconds, size_t msgBytes) {
+    vector<NSockPtr> pubs, subs;
+    uint64_t rxBytes = 0;
+    for (size_t i = 0; i < subNr; i++) {
+        auto [pub, sub] = NSock::pair();
+        if (!pub || !sub) {
+            printf("%-8s: socket pair %zu failed\n", name.c_str(), i);
+            return;
+        }
+        sub->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+            rxBytes += len;
+            return (size_t)len;
+        });
+        if (i % 10 == 9) {
+            sub->pause();
+        }
+        pubs.push_back(pub);
+        subs.push_back(sub);
+    }
+
+    vector<uint8_t> msg(msgBytes, 'f');
+    size_t highWater = 4 * msgBytes;
+    uint64_t publishedNr = 0;
+    uint64_t skippedNr = 0;
+    size_t peakHeld = 0;
+    vector<weak_ptr<const NBuffer>> live;
+    bool exitLoop = false;
+    auto start = Clock::now();
+
+    BenchTicker ticker([&] () {
+        if (secondsSince(start) >= seconds) {
+            exitLoop = true;
+            return;
+        }
+        NBufferPtr buffer;
+        if (shared) {
+            buffer = NBuffer::copy(msg.data(), msg.size());
+            live.push_back(buffer);
+        }
+
+        size_t held = 0;
+        for (auto &pub : pubs) {
+            if (pub->getQueuedBytes() >= highWater) {
+                ++skippedNr;
+                held += pub->getQueuedBytes();
+                continue;
+            }
+            if (shared) {
+                pub->send(NBufSlice(buffer));
+            } else {
+                pub->send(msg.data(), msg.size());
+            }
+            held += pub->getQueuedBytes();
+        }
+        ++publishedNr;
+
+        // What the queues hold: the copies, or the buffers still referenced
+        if (shared) {
+            live.erase(remove_if(live.begin(), live.end(),
+                                 [] (const weak_ptr<const NBuffer> &buf) {
+                                     return buf.expired();
+                                 }),
+                       live.end());
+            held = live.size() * msgBytes;
+        }
+        peakHeld = max(peakHeld, held);
+    });
+
+    npollLoop(exitLoop);
+    double elapsed = secondsSince(start);
+
+    uint64_t sharedBytes = 0;
+    for (auto &pub : pubs) {
+        sharedBytes += pub->getStats().sharedSendBytes;
+    }
+
+    printf("%-8s %8zu %10.0f %10.2f %12.1f %12lu %14lu\n", name.c_str(), subNr,
+           publishedNr / elapsed, rxBytes * 8 / elapsed / 1e9,
+           peakHeld / 1024.0 / 1024.0, skippedNr, sharedBytes);
+
+    for (size_t i = 0; i < subNr; i++) {
+        pubs[i]->destroy();
+        subs[i]->destroy();
+    }
+}
+
+static int benchFanOut(const vector<string> &args) {
+    double seconds = args.size() > 0 ? stod(args[0]) : 2;
+    size_t msgBytes = args.size() > 1 ? stoul(args[1]) : 16 * 1024;
+    vector<size_t> subNrs;
+    for (size_t i = 2; i < args.size(); i++) {
+        subNrs.push_back(stoul(args[i]));
+    }
+    if (subNrs.empty()) {
+        subNrs = {1000, 10000};
+    }
+
+    // Two fds per subscriber
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    size_t maxSubNr = limit.rlim_cur > 128 ? (limit.rlim_cur - 64) / 2 : 32;
+
+    printf("Fan-out of %zu byte messages, %.1fs per run\n", msgBytes, seconds);
+    printf("%-8s %8s %10s %10s %12s %12s %14s\n", "run", "subs", "msgs/s", "Gbit/s",
+           "peak MB held", "skipped", "shared bytes");
+    for (size_t subNr : subNrs) {
+        if (subNr > maxSubNr) {
+            printf("(%zu subscribers need more fds than RLIMIT_NOFILE allows, using %zu)\n",
+                   subNr, maxSubNr);
+            subNr = maxSubNr;
+        }
+        fanOutRun("copy", false, subNr, seconds, msgBytes);
+        fanOutRun("shared", true, subNr, seconds, msgBytes);
+    }
+
+    return 0;
+}
+
+static double rssMb() {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE) / 1024.0 / 1024.0;
+}
+
+/*
+ * Connection churn over a unix socket: inFlight clients at a time connect,
+ * send a line, get it echoed back, and close. Each one is an accepted and a
+ * connected NSock, with their buffers, from the nalloc slabs. RSS should
+ * level off once the slabs cover the connections in flight.
+ */
+static int benchChurn(const vector<string> &args) {
+    double seconds = args.size() > 0 ? stod(args[0]) : 4;
+    size_t inFlight = args.size() > 1 ? stoul(args[1]) : 64;
+    size_t sampleNr = 8;
+
+    string path = "@nsockBench-churn-" + to_string(getpid());
+    bool exitLoop = false;
+    uint64_t doneNr = 0;
+    string line = "churn\n";
+    set<NSockPtr> clients, servers;
+
+    NSockOnRecvFunc echoOnce = [&] (NSockPtr sock, const uint8_t *buf, int len) {
+        sock->send(buf, len);
+        sock->end();
+        servers.erase(sock);
+        return (size_t)len;
+    };
+    auto listenSock = NSock::listenUnix(path, [&] (NSockPtr sock) {
+        servers.insert(sock);
+        sock->setRecvFn(echoOnce);
+    });
+    if (!listenSock) {
+        printf("Failed to listen on %s\n", path.c_str());
+        return -1;
+    }
+
+    function<void ()> connectOne = [&] () {
+        auto sock = NSock::connectUnix(path,
+            [&] (NSockPtr sock, const uint8_t *buf, int len) {
+                sock->destroy();
+                clients.erase(sock);
+                ++doneNr;
+                if (!exitLoop) {
+                    connectOne();
+                }
+                return (size_t)len;
+            },
+            [&] (NSockPtr sock, int error) {
+                printf("socket error %d (%s)\n", error, strerror(error));
+                sock->destroy();
+                clients.erase(sock);
+                exitLoop = true;
+            });
+        if (!sock) {
+            printf("Failed to connect to %s\n", path.c_str());
+            exitLoop = true;
+            return;
+        }
+        clients.insert(sock);
+        sock->send((const uint8_t *)line.data(), line.size());
+    };
+
+    printf("Connection churn over a unix socket, %zu in flight, %.1fs\n", inFlight, seconds);
+    printf("%8s %12s %10s %12s %12s\n", "seconds", "accepts/s", "RSS MB", "slab MB",
+           "in use MB");
+
+    auto start = Clock::now();
+    auto last = start;
+    uint64_t lastDone = 0;
+    size_t samples = 0;
+    function<void ()> sample = [&] () {
+        double interval = secondsSince(last);
+        auto stat = nallocGetStats();
+        printf("%8.1f %12.0f %10.1f %12.1f %12.1f\n", secondsSince(start),
+               (doneNr - lastDone) / interval, rssMb(),
+               stat.slabBytes / 1024.0 / 1024.0, stat.inUseBytes / 1024.0 / 1024.0);
+        last = Clock::now();
+        lastDone = doneNr;
+        if (++samples == sampleNr) {
+            exitLoop = true;
+            return;
+        }
+        npollAddTimer(seconds * 1000 / sampleNr, sample);
+    };
+    npollAddTimer(seconds * 1000 / sampleNr, sample);
+
+    for (size_t i = 0; i < inFlight; i++) {
+        connectOne();
+    }
+    npollLoop(exitLoop);
+
+    auto stat = nallocGetStats();
+    printf("%lu connections; NSock slabs: ", doneNr);
+    for (auto &slab : stat.objects) {
+        printf("%s ", slab.toString().c_str());
+    }
+    printf("\n");
+
+    // Let the closing ones see their peer go
+    for (auto &set : {clients, servers}) {
+        for (auto &sock : set) {
+            sock->destroy();
+        }
+    }
+    listenSock->destroy();
+    exitLoop = false;
+    npollAddTimer(100, [&] () {
+        exitLoop = true;
+    });
+    npollLoop(exitLoop);
+
+    return 0;
+}
+
+static double anonHugeMb() {
+    long kb = 0;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof line, f)) {
+            if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+    }
+    return kb / 1024.0;
+}
+
+/*
+ * Small messages round robin over pairNr socket pairs, so that each send and
+ * receive touches another connection's buffers. Each mode runs in a child
+ * process of its own, with the slabs from malloc, or from huge page arenas.
+ */
+static void hugePagesRun(const string &name, bool hugePages, size_t pairNr,
+                         double seconds, size_t msgBytes) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("%-8s: fork failed: %s\n", name.c_str(), strerror(errno));
+        return;
+    }
+    if (pid > 0) {
+        waitpid(pid, nullptr, 0);
+        return;
+    }
+
+    nallocUseHugePages(hugePages);
+
+    vector<NSockPtr> txs, rxs;
+    uint64_t rxNr = 0;
+    for (size_t i = 0; i < pairNr; i++) {
+        auto [tx, rx] = NSock::pair();
+        if (!tx || !rx) {
+            printf("%-8s: socket pair %zu failed\n", name.c_str(), i);
+            _exit(1);
+        }
+        rx->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+            size_t n = len - len % msgBytes;
+            rxNr += n / msgBytes;
+            return n;
+        });
+        txs.push_back(tx);
+        rxs.push_back(rx);
+    }
+
+    vector<uint8_t> msg(msgBytes, 'h');
+    size_t next = 0;
+    bool exitLoop = false;
+    auto start = Clock::now();
+
+    BenchTicker ticker([&] () {
+        if (secondsSince(start) >= seconds) {
+            exitLoop = true;
+            return;
+        }
+        for (size_t i = 0; i < 256; i++) {
+            txs[next]->send(msg.data(), msg.size());
+            next = (next + 1) % pairNr;
+        }
+    });
+
+    npollLoop(exitLoop);
+    double elapsed = secondsSince(start);
+
+    auto stat = nallocGetStats();
+    printf("%-8s %8zu %12.0f %8lu %8lu %8lu %12.1f %12.1f\n", name.c_str(), pairNr,
+           rxNr / elapsed, stat.arenaNr, stat.hugeTlbArenaNr, stat.thpArenaNr,
+           stat.slabBytes / 1024.0 / 1024.0, anonHugeMb());
+    fflush(stdout);
+
+    _exit(0);
+}
+
+static int benchHugePages(const vector<string> &args) {
+    size_t pairNr = args.size() > 0 ? stoul(args[0]) : 2000;
+    double seconds = args.size() > 1 ? stod(args[1]) : 2;
+    size_t msgBytes = args.size() > 2 ? stoul(args[2]) : 64;
+
+    // Two fds per pair
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    size_t maxPairNr = limit.rlim_cur > 128 ? (limit.rlim_cur - 64) / 2 : 32;
+    if (pairNr > maxPairNr) {
+        printf("(%zu pairs need more fds than RLIMIT_NOFILE allows, using %zu)\n",
+               pairNr, maxPairNr);
+        pairNr = maxPairNr;
+    }
+
+    printf("%zu byte messages round robin over socket pairs, %.1fs per run\n",
+           msgBytes, seconds);
+    printf("%-8s %8s %12s %8s %8s %8s %12s %12s\n", "run", "pairs", "msgs/s", "arenas",
+           "hugetlb", "thp", "slab MB", "AnonHuge MB");
+    fflush(stdout);
+    hugePagesRun("heap", false, pairNr, seconds, msgBytes);
+    hugePagesRun("huge", true, pairNr, seconds, msgBytes);
+
+    return 0;
+}
+
+/*
+ * CircularBuffer, plain and mirrored: odd sized puts, drained with peek() and
+ * consume() the way writeToSocket() does, counting the pieces it takes. Then
+ * a socket pair streaming through send buffers of each kind.
+ */
+static void ringRun(const string &name, bool mirrored, double seconds, size_t msgBytes) {
+    CircularBuffer ring(64 * 1024, mirrored);
+    if (ring.isMirrored() != mirrored) {
+        printf("%-8s: no mirrored buffer, skipped\n", name.c_str());
+        return;
+    }
+
+    vector<uint8_t> msg(msgBytes, 'r');
+    uint64_t bytes = 0, pieceNr = 0;
+    auto start = Clock::now();
+    while (secondsSince(start) < seconds) {
+        for (size_t i = 0; i < 1000; i++) {
+            ring.put(msg.data(), msg.size());
+            while (!ring.empty()) {
+                uint8_t *buf;
+                size_t len = ring.peek(&buf);
+                ring.consume(len);
+                bytes += len;
+                ++pieceNr;
+            }
+        }
+    }
+    double elapsed = secondsSince(start);
+
+    nallocUseMirroredBuffers(mirrored);
+    auto [tx, rx] = NSock::pair();
+    nallocUseMirroredBuffers(false);
+    uint64_t rxBytes = 0;
+    rx->setRecvFn([&] (NSockPtr sock, const uint8_t *buf, int len) {
+        rxBytes += len;
+        return (size_t)len;
+    });
+
+    bool exitLoop = false;
+    auto streamStart = Clock::now();
+    auto pump = [&] (NSockPtr sock) {
+        while (!exitLoop && sock->send(msg.data(), msg.size()) == (int)msg.size()) {
+        }
+    };
+    tx->setDrainFn(pump);
+    pump(tx);
+    npollAddTimer(seconds * 1000, [&] () {
+        exitLoop = true;
+    });
+    npollLoop(exitLoop);
+    double streamElapsed = secondsSince(streamStart);
+
+    printf("%-8s %11.2f %11.2f %12.2f\n", name.c_str(), bytes * 8 / elapsed / 1e9,
+           (double)pieceNr / (bytes / msgBytes), rxBytes * 8 / streamElapsed / 1e9);
+
+    tx->destroy();
+    rx->destroy();
+}
+
+static int benchRing(const vector<string> &args) {
+    double seconds = args.size() > 0 ? stod(args[0]) : 2;
+    size_t msgBytes = args.size() > 1 ? stoul(args[1]) : 3000;
+
+    printf("%zu byte puts into a 64KB ring, %.1fs per run\n", msgBytes, seconds);
+    printf("%-8s %11s %11s %12s\n", "run", "ring Gbit/s", "pieces/put",
+           "pair Gbit/s");
+    ringRun("plain", false, seconds, msgBytes);
+    ringRun("mirrored", true, seconds, msgBytes);
+
+    return 0;
+}
+
+/*
+ * The accept filter's cost per accept with many tracked addresses: repeat
+ * visitors (all in the table), new addresses (each one takes or evicts a
+ * slot), and with a deny list to check first.
+ */
+static int benchAcceptFilter(const vector<string> &args) {
+    size_t trackedNr = args.size() > 0 ? stoul(args[0]) : 1000 * 1000;
+    size_t lookupNr = args.size() > 1 ? stoul(args[1]) : 10 * 1000 * 1000;
+
+    auto ipv4 = [] (uint32_t ip) {
+        struct sockaddr_storage addr = {0};
+        auto sin = reinterpret_cast<struct sockaddr_in *>(&addr);
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(ip);
+        return addr;
+    };
+
+    // Addresses spread over the IPv4 space, in a fixed pseudo random order
+    vector<struct sockaddr_storage> addrs(trackedNr);
+    for (size_t i = 0; i < trackedNr; i++) {
+        addrs[i] = ipv4((uint32_t)(0x0b000000 + i * 2654435761U));
+    }
+
+    printf("%zu tracked addresses, %zu lookups per run\n", trackedNr, lookupNr);
+    printf("%-12s %12s %12s %12s\n", "run", "ns/accept", "limited", "evicted");
+
+    auto run = [&] (const char *name, size_t denyNr, bool fresh) {
+        auto filter = NAcceptFilter::create(1000, 1000, trackedNr);
+        for (size_t i = 0; i < denyNr; i++) {
+            filter->deny("240." + to_string(i) + ".0.0/16");
+        }
+        for (auto &addr : addrs) {
+            filter->admit(addr, 0);
+        }
+        auto before = filter->getStats();
+
+        // Stay within one window, so that nothing expires
+        size_t admitted = 0;
+        auto start = Clock::now();
+        for (size_t i = 0; i < lookupNr; i++) {
+            if (fresh) {
+                admitted += filter->admit(ipv4((uint32_t)(0xc0000000 + i * 2246822519U)), 500);
+            } else {
+                admitted += filter->admit(addrs[(i * 7919) % trackedNr], 500);
+            }
+        }
+        double elapsed = secondsSince(start);
+
+        auto stat = filter->getStats();
+        printf("%-12s %12.1f %12lu %12lu\n", name, elapsed * 1e9 / lookupNr,
+               stat.limitNr - before.limitNr, stat.evictNr - before.evictNr);
+        return admitted;
+    };
+
+    run("repeat", 0, false);
+    run("new", 0, true);
+    run("repeat+deny", 16, false);
+
+    return 0;
+}
+
+/*
+ * Finding line ends: getline() (what CommandServer does), memchr, each
+ * scanByte() implementation, and NLineFramer fed 64KB reads.
+ */
+static int benchLineScan(const vector<string> &args) {
+    size_t totalBytes = args.size() > 0 ? stoul(args[0]) : 16 * 1024 * 1024;
+
+    printf("%-8s %12s %12s %12s %12s %12s %12s\n", "lineLen",
+           "getline", "memchr", "scalar", "sse2", "avx2", "lineFramer");
+
+    for (size_t lineLen : {8, 32, 128, 512, 2048}) {
+        string data;
+        data.reserve(totalBytes + lineLen);
+        while (data.size() < totalBytes) {
+            data.append(lineLen - 1, 'x');
+            data += '\n';
+        }
+        const uint8_t *buf = reinterpret_cast<const uint8_t *>(data.data());
+        size_t lineNr = data.size() / lineLen;
+
+        // Returns ns per line
+        auto timeIt = [&] (function<size_t ()> countLines) {
+            auto start = Clock::now();
+            size_t n = countLines();
+            double elapsed = secondsSince(start);
+            if (n != lineNr) {
+                printf("line count mismatch: %zu != %zu\n", n, lineNr);
+            }
+            return elapsed * 1e9 / lineNr;
+        };
+
+        double getlineNs = timeIt([&] () {
+            istringstream is(data);
+            string line;
+            size_t n = 0;
+            while (getline(is, line)) {
+                ++n;
+            }
+            return n;
+        });
+
+        double memchrNs = timeIt([&] () {
+            size_t n = 0;
+            const uint8_t *p = buf, *end = buf + data.size();
+            while ((p = static_cast<const uint8_t *>(memchr(p, '\n', end - p)))) {
+                ++n;
+                ++p;
+            }
+            return n;
+        });
+
+        double implNs[3] = {-1, -1, -1};
+        for (auto impl : {NScanScalar, NScanSse2, NScanAvx2}) {
+            if (!scanImplSupported(impl)) {
+                continue;
+            }
+            implNs[impl] = timeIt([&] () {
+                size_t n = 0;
+                const uint8_t *p = buf, *end = buf + data.size();
+                while ((p = scanByteWith(impl, p, end - p, '\n'))) {
+                    ++n;
+                    ++p;
+                }
+                return n;
+            });
+        }
+
+        double framerNs = timeIt([&] () {
+            size_t n = 0;
+            auto framer = make_shared<NLineFramer>([&] (NSockPtr, const uint8_t *, size_t) {
+                ++n;
+                return true;
+            }, lineLen);
+            const size_t readSize = 64 * 1024;
+            for (size_t off = 0; off < data.size(); off += readSize) {
+                framer->feed(nullptr, buf + off, min(readSize, data.size() - off));
+            }
+            return n;
+        });
+
+        printf("%-8zu %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f\n", lineLen,
+               getlineNs, memchrNs, implNs[0], implNs[1], implNs[2], framerNs);
+    }
+
+    printf("(ns per line, %s used by default, -1 = not supported)\n",
+           scanImplName(scanImpl()));
+
+    return 0;
+}
+
+
+struct BenchEntry {
+    const char *usage;
+    function<int (const vector<string> &args)> fn;
+};
+
+static const map<string, BenchEntry> sBenchTable = {
+    {"udp-pps", {"[seconds] [payloadBytes]", benchUdpPps}},
+    {"tls-throughput", {"[seconds] [sendBytes]", benchTlsThroughput}},
+    {"line-scan", {"[totalBytes]", benchLineScan}},
+    {"fairness", {"[seconds] [miceNr] [budgetBytes]", benchFairness}},
+    {"pause-wakeups", {"[seconds] [sipBytes] [sipIntervalUs]", benchPauseWakeups}},
+    {"egress", {"[seconds] [bulkNr] [capBytes]", benchEgress}},
+    {"accept-filter", {"[trackedNr] [lookupNr]", benchAcceptFilter}},
+    {"splice", {"[seconds] [sendBytes]", benchSplice}},
+    {"fan-out", {"[seconds] [msgBytes] [subscriberNr...]", benchFanOut}},
+    {"churn", {"[seconds] [inFlight]", benchChurn}},
+    {"huge-pages", {"[pairNr] [seconds] [msgBytes]", benchHugePages}},
+    {"ring", {"[seconds] [msgBytes]", benchRing}},
+};
+
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || sBenchTable.find(argv[1]) == sBenchTable.end()) {
+        printf("%s: <benchmark> [args...]\n", argv[0]);
+        for (auto &kv : sBenchTable) {
+            printf("    %s %s\n", kv.first.c_str(), kv.second.usage);
+        }
+        return -1;
+    }
+
+    logSetPath("/tmp/nsock/nsockBench");
+
+    vector<string> args(argv + 2, argv + argc);
+    return sBenchTable.at(argv[1]).fn(args);
+}
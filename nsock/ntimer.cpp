@@ -0,0 +1,123 @@
+#include <chrono>
+#include <algorithm>
+
+#include "ntimer.h"
+#include "npoll.h"
+
+
+using namespace std;
+using namespace npoll;
+
+namespace nsock {
+
+
+NTimerWheel &NTimerWheel::get() {
+    static NTimerWheel sWheel;
+    return sWheel;
+}
+
+
+uint64_t NTimerWheel::nowMs() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+NTimerWheel::NTimerWheel(uint64_t tickMs, size_t slotNr) :
+    tickMs(max<uint64_t>(tickMs, 1)), slots(max<size_t>(slotNr, 1)) {
+}
+
+
+NTimerWheel::~NTimerWheel() {
+    if (npollTimer) {
+        npollCancelTimer(npollTimer);
+    }
+}
+
+
+NTimerWheel::TimerId NTimerWheel::add(uint64_t delayMs, TimerFunc fn) {
+    arm();
+
+    // Due after this many ticks, counting from the last one, so never early
+    uint64_t sinceTick = nowMs() - lastTickMs;
+    uint64_t ticks = max<uint64_t>(1, (delayMs + sinceTick + tickMs - 1) / tickMs);
+    size_t slot = (cursor + ticks) % slots.size();
+
+    TimerId id = ++lastId;
+    auto &list = slots[slot];
+    list.push_back({id, (ticks - 1) / slots.size(), fn});
+    index[id] = {slot, prev(list.end())};
+
+    return id;
+}
+
+
+bool NTimerWheel::cancel(TimerId id) {
+    auto it = index.find(id);
+    if (it == index.end()) {
+        return false;
+    }
+
+    slots[it->second.first].erase(it->second.second);
+    index.erase(it);
+
+    return true;
+}
+
+
+/*
+ * Start ticking if we are not already.
+ */
+void NTimerWheel::arm() {
+    if (npollTimer) {
+        return;
+    }
+
+    lastTickMs = nowMs();
+    npollTimer = npollAddTimer(tickMs, [this] () {
+        npollTimer = 0;
+        tick();
+    });
+}
+
+
+/*
+ * Advance the wheel by the ticks that passed, firing what is due.
+ */
+void NTimerWheel::tick() {
+    uint64_t now = nowMs();
+    uint64_t ticks = max<uint64_t>(1, (now - lastTickMs) / tickMs);
+    lastTickMs += ticks * tickMs;
+
+    for (uint64_t t = 0; t < ticks && !index.empty(); t++) {
+        cursor = (cursor + 1) % slots.size();
+
+        // Take out what is due first: the callbacks may add and cancel
+        vector<TimerFunc> due;
+        auto &list = slots[cursor];
+        for (auto it = list.begin(); it != list.end();) {
+            if (it->rounds) {
+                --it->rounds;
+                ++it;
+                continue;
+            }
+            due.push_back(move(it->fn));
+            index.erase(it->id);
+            it = list.erase(it);
+        }
+
+        for (auto &fn : due) {
+            fn();
+        }
+    }
+
+    if (!index.empty() && !npollTimer) {
+        uint64_t sinceTick = nowMs() - lastTickMs;
+        npollTimer = npollAddTimer(sinceTick < tickMs ? tickMs - sinceTick : 0, [this] () {
+            npollTimer = 0;
+            tick();
+        });
+    }
+}
+
+}
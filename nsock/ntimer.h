@@ -0,0 +1,67 @@
+#ifndef _NTIMER_H
+#define _NTIMER_H
+
+#include <functional>
+#include <vector>
+#include <list>
+#include <unordered_map>
+
+#include <inttypes.h>
+
+
+namespace nsock {
+
+/*
+ * A hashed timer wheel, for the many long, mostly cancelled or pushed back
+ * timeouts of connections: adding and cancelling are O(1), and the whole
+ * wheel is driven by a single npoll timer per tick, armed only while the
+ * wheel has entries. Timers fire on the tick after they are due, so they are
+ * up to tickMs late.
+ */
+class NTimerWheel {
+public:
+    typedef uint64_t TimerId;
+    typedef std::function<void ()> TimerFunc;
+
+    static const uint64_t sDefaultTickMs = 100;
+    static const size_t sDefaultSlotNr = 512;
+
+    /* The wheel shared by the sockets of the loop */
+    static NTimerWheel &get();
+
+    NTimerWheel(uint64_t tickMs=sDefaultTickMs, size_t slotNr=sDefaultSlotNr);
+    ~NTimerWheel();
+
+    /* Return a non-zero id, to cancel the timer with */
+    TimerId add(uint64_t delayMs, TimerFunc fn);
+    bool cancel(TimerId id);
+
+    size_t size() const {
+        return index.size();
+    }
+
+    /* The monotonic clock used for deadlines, in ms */
+    static uint64_t nowMs();
+
+private:
+    struct Entry {
+        TimerId id;
+        uint64_t rounds;        // full turns of the wheel to wait
+        TimerFunc fn;
+    };
+
+    void arm();
+    void tick();
+
+    uint64_t tickMs;
+    std::vector<std::list<Entry>> slots;
+    std::unordered_map<TimerId, std::pair<size_t, std::list<Entry>::iterator>> index;
+    size_t cursor = 0;
+    uint64_t lastTickMs = 0;
+    TimerId lastId = 0;
+    uint64_t npollTimer = 0;
+};
+
+}
+
+#endif
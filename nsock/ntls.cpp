@@ -0,0 +1,483 @@
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/tls.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/core_names.h>
+#include <openssl/x509.h>
+
+#include "ntls.h"
+#include "util.h"
+
+
+using namespace std;
+
+namespace nsock {
+
+
+static void keyLogCb(const SSL *ssl, const char *line) {
+    auto handshake = static_cast<NTlsHandshake *>(SSL_get_app_data(ssl));
+    if (handshake) {
+        handshake->onKeyLog(line);
+    }
+}
+
+
+SSL_CTX *NTlsContext::newCtx(bool isServer) {
+    SSL_CTX *ctx = SSL_CTX_new(isServer ? TLS_server_method() : TLS_client_method());
+    if (!ctx) {
+        throw runtime_error("Failed SSL_CTX_new()");
+    }
+
+    // The suites the kernel side is set up for (see ktlsCiphers)
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:"
+                                  "TLS_CHACHA20_POLY1305_SHA256");
+    SSL_CTX_set_keylog_callback(ctx, keyLogCb);
+
+    if (isServer) {
+        // Nothing resumes a session, so don't bother the clients with
+        // tickets
+        SSL_CTX_set_num_tickets(ctx, 0);
+    }
+
+    return ctx;
+}
+
+
+NTlsContext::~NTlsContext() {
+    SSL_CTX_free(ctx);
+}
+
+
+NTlsContextPtr NTlsContext::createServer(const string &certFile,
+                                         const string &keyFile) {
+    SSL_CTX *ctx = newCtx(true);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1) {
+        SSL_CTX_free(ctx);
+        stringstream ss;
+        ss << "Failed to load certificate " << certFile << " or key " << keyFile << endl;
+        throw runtime_error(ss.str());
+    }
+
+    return make_shared<NTlsContext>(ctx);
+}
+
+
+NTlsContextPtr NTlsContext::createSelfSignedServer(const string &commonName) {
+    SSL_CTX *ctx = newCtx(true);
+
+    EVP_PKEY *pkey = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    if (!pkey || !cert) {
+        EVP_PKEY_free(pkey);
+        X509_free(cert);
+        SSL_CTX_free(ctx);
+        throw runtime_error("Failed to create self-signed certificate");
+    }
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 30 * 24 * 3600);
+    X509_set_pubkey(cert, pkey);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>(commonName.c_str()),
+                               -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_sign(cert, pkey, EVP_sha256());
+
+    int ok = SSL_CTX_use_certificate(ctx, cert) == 1 &&
+             SSL_CTX_use_PrivateKey(ctx, pkey) == 1;
+
+    // The SSL_CTX holds its own references
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+
+    if (!ok) {
+        SSL_CTX_free(ctx);
+        throw runtime_error("Failed to use self-signed certificate");
+    }
+
+    return make_shared<NTlsContext>(ctx);
+}
+
+
+NTlsContextPtr NTlsContext::createClient(bool verifyPeer, const string &caFile) {
+    SSL_CTX *ctx = newCtx(false);
+
+    if (verifyPeer) {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+        int ok = caFile.empty() ? SSL_CTX_set_default_verify_paths(ctx) :
+                                  SSL_CTX_load_verify_locations(ctx, caFile.c_str(), nullptr);
+        if (ok != 1) {
+            SSL_CTX_free(ctx);
+            throw runtime_error("Failed to load CA certificates");
+        }
+    }
+
+    return make_shared<NTlsContext>(ctx);
+}
+
+
+NTlsHandshake::NTlsHandshake(NTlsContextPtr ctx, int fd, bool server,
+                             const string &hostname) :
+    tlsCtx(ctx), sockfd(fd), isServer(server) {
+    ssl = SSL_new(ctx->get());
+    assert(ssl);
+    SSL_set_fd(ssl, fd);
+    SSL_set_app_data(ssl, this);
+
+    if (isServer) {
+        SSL_set_accept_state(ssl);
+        return;
+    }
+
+    SSL_set_connect_state(ssl);
+
+    if (hostname.empty()) {
+        // A valid certificate for any name would do
+        missingHostname = SSL_get_verify_mode(ssl) & SSL_VERIFY_PEER;
+        return;
+    }
+
+    // SNI is for names only, not addresses. SSL_set1_host() takes either.
+    struct in6_addr addr;
+    if (inet_pton(AF_INET, hostname.c_str(), &addr) != 1 &&
+        inet_pton(AF_INET6, hostname.c_str(), &addr) != 1) {
+        SSL_set_tlsext_host_name(ssl, hostname.c_str());
+    }
+    SSL_set1_host(ssl, hostname.c_str());
+}
+
+
+NTlsHandshake::~NTlsHandshake() {
+    // Doesn't close the socket, or send anything
+    SSL_free(ssl);
+}
+
+
+int NTlsHandshake::step() {
+    if (missingHostname) {
+        log("%s: no hostname to verify the server certificate against\n", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    ERR_clear_error();
+
+    int ret = SSL_do_handshake(ssl);
+    if (ret == 1) {
+        return 1;
+    }
+
+    int err = SSL_get_error(ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        return 0;
+    }
+
+    long verify = SSL_get_verify_result(ssl);
+    log("%s: TLS handshake failed: %s%s%s\n", __FUNCTION__,
+        ERR_error_string(ERR_get_error(), nullptr),
+        verify == X509_V_OK ? "" : ", ",
+        verify == X509_V_OK ? "" : X509_verify_cert_error_string(verify));
+    return -EPROTO;
+}
+
+
+static vector<uint8_t> hexToBytes(const char *hex, size_t len) {
+    vector<uint8_t> bytes;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        char byte[3] = {hex[i], hex[i + 1], '\0'};
+        bytes.push_back(strtoul(byte, nullptr, 16));
+    }
+
+    return bytes;
+}
+
+
+/*
+ * Lines look like "CLIENT_TRAFFIC_SECRET_0 <client random> <secret>", all in
+ * hex.
+ */
+void NTlsHandshake::onKeyLog(const char *line) {
+    static const char clientLabel[] = "CLIENT_TRAFFIC_SECRET_0 ";
+    static const char serverLabel[] = "SERVER_TRAFFIC_SECRET_0 ";
+
+    vector<uint8_t> *secret = nullptr;
+    if (!strncmp(line, clientLabel, sizeof(clientLabel) - 1)) {
+        secret = &clientSecret;
+    } else if (!strncmp(line, serverLabel, sizeof(serverLabel) - 1)) {
+        secret = &serverSecret;
+    } else {
+        return;
+    }
+
+    const char *hex = strrchr(line, ' ');
+    if (hex) {
+        ++hex;
+        *secret = hexToBytes(hex, strlen(hex));
+    }
+}
+
+
+/*
+ * The TLS 1.3 suites the kernel can take over.
+ */
+struct KtlsCipher {
+    uint16_t suite;
+    uint16_t cipherType;
+    size_t keyLen;
+    const char *digest;
+};
+
+static const KtlsCipher ktlsCiphers[] = {
+    {TLS1_3_CK_AES_128_GCM_SHA256 & 0xffff, TLS_CIPHER_AES_GCM_128,
+     TLS_CIPHER_AES_GCM_128_KEY_SIZE, "SHA256"},
+    {TLS1_3_CK_AES_256_GCM_SHA384 & 0xffff, TLS_CIPHER_AES_GCM_256,
+     TLS_CIPHER_AES_GCM_256_KEY_SIZE, "SHA384"},
+    {TLS1_3_CK_CHACHA20_POLY1305_SHA256 & 0xffff, TLS_CIPHER_CHACHA20_POLY1305,
+     TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE, "SHA256"},
+};
+
+// The write IV, for all of them: the salt, then the kernel's iv
+static const size_t sTls13IvLen = 12;
+
+
+/*
+ * HKDF-Expand-Label from RFC 8446, with an empty context.
+ */
+static bool expandLabel(const char *digest, const vector<uint8_t> &secret,
+                        const char *label, vector<uint8_t> &out) {
+    EVP_KDF *kdf = EVP_KDF_fetch(nullptr, "TLS13-KDF", nullptr);
+    EVP_KDF_CTX *kctx = kdf ? EVP_KDF_CTX_new(kdf) : nullptr;
+    EVP_KDF_free(kdf);
+    if (!kctx) {
+        return false;
+    }
+
+    static const char prefix[] = "tls13 ";
+    int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+                                         const_cast<char *>(digest), 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY,
+                                          const_cast<uint8_t *>(secret.data()),
+                                          secret.size()),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PREFIX,
+                                          const_cast<char *>(prefix), sizeof(prefix) - 1),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_LABEL,
+                                          const_cast<char *>(label), strlen(label)),
+        OSSL_PARAM_construct_end()
+    };
+    int ok = EVP_KDF_derive(kctx, out.data(), out.size(), params);
+    EVP_KDF_CTX_free(kctx);
+
+    return ok == 1;
+}
+
+
+template <typename Info>
+static size_t fillCryptoInfo(Info &info, uint16_t cipherType,
+                             const vector<uint8_t> &key, const vector<uint8_t> &iv) {
+    info.info.version = TLS_1_3_VERSION;
+    info.info.cipher_type = cipherType;
+    memcpy(info.key, key.data(), sizeof(info.key));
+    memcpy(info.salt, iv.data(), sizeof(info.salt));
+    memcpy(info.iv, iv.data() + sizeof(info.salt), sizeof(info.iv));
+    // Application data records start at sequence number 0
+
+    return sizeof(info);
+}
+
+
+static int setKernelKeys(int fd, int direction, const KtlsCipher &cipher,
+                         const vector<uint8_t> &secret) {
+    vector<uint8_t> key(cipher.keyLen);
+    vector<uint8_t> iv(sTls13IvLen);
+    if (!expandLabel(cipher.digest, secret, "key", key) ||
+        !expandLabel(cipher.digest, secret, "iv", iv)) {
+        return -EPROTO;
+    }
+
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    memset(&info, 0, sizeof(info));
+
+    size_t infoLen;
+    switch (cipher.cipherType) {
+    case TLS_CIPHER_AES_GCM_128:
+        infoLen = fillCryptoInfo(info.aes128, cipher.cipherType, key, iv);
+        break;
+    case TLS_CIPHER_AES_GCM_256:
+        infoLen = fillCryptoInfo(info.aes256, cipher.cipherType, key, iv);
+        break;
+    default:
+        infoLen = fillCryptoInfo(info.chacha, cipher.cipherType, key, iv);
+        break;
+    }
+
+    int err = setsockopt(fd, SOL_TLS, direction, &info, infoLen);
+    OPENSSL_cleanse(&info, sizeof(info));
+    OPENSSL_cleanse(key.data(), key.size());
+    OPENSSL_cleanse(iv.data(), iv.size());
+    if (err) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+
+int NTlsHandshake::installKernelKeys() {
+    const SSL_CIPHER *sslCipher = SSL_get_current_cipher(ssl);
+    const KtlsCipher *cipher = nullptr;
+    for (auto &c : ktlsCiphers) {
+        if (sslCipher && SSL_CIPHER_get_protocol_id(sslCipher) == c.suite) {
+            cipher = &c;
+        }
+    }
+    if (!cipher || clientSecret.empty() || serverSecret.empty()) {
+        log("%s: unexpected cipher or missing traffic secrets\n", __FUNCTION__);
+        return -EPROTO;
+    }
+
+    int err = setsockopt(sockfd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+    if (err) {
+        log("%s: failed setsockopt(TCP_ULP, tls): %d\n", __FUNCTION__, errno);
+        return -errno;
+    }
+
+    err = setKernelKeys(sockfd, TLS_TX, *cipher, isServer ? serverSecret : clientSecret);
+    if (!err) {
+        err = setKernelKeys(sockfd, TLS_RX, *cipher, isServer ? clientSecret : serverSecret);
+    }
+    if (err) {
+        log("%s: failed setsockopt(SOL_TLS): %d\n", __FUNCTION__, -err);
+    }
+
+    OPENSSL_cleanse(clientSecret.data(), clientSecret.size());
+    OPENSSL_cleanse(serverSecret.data(), serverSecret.size());
+
+    return err;
+}
+
+
+// Record and handshake message types, RFC 8446
+static const uint8_t sRecordAlert = 21;
+static const uint8_t sRecordHandshake = 22;
+static const uint8_t sRecordData = 23;
+static const uint8_t sNewSessionTicket = 4;
+static const uint8_t sKeyUpdate = 24;
+static const uint8_t sCloseNotify = 0;
+
+
+ssize_t NTlsRecords::recv(int fd, uint8_t *buf, size_t len) {
+    while (true) {
+        uint8_t ctrl[CMSG_SPACE(sizeof(uint8_t))];
+        struct iovec iov = {buf, len};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+
+        ssize_t n = recvmsg(fd, &msg, 0);
+        if (n <= 0) {
+            return n;
+        }
+
+        uint8_t type = sRecordData;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (cm && cm->cmsg_level == SOL_TLS && cm->cmsg_type == TLS_GET_RECORD_TYPE) {
+            type = *CMSG_DATA(cm);
+        }
+
+        switch (onRecord(type, buf, n)) {
+        case Data:
+            return n;
+        case Skip:
+            break;
+        case End:
+            return 0;
+        case Fail:
+            errno = EPROTO;
+            return -1;
+        }
+    }
+}
+
+
+NTlsRecords::Action NTlsRecords::onRecord(uint8_t type, const uint8_t *buf, size_t len) {
+    if (type == sRecordData) {
+        return Data;
+    }
+
+    if (type == sRecordAlert) {
+        for (size_t i = 0; i < len; i++) {
+            alert[alertLen++] = buf[i];
+            if (alertLen < sizeof(alert)) {
+                continue;
+            }
+            alertLen = 0;
+            if (alert[1] != sCloseNotify) {
+                log("%s: TLS alert %u\n", __FUNCTION__, alert[1]);
+                return Fail;
+            }
+            return End;
+        }
+        return Skip;
+    }
+
+    if (type != sRecordHandshake) {
+        log("%s: unexpected TLS record type %u\n", __FUNCTION__, type);
+        return Fail;
+    }
+
+    // Walk the message headers, skipping the bodies
+    size_t i = 0;
+    while (i < len) {
+        if (msgBodyLeft) {
+            size_t skip = min(msgBodyLeft, len - i);
+            msgBodyLeft -= skip;
+            i += skip;
+            continue;
+        }
+
+        msgHeader[msgHeaderLen++] = buf[i++];
+        if (msgHeaderLen < sizeof(msgHeader)) {
+            continue;
+        }
+        msgHeaderLen = 0;
+
+        if (msgHeader[0] != sNewSessionTicket) {
+            log("%s: unsupported post-handshake message %u%s\n", __FUNCTION__,
+                msgHeader[0], msgHeader[0] == sKeyUpdate ? " (KeyUpdate)" : "");
+            return Fail;
+        }
+        msgBodyLeft = (msgHeader[1] << 16) | (msgHeader[2] << 8) | msgHeader[3];
+    }
+
+    return Skip;
+}
+
+}
@@ -0,0 +1,146 @@
+#ifndef _NTLS_H
+#define _NTLS_H
+
+#include <string>
+#include <memory>
+#include <vector>
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include <openssl/ssl.h>
+
+
+namespace nsock {
+
+/*
+ * Kernel TLS (kTLS) support.
+ *
+ * OpenSSL does the handshake on the socket. Once it is done, the TLS 1.3
+ * traffic secrets (captured with the keylog callback) are expanded into
+ * traffic keys with OpenSSL's TLS13-KDF and handed to the kernel with TCP_ULP
+ * "tls", TLS_TX and TLS_RX. From then on the kernel encrypts and decrypts,
+ * NSock sends with plain send(), and receives through NTlsRecords. This is
+ * done here rather than with SSL_OP_ENABLE_KTLS, as OpenSSL 3.0 only
+ * offloads the send side of TLS 1.3.
+ *
+ * Restrictions: TLS 1.3 only, with any of its AES-GCM and ChaCha20-Poly1305
+ * suites (the latter needs Linux 5.11). Our servers don't issue session
+ * tickets; a client skips the ones it gets. KeyUpdate fails the connection.
+ * A socket that splices what it receives (NSock::pipe()) passes the records
+ * through unseen, so it fails on a session ticket instead.
+ */
+
+class NTlsContext;
+typedef std::shared_ptr<NTlsContext> NTlsContextPtr;
+
+class NTlsContext {
+public:
+    /* Server context from PEM certificate and key files */
+    static NTlsContextPtr createServer(const std::string &certFile,
+                                       const std::string &keyFile);
+
+    /* Server context with an in-memory self-signed certificate, for tests */
+    static NTlsContextPtr createSelfSignedServer(const std::string &commonName);
+
+    /*
+     * Client context. Verify the peer against caFile, or the system store,
+     * and check that its certificate is for the hostname passed to
+     * NSock::startTls().
+     */
+    static NTlsContextPtr createClient(bool verifyPeer=true,
+                                       const std::string &caFile="");
+
+    SSL_CTX *get() const {
+        return ctx;
+    }
+
+    /* Constructor - don't call directly, use the create functions */
+    NTlsContext(SSL_CTX *sslCtx) :
+        ctx(sslCtx) {
+    }
+
+    ~NTlsContext();
+
+private:
+    static SSL_CTX *newCtx(bool isServer);
+
+    SSL_CTX *ctx = nullptr;
+};
+
+
+/*
+ * One TLS handshake on a non-blocking socket.
+ */
+class NTlsHandshake {
+public:
+    /*
+     * A client sends hostname as SNI, and, if its context verifies the peer,
+     * fails the handshake unless the certificate matches it. A verifying
+     * client without a hostname fails right away.
+     */
+    NTlsHandshake(NTlsContextPtr ctx, int fd, bool isServer,
+                  const std::string &hostname="");
+    ~NTlsHandshake();
+
+    /*
+     * Make progress on the handshake. Return 1 when it is done, 0 if it is
+     * waiting for the socket, or a negative errno on failure.
+     */
+    int step();
+
+    /* Hand the session keys to the kernel. Return 0 or a negative errno */
+    int installKernelKeys();
+
+    /* Keylog callback: stash the traffic secrets */
+    void onKeyLog(const char *line);
+
+private:
+    NTlsContextPtr tlsCtx;
+    SSL *ssl = nullptr;
+    int sockfd = -1;
+    bool isServer = false;
+    bool missingHostname = false;
+
+    std::vector<uint8_t> clientSecret;
+    std::vector<uint8_t> serverSecret;
+};
+
+
+/*
+ * Receiving on a kTLS socket. The kernel hands over the records of one type
+ * at a time, and a plain recv() fails with EIO on any but application data:
+ * recvmsg() gets the type, and the others are dealt with here.
+ */
+class NTlsRecords {
+public:
+    enum Action {
+        Data,       // application data, pass it on
+        Skip,       // consumed here
+        End,        // close_notify
+        Fail        // anything else
+    };
+
+    /*
+     * Like recv(), for application data only: other records are consumed.
+     * Return 0 on close_notify too, and fail with EPROTO on a record that
+     * can't be handled.
+     */
+    ssize_t recv(int fd, uint8_t *buf, size_t len);
+
+    /* len bytes of a record of type, maybe only part of it */
+    Action onRecord(uint8_t type, const uint8_t *buf, size_t len);
+
+private:
+    // Parse state of the handshake messages and alerts, which may come in
+    // pieces
+    uint8_t msgHeader[4];
+    size_t msgHeaderLen = 0;
+    size_t msgBodyLeft = 0;
+    uint8_t alert[2];
+    size_t alertLen = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,341 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include "nsock.h"
+#include "npoll.h"
+#include "util.h"
+#include "proxyServer.h"
+#include "commandServer.h"
+
+
+using namespace std;
+using namespace nsock;
+using namespace npoll;
+
+
+string ProxyBackend::toString() const {
+    stringstream ss;
+
+    ss << "{"
+       << "backend:\"" << host << ":" << port << "\", "
+       << "activeNr:" << activeNr << ", "
+       << "connNr:" << connNr << ", "
+       << "connectErrorNr:" << connectErrorNr << ", "
+       << "errorNr:" << errorNr << ", "
+       << "upBytes:" << upBytes << ", "
+       << "downBytes:" << downBytes
+       << "}";
+
+    return ss.str();
+}
+
+
+ProxyServer::ProxyServer(const vector<ProxyBackend> &backends, ProxyBalance balance) :
+    mBackends(backends), mBalance(balance), mRandom(random_device()()) {
+}
+
+ProxyServer::~ProxyServer() {
+}
+
+
+ProxyServerPtr ProxyServer::createProxyServer(string host, unsigned short port,
+                                              const vector<ProxyBackend> &backends,
+                                              ProxyBalance balance) {
+    ProxyServerPtr server = make_shared<ProxyServer>(backends, balance);
+
+    NSockOnConnectFunc connCb = [=] (NSockPtr sock) {
+        server->onConnect(sock);
+    };
+    server->mListenSock = NSock::listen(host, port, connCb);
+    if (!server->mListenSock) {
+        return nullptr;
+    }
+    printf("ProxyServer now listening on %s:%d\n", host.c_str(), port);
+
+    // Each direction ends on its own
+    server->mListenSock->setAllowHalfOpen(true);
+
+    return server;
+}
+
+string ProxyServer::getProxyStats() const {
+    stringstream ss;
+
+    ss << "{\n";
+    ss << "listenSocket: " << mListenSock->getStats().toString() << ",\n";
+    ss << "backends: [";
+    for (size_t i = 0; i < mBackends.size(); i++) {
+        ss << (i ? ",\n" : "") << mBackends[i].toString();
+    }
+    ss << "]\n";
+    ss << "}\n";
+
+    return ss.str();
+}
+
+void ProxyServer::serverLoop() {
+    bool exit = false;
+
+    EofFunc eofCb = [&]() {
+        log("%s: Got EoF, exiting...\n", __FUNCTION__);
+        exit = true;
+    };
+
+    CommandServer cmdServer(eofCb);
+    auto self = shared_from_this();
+    auto getStatsCb = [=] (const NRequest &req) {
+        return self->getProxyStats();
+    };
+
+    cmdServer.addCommand("get-stats", getStatsCb);
+
+    cmdServer.monitorStdin();
+
+    npollLoop(exit);
+
+    for (auto &conn : mConnections) {
+        conn->client->destroy();
+        conn->upstream->destroy();
+    }
+    mConnections.clear();
+
+    if (mListenSock) {
+        mListenSock->end();
+        mListenSock = nullptr;
+    }
+}
+
+
+size_t ProxyServer::pickBackend() {
+    size_t n = mBackends.size();
+
+    switch (mBalance) {
+    case ProxyLeastConn: {
+        // Ties go round robin, so an idle pool still spreads the load
+        size_t best = mNextBackend % n;
+        for (size_t i = 1; i < n; i++) {
+            size_t idx = (mNextBackend + i) % n;
+            if (mBackends[idx].activeNr < mBackends[best].activeNr) {
+                best = idx;
+            }
+        }
+        mNextBackend = best + 1;
+        return best;
+    }
+
+    case ProxyPowerOfTwo: {
+        if (n == 1) {
+            return 0;
+        }
+        size_t a = mRandom() % n;
+        size_t b = mRandom() % (n - 1);
+        if (b >= a) {
+            ++b;
+        }
+        return mBackends[b].activeNr < mBackends[a].activeNr ? b : a;
+    }
+
+    default:
+        return mNextBackend++ % n;
+    }
+}
+
+
+/*
+ * A connection is done: both directions ended, or something failed.
+ */
+void ProxyServer::finish(ProxyConnPtr conn, bool failed) {
+    if (mConnections.erase(conn) == 0) {
+        return;
+    }
+
+    auto &backend = mBackends[conn->backend];
+    --backend.activeNr;
+    backend.upBytes += conn->client->getStats().recvBytes;
+    if (conn->upstream) {
+        backend.downBytes += conn->upstream->getStats().recvBytes;
+    }
+
+    if (failed) {
+        ++backend.errorNr;
+        conn->client->destroy();
+        if (conn->upstream) {
+            conn->upstream->destroy();
+        }
+    }
+
+    // Otherwise both sides close themselves, once their pipes are drained
+}
+
+
+void ProxyServer::onSocketEnd(ProxyConnPtr conn, NSockPtr sock) {
+    log("%s: nsock peer done: nsockId=%lu\n", __FUNCTION__, sock->getId());
+
+    // Pass the half-close on, after what is still in the pipe
+    auto other = (sock == conn->client) ? conn->upstream : conn->client;
+    other->shutdown();
+
+    if (conn->client->isReadShut() && conn->upstream->isReadShut()) {
+        finish(conn, false);
+    }
+}
+
+void ProxyServer::onSocketError(ProxyConnPtr conn, NSockPtr sock, int error) {
+    log("%s: nsock error: nsockId=%lu, error=%d\n", __FUNCTION__,
+        sock->getId(), error);
+
+    if (sock == conn->upstream && !conn->connected) {
+        ++mBackends[conn->backend].connectErrorNr;
+    }
+
+    finish(conn, true);
+}
+
+void ProxyServer::onUpstreamConnect(ProxyConnPtr conn) {
+    log("%s: upstream nsock %lu connected\n", __FUNCTION__, conn->upstream->getId());
+    conn->connected = true;
+}
+
+void ProxyServer::onConnect(NSockPtr sock) {
+    log("%s: client nsock %lu connected\n", __FUNCTION__, sock->getId());
+
+    auto conn = make_shared<ProxyConn>();
+    conn->client = sock;
+    conn->backend = pickBackend();
+
+    auto &backend = mBackends[conn->backend];
+    ++backend.connNr;
+    ++backend.activeNr;
+    mConnections.insert(conn);
+
+    // The callbacks hold the connection weakly: it holds the sockets
+    auto self = shared_from_this();
+    weak_ptr<ProxyConn> weakConn = conn;
+    NSockOnErrorFunc errorCb = [=] (NSockPtr sock, int error) {
+        auto conn = weakConn.lock();
+        if (conn) {
+            self->onSocketError(conn, sock, error);
+        }
+    };
+    NSockOnEndFunc endCb = [=] (NSockPtr sock) {
+        auto conn = weakConn.lock();
+        if (conn) {
+            self->onSocketEnd(conn, sock);
+        }
+    };
+    NSockOnConnectFunc upConnCb = [=] (NSockPtr sock) {
+        auto conn = weakConn.lock();
+        if (conn) {
+            self->onUpstreamConnect(conn);
+        }
+    };
+
+    sock->setErrorFn(errorCb);
+    sock->setEndFn(endCb);
+
+    conn->upstream = NSock::connectAsync(backend.host, backend.port, upConnCb, errorCb);
+    if (!conn->upstream) {
+        log("%s: failed to connect to %s:%d\n", __FUNCTION__,
+            backend.host.c_str(), backend.port);
+        ++backend.connectErrorNr;
+        finish(conn, true);
+        return;
+    }
+    conn->upstream->setEndFn(endCb);
+    conn->upstream->setAllowHalfOpen(true);
+
+    // Data from the client waits in the pipe until the upstream connects
+    int err = sock->pipe(conn->upstream);
+    if (!err) {
+        err = conn->upstream->pipe(sock);
+    }
+    if (err) {
+        log("%s: failed to pipe: %d\n", __FUNCTION__, err);
+        finish(conn, true);
+    }
+}
+
+
+static bool parseBackend(const string &arg, ProxyBackend &backend) {
+    size_t colon = arg.rfind(':');
+    if (colon == string::npos || colon == 0) {
+        return false;
+    }
+
+    backend.host = arg.substr(0, colon);
+    try {
+        backend.port = stoi(arg.substr(colon + 1));
+    } catch (const exception &e) {
+        return false;
+    }
+
+    return true;
+}
+
+
+int main(int argc, char *argv[]) {
+    string host = "localhost";
+    unsigned short port = 12122;
+    vector<ProxyBackend> backends;
+    ProxyBalance balance = ProxyRoundRobin;
+
+    auto usage = [&] () {
+        printf("%s: [-h host] [-p port] [-a rr|lc|p2c] -b backendHost:port [-b ...]\n",
+               argv[0]);
+        return -1;
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:b:a:")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = stoi(optarg);
+            break;
+        case 'b': {
+            ProxyBackend backend;
+            if (!parseBackend(optarg, backend)) {
+                return usage();
+            }
+            backends.push_back(backend);
+            break;
+        }
+        case 'a':
+            if (string(optarg) == "rr") {
+                balance = ProxyRoundRobin;
+            } else if (string(optarg) == "lc") {
+                balance = ProxyLeastConn;
+            } else if (string(optarg) == "p2c") {
+                balance = ProxyPowerOfTwo;
+            } else {
+                return usage();
+            }
+            break;
+        default:
+            return usage();
+        }
+    }
+
+    if (backends.empty()) {
+        return usage();
+    }
+
+    logSetPath("/tmp/nsock/proxyServer");
+
+    log("%s: starting...\n", argv[0]);
+
+    ProxyServerPtr server = ProxyServer::createProxyServer(host, port, backends, balance);
+    if (!server) {
+        printf("Failed to listen on %s:%d\n", host.c_str(), port);
+        return -1;
+    }
+
+    server->serverLoop();
+
+    cout << "Good bye\n";
+}
@@ -0,0 +1,87 @@
+#ifndef _PROXY_SERVER_H
+#define _PROXY_SERVER_H
+
+#include <vector>
+#include <memory>
+#include <set>
+#include <string>
+#include <random>
+
+#include "nsock.h"
+#include "npoll.h"
+#include "util.h"
+
+
+/*
+ * A TCP proxy: each client connection gets an upstream connection to one of
+ * the backends, and the two are spliced together both ways (NSock::pipe()),
+ * with end-of-stream passed through as a half-close.
+ */
+
+enum ProxyBalance {
+    ProxyRoundRobin = 0,
+    ProxyLeastConn,         // fewest connections in flight
+    ProxyPowerOfTwo         // the less busy of two picked at random
+};
+
+struct ProxyBackend {
+    std::string host;
+    unsigned short port = 0;
+
+    // connections in flight, and in total
+    uint64_t activeNr = 0;
+    uint64_t connNr = 0;
+    uint64_t connectErrorNr = 0;
+    uint64_t errorNr = 0;
+
+    // of finished connections
+    uint64_t upBytes = 0;
+    uint64_t downBytes = 0;
+
+    std::string toString() const;
+};
+
+struct ProxyConn {
+    nsock::NSockPtr client;
+    nsock::NSockPtr upstream;
+    size_t backend = 0;
+    bool connected = false;
+};
+typedef std::shared_ptr<ProxyConn> ProxyConnPtr;
+
+
+class ProxyServer;
+typedef std::shared_ptr<ProxyServer> ProxyServerPtr;
+
+class ProxyServer : public std::enable_shared_from_this<ProxyServer> {
+public:
+    ProxyServer(const std::vector<ProxyBackend> &backends, ProxyBalance balance);
+    ~ProxyServer();
+
+    static ProxyServerPtr createProxyServer(std::string host, unsigned short port,
+                                            const std::vector<ProxyBackend> &backends,
+                                            ProxyBalance balance=ProxyRoundRobin);
+    void serverLoop();
+    std::string getProxyStats() const;
+
+private:
+    /* The socket callbacks */
+    void onConnect(nsock::NSockPtr sock);
+    void onUpstreamConnect(ProxyConnPtr conn);
+    void onSocketEnd(ProxyConnPtr conn, nsock::NSockPtr sock);
+    void onSocketError(ProxyConnPtr conn, nsock::NSockPtr sock, int error);
+
+    size_t pickBackend();
+    void finish(ProxyConnPtr conn, bool failed);
+
+    std::vector<ProxyBackend> mBackends;
+    ProxyBalance mBalance;
+    size_t mNextBackend = 0;
+    std::mt19937 mRandom;
+
+    nsock::NSockPtr mListenSock;
+    std::set<ProxyConnPtr> mConnections;
+};
+
+
+#endif
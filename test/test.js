@@ -20,7 +20,9 @@ function startConnections(opts) {
         });
         const avg = sum / connStats.length;
 
-        console.log(`Connections: ${opts.connNr}, Average response time: ${avg}, No response conns: ${noRespNr}`);
+        const transport = opts.unixPath ? `unix:${opts.unixPath}` : `tcp:${echoServerHost}:${echoServerPort}`;
+        console.log(`Transport: ${transport}, Connections: ${opts.connNr}, Rounds: ${opts.rounds}, Average response time: ${avg}, No response conns: ${noRespNr}`);
+        console.log(`Total elapsed ms: ${Date.now() - startTime}`);
     };
 
     const statObj = {
@@ -31,9 +33,10 @@ function startConnections(opts) {
         return JSON.parse(JSON.stringify(statObj));
     });
 
+    const startTime = Date.now();
     let doneNr = 0;
     _.times(opts.connNr, (idx) => {
-        connectAndSend(idx + 1, (respTime) => {
+        connectAndSend(idx + 1, opts, (respTime) => {
             connStats[idx].respTimeMs = respTime;
             ++doneNr;
             if (doneNr === opts.connNr) {
@@ -44,25 +47,38 @@ function startConnections(opts) {
 }
 
 
-function connectAndSend(clientIdx, doneCb) {
+/*
+ * Send a message and wait for the echo, opts.rounds times. Report the average
+ * response time per round.
+ */
+function connectAndSend(clientIdx, opts, doneCb) {
     const msgLen = 32;
     const message = '0'.repeat(msgLen) + `${clientIdx}`.slice(-msgLen);
 
     const before = Date.now();
-    let sock = net.createConnection(echoServerPort, echoServerHost, () => {
+    const onConnected = () => {
         console.log(`Client ${clientIdx} connected.`);
 
         sock.write(message);
-    });
+    };
+    let sock = opts.unixPath ?
+        net.createConnection(opts.unixPath, onConnected) :
+        net.createConnection(echoServerPort, echoServerHost, onConnected);
 
     let recvMsg = '';
+    let round = 0;
     sock.on('data', (data) => {
         recvMsg += data;
         if (!message.startsWith(recvMsg)) {
             console.error(`Connection ${clientIdx}: Mismatched echo response!!!!!`);
         } else if (message.length === recvMsg.length) {
+            recvMsg = '';
+            if (++round < opts.rounds) {
+                sock.write(message);
+                return;
+            }
             sock.end();
-            doneCb(Date.now() - before);
+            doneCb((Date.now() - before) / opts.rounds);
         }
     });
 
@@ -80,13 +96,25 @@ function connectAndSend(clientIdx, doneCb) {
     var argv = require('minimist')(process.argv.slice(2));
 
     const opts = {
-        connNr: 10
+        connNr: 10,
+        rounds: 1,
+        unixPath: null
     };
 
     if (argv.connNr) {
         opts.connNr = argv.connNr;
     }
 
+    if (argv.rounds) {
+        opts.rounds = argv.rounds;
+    }
+
+    // Compare loopback TCP with a unix domain socket: start echoServer with
+    // -u <path> and run with --unixPath <path>.
+    if (argv.unixPath) {
+        opts.unixPath = argv.unixPath;
+    }
+
     startConnections(opts);
 
 })();